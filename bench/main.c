@@ -0,0 +1,735 @@
+//
+//  main.c
+//  bench
+//
+
+// Benchmarks for the coroutine library.  Each benchmark runs its operation
+// in batches and times each batch, so the percentiles are of the time per
+// operation within a batch (for the HTTP benchmark a batch is one request).
+// Results are printed as a table or, with -j, as one JSON object per line
+// so that runs can be collected and compared over time.
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitset.h"
+#include "buffer.h"
+#include "coroutine.h"
+#include "dstring.h"
+#include "hashmap.h"
+#include "http.h"
+#include "map.h"
+#include "vector.h"
+
+#define kMaxSamples 100000
+#define kMinSamples 100
+
+typedef struct {
+  const char* name;
+  size_t param;        // Size the benchmark was run with, or 0.
+  uint64_t* samples;   // Nanoseconds per operation in each batch.
+  size_t num_samples;
+  uint64_t ops;
+  uint64_t elapsed;    // Total of the timed batches, in nanoseconds.
+  uint64_t wall_time;  // Whole benchmark, including untimed setup.
+} Result;
+
+typedef struct {
+  bool json;
+  const char* filter;
+  uint64_t budget;  // Time to spend on each benchmark, in nanoseconds.
+  CoroutinePollerType poller;
+  const char* server;  // Path of http_server.
+  int port;
+  int connections;
+  int server_machines;
+} Options;
+
+static Options options = {.budget = 500000000,
+                          .poller = kCoDefaultPoller,
+                          .server = "./http_server",
+                          .port = 8097,
+                          .connections = 16,
+                          .server_machines = 1};
+
+// Stops the compiler throwing away results.
+static volatile int64_t sink;
+
+static uint64_t Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool Selected(const char* name) {
+  return options.filter == NULL || strstr(name, options.filter) != NULL;
+}
+
+static void ResultInit(Result* r, const char* name, size_t param) {
+  memset(r, 0, sizeof(*r));
+  r->name = name;
+  r->param = param;
+  r->samples = malloc(sizeof(uint64_t) * kMaxSamples);
+  r->wall_time = Now();
+}
+
+// Returns true while the benchmark should run more batches: until it has
+// used its time budget, but with at least kMinSamples.
+static bool ResultMore(Result* r) {
+  if (r->num_samples >= kMaxSamples) {
+    return false;
+  }
+  return r->num_samples < kMinSamples || r->elapsed < options.budget;
+}
+
+// Records a batch of 'ops' operations that started at 'start'.
+static void ResultAdd(Result* r, uint64_t start, uint64_t ops) {
+  uint64_t t = Now() - start;
+  r->elapsed += t;
+  r->ops += ops;
+  if (r->num_samples < kMaxSamples) {
+    r->samples[r->num_samples++] = t / ops;
+  }
+}
+
+static int CompareSamples(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t Percentile(Result* r, double p) {
+  size_t i = (size_t)(p * r->num_samples);
+  return r->samples[i < r->num_samples ? i : r->num_samples - 1];
+}
+
+static void ResultReport(Result* r) {
+  r->wall_time = Now() - r->wall_time;
+  if (r->num_samples == 0) {
+    free(r->samples);
+    return;
+  }
+  qsort(r->samples, r->num_samples, sizeof(uint64_t), CompareSamples);
+  double ns_per_op = (double)r->elapsed / r->ops;
+  double ops_per_sec = r->ops * 1e9 / r->elapsed;
+  if (options.json) {
+    printf(
+        "{\"benchmark\":\"%s\",\"param\":%zu,\"ops\":%llu,"
+        "\"samples\":%zu,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f,"
+        "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+        "\"max_ns\":%llu,\"wall_ms\":%llu}\n",
+        r->name, r->param, (unsigned long long)r->ops, r->num_samples,
+        ns_per_op, ops_per_sec, (unsigned long long)Percentile(r, 0.5),
+        (unsigned long long)Percentile(r, 0.99),
+        (unsigned long long)Percentile(r, 0.999),
+        (unsigned long long)r->samples[r->num_samples - 1],
+        (unsigned long long)(r->wall_time / 1000000));
+  } else {
+    char name[64];
+    if (r->param != 0) {
+      snprintf(name, sizeof(name), "%s/%zu", r->name, r->param);
+    } else {
+      snprintf(name, sizeof(name), "%s", r->name);
+    }
+    printf("%-24s %12.1f %12.0f %10llu %10llu %10llu\n", name, ns_per_op,
+           ops_per_sec, (unsigned long long)Percentile(r, 0.5),
+           (unsigned long long)Percentile(r, 0.99),
+           (unsigned long long)Percentile(r, 0.999));
+  }
+  fflush(stdout);
+  free(r->samples);
+}
+
+static void MachineInit(CoroutineMachine* m) {
+  CoroutineMachineInitWithPoller(m, options.poller);
+}
+
+// Coroutine switches.
+
+typedef struct {
+  Result* result;
+  size_t batch;
+  bool done;
+} SwitchData;
+
+// Yields to the other coroutine and back, timing the switches.
+static void Pinger(Coroutine* c) {
+  SwitchData* data = CoroutineGetUserData(c);
+  while (ResultMore(data->result)) {
+    uint64_t start = Now();
+    for (size_t i = 0; i < data->batch; i++) {
+      CoroutineYield(c);
+    }
+    // Each yield was two switches, there and back.
+    ResultAdd(data->result, start, data->batch * 2);
+  }
+  data->done = true;
+}
+
+static void Ponger(Coroutine* c) {
+  SwitchData* data = CoroutineGetUserData(c);
+  while (!data->done) {
+    CoroutineYield(c);
+  }
+}
+
+static void BenchYield(void) {
+  Result r;
+  ResultInit(&r, "yield", 0);
+  SwitchData data = {.result = &r, .batch = 100};
+  CoroutineMachine m;
+  MachineInit(&m);
+  CoroutineStart(NewCoroutineWithUserData(&m, Pinger, &data));
+  CoroutineStart(NewCoroutineWithUserData(&m, Ponger, &data));
+  CoroutineMachineRun(&m);
+  CoroutineMachineDestruct(&m);
+  ResultReport(&r);
+}
+
+// Generators.
+
+static void Counter(Coroutine* c) {
+  for (int64_t i = 0;; i++) {
+    CoroutineYieldValue(c, &i);
+  }
+}
+
+static void Caller(Coroutine* c) {
+  Result* r = CoroutineGetUserData(c);
+  Coroutine* generator = NewCoroutine(c->machine, Counter);
+  const size_t kBatch = 100;
+  while (ResultMore(r)) {
+    uint64_t start = Now();
+    for (size_t i = 0; i < kBatch; i++) {
+      int64_t value;
+      CoroutineCall(c, generator, &value, sizeof(value));
+      sink = value;
+    }
+    ResultAdd(r, start, kBatch);
+  }
+  CoroutineMachineStop(c->machine);
+}
+
+static void BenchGenerator(void) {
+  Result r;
+  ResultInit(&r, "generator", 0);
+  CoroutineMachine m;
+  MachineInit(&m);
+  CoroutineStart(NewCoroutineWithUserData(&m, Caller, &r));
+  CoroutineMachineRun(&m);
+  CoroutineMachineDestruct(&m);
+  ResultReport(&r);
+}
+
+// Spawning coroutines that exit at once.
+
+static size_t num_exited;
+
+static void Empty(Coroutine* c) { num_exited++; }
+
+static void Spawner(Coroutine* c) {
+  Result* r = CoroutineGetUserData(c);
+  const size_t kBatch = 100;
+  while (ResultMore(r)) {
+    uint64_t start = Now();
+    num_exited = 0;
+    for (size_t i = 0; i < kBatch; i++) {
+      CoroutineStart(NewCoroutine(c->machine, Empty));
+    }
+    while (num_exited < kBatch) {
+      CoroutineYield(c);
+    }
+    ResultAdd(r, start, kBatch);
+  }
+}
+
+static void BenchSpawn(void) {
+  Result r;
+  ResultInit(&r, "spawn", 0);
+  CoroutineMachine m;
+  MachineInit(&m);
+  CoroutineStart(NewCoroutineWithUserData(&m, Spawner, &r));
+  CoroutineMachineRun(&m);
+  CoroutineMachineDestruct(&m);
+  ResultReport(&r);
+}
+
+// Switching while coroutines are parked waiting for fds.  Each waits on
+// its own dup of the read end of a pipe, so they are all woken when the
+// pipe is written to at the end.
+
+static void Parked(Coroutine* c) {
+  int fd = (int)(intptr_t)CoroutineGetUserData(c);
+  CoroutineWait(c, fd, POLLIN);
+  CoroutineClose(c, fd);
+}
+
+typedef struct {
+  SwitchData data;
+  int pipe_fd;
+} ParkedData;
+
+static void ParkedPinger(Coroutine* c) {
+  ParkedData* data = CoroutineGetUserData(c);
+  Pinger(c);
+  // Wakes the parked coroutines.
+  ssize_t n = write(data->pipe_fd, "x", 1);
+  (void)n;
+}
+
+// Raises the fd limit as far as possible and returns it.
+static size_t RaiseFdLimit(void) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return 0;
+  }
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  getrlimit(RLIMIT_NOFILE, &limit);
+  return limit.rlim_cur;
+}
+
+static void BenchParked(size_t num_parked) {
+  if (num_parked + 64 > RaiseFdLimit()) {
+    fprintf(stderr, "skipping parked/%zu: not enough file descriptors\n",
+            num_parked);
+    return;
+  }
+  int pipes[2];
+  if (pipe(pipes) != 0) {
+    perror("pipe");
+    return;
+  }
+  Result r;
+  ResultInit(&r, "parked", num_parked);
+  CoroutineMachine m;
+  MachineInit(&m);
+  for (size_t i = 0; i < num_parked; i++) {
+    int fd = dup(pipes[0]);
+    if (fd == -1) {
+      perror("dup");
+      abort();
+    }
+    CoroutineStart(NewCoroutineWithUserData(&m, Parked, (void*)(intptr_t)fd));
+  }
+  ParkedData data = {.data = {.result = &r,
+                              .batch = num_parked >= 10000 ? 10 : 100},
+                     .pipe_fd = pipes[1]};
+  // Get them all parked before timing.
+  CoroutineStart(NewCoroutineWithUserData(&m, ParkedPinger, &data));
+  CoroutineStart(NewCoroutineWithUserData(&m, Ponger, &data.data));
+  CoroutineMachineRun(&m);
+  CoroutineMachineDestruct(&m);
+  close(pipes[0]);
+  close(pipes[1]);
+  ResultReport(&r);
+}
+
+// Data structures.  A batch is a round of operations on 'n' elements.
+
+static void BenchMap(size_t n) {
+  Result insert, find;
+  ResultInit(&insert, "map_insert", n);
+  ResultInit(&find, "map_find", n);
+  Map map;
+  MapInitForInt64Keys(&map);
+  srandom(1);
+  int64_t* keys = malloc(sizeof(int64_t) * n);
+  while (ResultMore(&insert) || ResultMore(&find)) {
+    MapClear(&map);
+    for (size_t i = 0; i < n; i++) {
+      keys[i] = random();
+    }
+    uint64_t start = Now();
+    for (size_t i = 0; i < n; i++) {
+      MapInsert(&map, (MapKeyValue){.key.w = keys[i], .value.w = i});
+    }
+    ResultAdd(&insert, start, n);
+    start = Now();
+    for (size_t i = 0; i < n; i++) {
+      sink = (int64_t)MapFindInt64Key(&map, keys[i]);
+    }
+    ResultAdd(&find, start, n);
+  }
+  free(keys);
+  MapDestruct(&map);
+  ResultReport(&insert);
+  ResultReport(&find);
+}
+
+static void BenchHashMap(size_t n) {
+  Result insert, find;
+  ResultInit(&insert, "hashmap_insert", n);
+  ResultInit(&find, "hashmap_find", n);
+  HashMap map;
+  HashMapInitForInt64Keys(&map);
+  srandom(1);
+  int64_t* keys = malloc(sizeof(int64_t) * n);
+  while (ResultMore(&insert) || ResultMore(&find)) {
+    HashMapClear(&map);
+    for (size_t i = 0; i < n; i++) {
+      keys[i] = random();
+    }
+    uint64_t start = Now();
+    for (size_t i = 0; i < n; i++) {
+      HashMapInsert(&map, (MapKeyValue){.key.w = keys[i], .value.w = i});
+    }
+    ResultAdd(&insert, start, n);
+    start = Now();
+    for (size_t i = 0; i < n; i++) {
+      sink = (int64_t)HashMapFindInt64Key(&map, keys[i]);
+    }
+    ResultAdd(&find, start, n);
+  }
+  free(keys);
+  HashMapDestruct(&map);
+  ResultReport(&insert);
+  ResultReport(&find);
+}
+
+static void BenchVector(size_t n) {
+  Result append, get;
+  ResultInit(&append, "vector_append", n);
+  ResultInit(&get, "vector_get", n);
+  Vector vec;
+  VectorInit(&vec);
+  while (ResultMore(&append) || ResultMore(&get)) {
+    VectorClear(&vec);
+    uint64_t start = Now();
+    for (size_t i = 0; i < n; i++) {
+      VectorAppend(&vec, (void*)(intptr_t)i);
+    }
+    ResultAdd(&append, start, n);
+    start = Now();
+    for (size_t i = 0; i < n; i++) {
+      sink = (intptr_t)VectorGet(&vec, i);
+    }
+    ResultAdd(&get, start, n);
+  }
+  VectorDestruct(&vec);
+  ResultReport(&append);
+  ResultReport(&get);
+}
+
+static void BenchBitSet(size_t n) {
+  Result insert, find;
+  ResultInit(&insert, "bitset_insert", n);
+  ResultInit(&find, "bitset_find_clear", n);
+  BitSet set;
+  BitSetInit(&set);
+  while (ResultMore(&insert) || ResultMore(&find)) {
+    BitSetClear(&set);
+    uint64_t start = Now();
+    for (size_t i = 0; i < n; i++) {
+      BitSetInsert(&set, i);
+    }
+    ResultAdd(&insert, start, n);
+    // Like allocating coroutine ids: remove one and find it again.
+    const size_t kFinds = 100;
+    start = Now();
+    for (size_t i = 0; i < kFinds; i++) {
+      BitSetRemove(&set, n - 1 - i);
+      sink = BitSetFindFirstClear(&set);
+      BitSetInsert(&set, n - 1 - i);
+    }
+    ResultAdd(&find, start, kFinds);
+  }
+  BitSetDestruct(&set);
+  ResultReport(&insert);
+  ResultReport(&find);
+}
+
+static void BenchString(size_t n) {
+  Result append, format;
+  ResultInit(&append, "string_append", n);
+  ResultInit(&format, "string_printf", n);
+  String s = {0};
+  String t = {0};
+  while (ResultMore(&append) || ResultMore(&format)) {
+    StringClear(&s);
+    uint64_t start = Now();
+    for (size_t i = 0; i < n; i++) {
+      StringAppend(&s, "abcdefgh");
+    }
+    ResultAdd(&append, start, n);
+    start = Now();
+    for (size_t i = 0; i < n; i++) {
+      StringPrintf(&t, "co-%zu", i);
+    }
+    ResultAdd(&format, start, n);
+    sink = s.length + t.length;
+  }
+  StringDestruct(&s);
+  StringDestruct(&t);
+  ResultReport(&append);
+  ResultReport(&format);
+}
+
+// HTTP requests to http_server, in a closed loop over a number of
+// keep-alive connections.  Each sample is the latency of one request.
+
+typedef struct {
+  Result* result;
+  const char* path;
+  uint64_t end;  // When to stop sending requests.
+  bool failed;
+} HttpData;
+
+static int ConnectToServer(Coroutine* c) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(options.port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (CoroutineConnect(c, fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    CoroutineClose(c, fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Reads a whole response into the buffer.  Returns false on error.
+static bool ReadResponse(Coroutine* c, int fd, Buffer* buffer) {
+  BufferClear(buffer);
+  HttpParser parser;
+  HttpParserInit(&parser);
+  const size_t kReadSize = 16384;
+  size_t needed = 0;  // Length of the whole response, once known.
+  for (;;) {
+    if (needed == 0) {
+      HttpParseStatus status =
+          HttpParserParse(&parser, buffer->value, buffer->length);
+      if (status == kCoHttpInvalid) {
+        return false;
+      }
+      if (status == kCoHttpComplete) {
+        HttpSlice v;
+        if (!HttpParserFindHeader(&parser, buffer->value, "Content-Length",
+                                  &v)) {
+          return false;
+        }
+        needed = parser.length + HttpSliceToInt(buffer->value, v);
+      }
+    }
+    if (needed != 0 && buffer->length >= needed) {
+      return true;
+    }
+    size_t old_length = buffer->length;
+    BufferAddSpace(buffer, kReadSize);
+    ssize_t n = CoroutineRead(c, fd, &buffer->value[old_length], kReadSize);
+    if (n <= 0) {
+      buffer->length = old_length;
+      return false;
+    }
+    buffer->length = old_length + n;
+  }
+}
+
+static void HttpClient(Coroutine* c) {
+  HttpData* data = CoroutineGetUserData(c);
+  int fd = ConnectToServer(c);
+  if (fd == -1) {
+    data->failed = true;
+    return;
+  }
+  String request = {0};
+  StringPrintf(&request, "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n",
+               data->path);
+  Buffer buffer = {0};
+  while (Now() < data->end && data->result->num_samples < kMaxSamples) {
+    uint64_t start = Now();
+    if (CoroutineWrite(c, fd, request.value, request.length) !=
+            (ssize_t)request.length ||
+        !ReadResponse(c, fd, &buffer)) {
+      data->failed = true;
+      break;
+    }
+    ResultAdd(data->result, start, 1);
+  }
+  StringDestruct(&request);
+  BufferDestruct(&buffer);
+  CoroutineClose(c, fd);
+}
+
+// Waits for the server's port to accept connections.
+static bool WaitForServer(void) {
+  for (int i = 0; i < 500; i++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(options.port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int e = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+    close(fd);
+    if (e == 0) {
+      return true;
+    }
+    usleep(10000);
+  }
+  return false;
+}
+
+static void BenchHttp(size_t file_size) {
+  if (access(options.server, X_OK) != 0) {
+    fprintf(stderr, "skipping http: no server at %s\n", options.server);
+    return;
+  }
+  char path[] = "/tmp/co_bench_XXXXXX";
+  int file_fd = mkstemp(path);
+  if (file_fd == -1) {
+    perror("mkstemp");
+    return;
+  }
+  char* contents = malloc(file_size);
+  memset(contents, 'x', file_size);
+  ssize_t n = write(file_fd, contents, file_size);
+  free(contents);
+  close(file_fd);
+  if (n != (ssize_t)file_size) {
+    unlink(path);
+    return;
+  }
+
+  char port[16];
+  char machines[16];
+  snprintf(port, sizeof(port), "%d", options.port);
+  snprintf(machines, sizeof(machines), "%d", options.server_machines);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // The server logs every request.
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    execl(options.server, options.server, "-p", port, "-n", machines,
+          (char*)NULL);
+    perror("exec");
+    _exit(1);
+  }
+  if (pid == -1 || !WaitForServer()) {
+    fprintf(stderr, "skipping http: server didn't start\n");
+  } else {
+    Result r;
+    ResultInit(&r, "http", file_size);
+    HttpData data = {
+        .result = &r, .path = path, .end = Now() + options.budget * 4};
+    CoroutineMachine m;
+    MachineInit(&m);
+    for (int i = 0; i < options.connections; i++) {
+      CoroutineStart(NewCoroutineWithUserData(&m, HttpClient, &data));
+    }
+    CoroutineMachineRun(&m);
+    CoroutineMachineDestruct(&m);
+    // With several connections the batches overlap, so the rate is of the
+    // requests made in the time.
+    r.elapsed = Now() - r.wall_time;
+    if (data.failed) {
+      fprintf(stderr, "http: some requests failed\n");
+    }
+    ResultReport(&r);
+  }
+  if (pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+  unlink(path);
+}
+
+static void Usage(void) {
+  fprintf(stderr,
+          "usage: co_bench [-j] [-f filter] [-t milliseconds] "
+          "[-P poll|native|uring] [-s http_server] [-p port] "
+          "[-c connections] [-n server machines]\n");
+  exit(1);
+}
+
+int main(int argc, const char* argv[]) {
+  // Unbuffered streams format onto the stack through a BUFSIZ buffer, which
+  // would overflow a coroutine's stack.
+  setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+  signal(SIGPIPE, SIG_IGN);
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "-j") == 0) {
+      options.json = true;
+    } else if (strcmp(argv[i], "-f") == 0 && has_value) {
+      options.filter = argv[++i];
+    } else if (strcmp(argv[i], "-t") == 0 && has_value &&
+               isdigit(argv[i + 1][0])) {
+      options.budget = strtoull(argv[++i], NULL, 10) * 1000000;
+    } else if (strcmp(argv[i], "-P") == 0 && has_value) {
+      i++;
+      if (strcmp(argv[i], "poll") == 0) {
+        options.poller = kCoPollerPoll;
+      } else if (strcmp(argv[i], "native") == 0) {
+        options.poller = kCoPollerNative;
+      } else if (strcmp(argv[i], "uring") == 0) {
+        options.poller = kCoPollerUring;
+      } else {
+        Usage();
+      }
+    } else if (strcmp(argv[i], "-s") == 0 && has_value) {
+      options.server = argv[++i];
+    } else if (strcmp(argv[i], "-p") == 0 && has_value &&
+               isdigit(argv[i + 1][0])) {
+      options.port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0 && has_value &&
+               isdigit(argv[i + 1][0])) {
+      options.connections = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0 && has_value &&
+               isdigit(argv[i + 1][0])) {
+      options.server_machines = atoi(argv[++i]);
+    } else {
+      Usage();
+    }
+  }
+  if (!options.json) {
+    printf("%-24s %12s %12s %10s %10s %10s\n", "benchmark", "ns/op", "ops/s",
+           "p50", "p99", "p999");
+  }
+
+  if (Selected("yield")) {
+    BenchYield();
+  }
+  if (Selected("generator")) {
+    BenchGenerator();
+  }
+  if (Selected("spawn")) {
+    BenchSpawn();
+  }
+  if (Selected("parked")) {
+    for (size_t n = 100; n <= 100000; n *= 10) {
+      BenchParked(n);
+    }
+  }
+  if (Selected("map")) {
+    BenchMap(1000);
+    BenchMap(10000);
+  }
+  if (Selected("hashmap")) {
+    BenchHashMap(1000);
+    BenchHashMap(100000);
+  }
+  if (Selected("vector")) {
+    BenchVector(10000);
+  }
+  if (Selected("bitset")) {
+    BenchBitSet(10000);
+  }
+  if (Selected("string")) {
+    BenchString(1000);
+  }
+  if (Selected("http")) {
+    BenchHttp(4096);
+  }
+}
@@ -8,187 +8,105 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <netdb.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include "buffer.h"
 #include "coroutine.h"
 #include "dstring.h"
-#include "map.h"
-#include "vector.h"
+#include "group.h"
+#include "http.h"
+#include "resolver.h"
+#include "writer.h"
 
 void Usage(void) {
-  fprintf(stderr, "usage: client -j <jobs> <host> <filename>\n");
+  fprintf(stderr,
+          "usage: client [-j <jobs>] [-c <connections>] [-p <port>] "
+          "[-d <name server>] [-t <seconds>] <host> <filename>\n");
   exit(1);
 }
 
 typedef struct {
   const char* server_name; // Hostname of server.
-  in_addr_t ipaddr;  // IP address for server (IPv4).
+  Resolver* resolver;  // Finds the server's addresses.
+  int port;
   String* filename;  // File to get (not owned by this struct).
+  int jobs_remaining;  // Requests not yet taken by a connection.
+  int num_connections;
+  uint64_t timeout;          // Nanoseconds to give the jobs, 0 for ever.
+  CoroutineGroup* clients;   // The connections, while the jobs run.
 } ServerData;
 
-// Send data to the server from a coroutine.
-static bool SendToServer(Coroutine* c, int fd, const char* request,
-                         size_t length) {
-  int offset = 0;
-  const size_t kMaxLength = 1024;
-  while (length > 0) {
-    // Wait until we can send to the network.  This will yield to other
-    // coroutines and we will be resumed when we can write.
-    CoroutineWait(c, fd, POLLOUT);
-    size_t nbytes = length;
-    if (nbytes > kMaxLength) {
-      nbytes = kMaxLength;
-    }
-    ssize_t n = write(fd, request + offset, nbytes);
-    if (n == -1) {
-      perror("write");
-      return false;
-    }
-    if (n == 0) {
-      return false;
-    }
-    length -= n;
-    offset += n;
-  }
-  return true;
+// Reads from the server straight into the end of the buffer, as coroutine
+// stacks are too small for a big read buffer.  Data that has already
+// arrived is taken without yielding; otherwise this yields to other
+// coroutines until some arrives.
+static ssize_t ReadIntoBuffer(Coroutine* c, int fd, Buffer* buffer) {
+  const size_t kReadSize = 16384;
+  size_t old_length = buffer->length;
+  BufferAddSpace(buffer, kReadSize);
+  ssize_t n = CoroutineReadSome(c, fd, &buffer->value[old_length], kReadSize);
+  buffer->length = n > 0 ? old_length + n : old_length;
+  return n;
 }
 
-static size_t ReadHeaders(Buffer* buffer, Vector* header, Map* http_headers) {
-  // Parse the header.
-  size_t i = 0;
-  // Find the \r\n at the end of the first line.
-  while (i < buffer->length && buffer->value[i] != '\r') {
-    i++;
+// Makes sure there is data in the buffer at index i, reading more from the
+// server if all the buffer has been used.  Returns false on EOF or error.
+static bool FillBuffer(Coroutine* c, int fd, Buffer* buffer, size_t* i) {
+  if (*i < buffer->length) {
+    return true;
   }
-  if (i == buffer->length) {
-    // No header line.
-    return i;
-  }
-  String header_line;
-  StringInitFromSegment(&header_line, buffer->value, i);
-  i += 2;  // Skip \r\n.
-
-  // Parse the header line.  By splitting it at space into String objects
-  // allocated from the heap.
-  StringSplit(&header_line, ' ', header);
-
-  // Don't need this now.
-  StringDestruct(&header_line);
-
-  // Extract MIME headers.  Holds pointers to the data in the buffer.  Does
-  // not own the pointers.
-  while (i < buffer->length) {
-    if (buffer->value[i] == '\r') {
-      // End of headers is a blank line.
-      i += 2;
-      break;
-    }
-    char* name = &buffer->value[i];
-    while (i < buffer->length && buffer->value[i] != ':') {
-      // Convert name to upper case as they are case insensitive.
-      buffer->value[i] = toupper(buffer->value[i]);
-      i++;
-    }
-    // No header value, end of headers.
-    if (i == buffer->length) {
-      break;
-    }
-    buffer->value[i] = '\0';  // Replace : by EOL
-    i++;
-    // Skip to non-space.
-    while (i < buffer->length && isspace(buffer->value[i])) {
-      i++;
-    }
-    char* value = &buffer->value[i];
-    while (i < buffer->length) {
-      if (i < buffer->length + 3 && buffer->value[i] == '\r') {
-        // Check for continuation with a space as the first character on the
-        // next line.  TAB too.
-        if (buffer->value[i + 2] != ' ' && buffer->value[i + 2] != '\t') {
-          break;
-        }
-      } else if (buffer->value[i] == '\r') {
-        // No continuation, check for end of value.
-        break;
-      }
-      i++;
-    }
-    buffer->value[i] = '\0';  // Replace \r by EOL
-    i += 2;
-    MapKeyValue kv = {.key.p = name, .value.p = value};
-    MapInsert(http_headers, kv);
+  BufferClear(buffer);
+  *i = 0;
+  ssize_t n = ReadIntoBuffer(c, fd, buffer);
+  if (n == -1) {
+    perror("read");
+    return false;
   }
-  return i;
+  return n != 0;
 }
 
-static size_t ReadContents(Coroutine* c, int fd, Buffer* buffer, size_t i,
-                           int length, bool write_to_output) {
+static bool ReadContents(Coroutine* c, int fd, Buffer* buffer, size_t* i,
+                         int64_t length, bool write_to_output) {
   while (length > 0) {
-    if (i < buffer->length) {
-      // Data remaining in buffer
-      size_t nbytes = buffer->length - i;
-      if (nbytes > length) {
-        nbytes = length;
-      }
-      if (write_to_output) {
-        fwrite(&buffer->value[i], 1, nbytes, stdout);
-      }
-      length -= nbytes;
-      i += nbytes;
-    } else {
-      // No data in buffer, read some more into the buffer.
-      BufferClear(buffer);
-      i = 0;
-      char buf[256];
-      CoroutineWait(c, fd, POLLIN);
-      ssize_t n = read(fd, buf, sizeof(buf));
-      if (n == -1) {
-        perror("read");
-        break;
-      }
-      if (n == 0) {
-        printf("done\n");
-        break;
-      }
-      BufferAppend(buffer, buf, n);
+    if (!FillBuffer(c, fd, buffer, i)) {
+      return false;
+    }
+    // Data remaining in buffer
+    size_t nbytes = buffer->length - *i;
+    if (nbytes > length) {
+      nbytes = length;
     }
+    if (write_to_output) {
+      fwrite(&buffer->value[*i], 1, nbytes, stdout);
+    }
+    length -= nbytes;
+    *i += nbytes;
   }
-  return i;
+  return true;
 }
 
-static size_t ReadChunkLength(Coroutine* c, int fd, Buffer* buffer, size_t i,
-                              int* length) {
+static bool ReadChunkLength(Coroutine* c, int fd, Buffer* buffer, size_t* i,
+                            int* length) {
+  bool in_extension = false;
   for (;;) {
-    char ch;
-    if (i < buffer->length) {
-      ch = toupper(buffer->value[i++]);
-    } else {
-      // Fill the buffer with some more data.
-      BufferClear(buffer);
-      i = 0;
-      CoroutineWait(c, fd, POLLIN);
-      char buf[256];
-      ssize_t n = read(fd, buf, sizeof(buf));
-      if (n == -1) {
-        perror("read");
-        *length = 0;
-        return i;
-      }
-      if (n == 0) {
-        // Didn't read anything, EOF on input.
-        return i;
-      }
-      BufferAppend(buffer, buf, n);
-      continue;
+    if (!FillBuffer(c, fd, buffer, i)) {
+      return false;
     }
+    char ch = toupper(buffer->value[(*i)++]);
     if (ch == '\r') {
-      i++;
-      break;
+      // Skip the \n.
+      return ReadContents(c, fd, buffer, i, 1, false);
+    }
+    if (ch == ';') {
+      // Chunk extensions are ignored.
+      in_extension = true;
+    }
+    if (in_extension) {
+      continue;
     }
     if (ch > '9') {
       ch = ch - 'A' + 10;
@@ -197,158 +115,258 @@ static size_t ReadChunkLength(Coroutine* c, int fd, Buffer* buffer, size_t i,
     }
     *length = (*length << 4) | ch;
   }
-  return i;
 }
 
-static void ReadChunkedContents(Coroutine* c, int fd, Buffer* buffer,
-                                size_t i) {
+static bool ReadChunkedContents(Coroutine* c, int fd, Buffer* buffer,
+                                size_t* i) {
   for (;;) {
     // First line is the length of the chunk in hex.
     int length = 0;
-    i = ReadChunkLength(c, fd, buffer, i, &length);
+    if (!ReadChunkLength(c, fd, buffer, i, &length)) {
+      return false;
+    }
     if (length == 0) {
-      break;
+      // Last chunk is followed by an empty trailer.
+      return ReadContents(c, fd, buffer, i, 2, false);
+    }
+    if (!ReadContents(c, fd, buffer, i, length, true)) {
+      return false;
     }
-    i = ReadContents(c, fd, buffer, i, length, true);
 
     // Chunk is followed by a CRLF.  Don't print this, just skip it.
-    i = ReadContents(c, fd, buffer, i, 2, false);
+    if (!ReadContents(c, fd, buffer, i, 2, false)) {
+      return false;
+    }
   }
 }
 
-void Client(Coroutine* c) {
-  ServerData* data = CoroutineGetUserData(c);
-
-  int fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (fd == -1) {
-    perror("socket");
-    exit(1);
+// Connects to the first of the server's addresses that accepts.  The
+// addresses are looked up each time, which normally comes from the
+// resolver's cache.
+static int Connect(Coroutine* c, ServerData* data) {
+  ResolvedAddress* addresses =
+      malloc(sizeof(ResolvedAddress) * kCoResolverMaxAddresses);
+  ssize_t n = CoroutineResolve(c, data->resolver, data->server_name,
+                               data->port, AF_UNSPEC, addresses,
+                               kCoResolverMaxAddresses);
+  if (n <= 0) {
+    fprintf(stderr, "unknown host %s%s%s\n", data->server_name,
+            n == -1 ? ": " : "", n == -1 ? strerror(errno) : "");
+    free(addresses);
+    return -1;
   }
-
-  struct sockaddr_in addr = {.sin_family = AF_INET,
-                             .sin_port = htons(80),
-                             .sin_len = sizeof(int),
-                             .sin_addr.s_addr = data->ipaddr};
-  int e = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
-  if (e != 0) {
-    close(fd);
-    perror("connect");
-    return;
+  int fd = -1;
+  for (ssize_t i = 0; i < n && fd == -1; i++) {
+    fd = socket(addresses[i].addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK,
+                0);
+    if (fd == -1) {
+      perror("socket");
+      continue;
+    }
+    if (CoroutineConnect(c, fd, &addresses[i].addr.sa,
+                         addresses[i].length) != 0) {
+      perror("connect");
+      CoroutineClose(c, fd);
+      fd = -1;
+    }
   }
+  free(addresses);
+  return fd;
+}
+
+// Sends a request through the connection's writer and reads the
+// response.  The request goes out in one write.  The response (and any
+// pipelined data after it) is read into the buffer, starting with what was
+// left there from the last response.  Returns false if the request failed
+// and sets *keep_alive if the connection can be used again.
+static bool Get(Coroutine* c, CoroutineWriter* writer, ServerData* data,
+                Buffer* buffer, bool* keep_alive) {
+  *keep_alive = false;
+  int fd = writer->fd;
   String request = {0};
 
   StringPrintf(&request, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
                data->filename->value, data->server_name);
-  bool ok = SendToServer(c, fd, request.value, request.length);
+  bool ok = CoroutineWriterAppendString(writer, &request) &&
+            CoroutineWriterFlush(writer);
+  StringDestruct(&request);
   if (!ok) {
     fprintf(stderr, "Failed to send to server: %s\n", strerror(errno));
-    close(fd);
-    return;
+    return false;
   }
 
-  Buffer buffer = {0};
-
-  // Read incoming HTTP request and parse it.
+  // Read incoming HTTP response header.  The parser carries on from where
+  // it stopped after each read.
+  HttpParser parser;
+  HttpParserInit(&parser);
   for (;;) {
-    char buf[64];
-
-    // Wait for data to arrive.  This will yield to other coroutines and
-    // we will resume when data is available to read.
-    CoroutineWait(c, fd, POLLIN);
-    ssize_t n = read(fd, buf, sizeof(buf));
+    HttpParseStatus status =
+        HttpParserParse(&parser, buffer->value, buffer->length);
+    if (status == kCoHttpComplete) {
+      break;
+    }
+    if (status == kCoHttpInvalid) {
+      fprintf(stderr, "Invalid response from server\n");
+      return false;
+    }
+    ssize_t n = ReadIntoBuffer(c, fd, buffer);
     if (n == -1) {
       perror("read");
-      close(fd);
-      return;
+      return false;
     }
     if (n == 0) {
       // EOF while reading header, nothing we can do.
-      close(fd);
-      BufferDestruct(&buffer);
-      return;
-    }
-    // Append to data buffer.
-    BufferAppend(&buffer, buf, n);
-
-    // A blank line terminates the read.
-    if (strstr(buffer.value, "\r\n\r\n") != NULL) {
-      break;
+      return false;
     }
   }
+  const char* buf = buffer->value;
+  size_t i = parser.length;
+
+  // Make alises for the status line fields.
+  HttpSlice protocol = parser.start[0];
+  HttpSlice status = parser.start[1];
+  HttpSlice reason = parser.start[2];
+
+  HttpSlice connection;
+  bool has_connection =
+      HttpParserFindHeader(&parser, buf, "Connection", &connection);
+  bool server_keeps_alive =
+      HttpSliceEqual(buf, protocol, "HTTP/1.1")
+          ? !has_connection || !HttpSliceCaseEqual(buf, connection, "close")
+          : has_connection &&
+                HttpSliceCaseEqual(buf, connection, "keep-alive");
+
+  // We are the end of the http headers in the buffer.  We now need to work
+  // out the length.  This is either from the CONTENT-LENGTH header or if
+  // TRANSFER-ENCODING is "chunked", we have a series of chunks, each of which
+  // is preceded by a hex length on a line of its own and terminated with a
+  // CRLF
+  HttpSlice v;
+  bool is_chunked = false;
+  int64_t content_length = -1;
+  if (HttpParserFindHeader(&parser, buf, "Transfer-Encoding", &v) &&
+      HttpSliceCaseEqual(buf, v, "chunked")) {
+    is_chunked = true;
+  } else if (HttpParserFindHeader(&parser, buf, "Content-Length", &v)) {
+    content_length = HttpSliceToInt(buf, v);
+  }
 
-  Vector header = {0};
-  Map http_headers;
-  MapInitForCharPointerKeys(&http_headers);
-
-  // The buffer contains the HTTP header line and the HTTP headers.
-  size_t i = ReadHeaders(&buffer, &header, &http_headers);
-
-  const size_t kProtocol = 0;
-  const size_t kStatus = 1;
-  const size_t kError = 2;
-
-  // Make alises for the http header fields.
-  String* status = header.value.p[kStatus];
-  String* protocol = header.value.p[kProtocol];
+  // Check for valid status.  The contents of an error are not printed.
+  int64_t status_value = HttpSliceToInt(buf, status);
+  bool print = status_value == 200;
+  if (!print) {
+    fprintf(stderr, "%.*s Error: %.*s: %.*s\n", (int)protocol.length,
+            &buf[protocol.offset], (int)status.length, &buf[status.offset],
+            (int)reason.length, &buf[reason.offset]);
+  }
 
-  // Check for valid status.
-  int status_value = atoi(status->value);
-  if (status_value != 200) {
-    fprintf(stderr, "%s Error: %d: ", protocol->value, status_value);
-    // Print all error strings.
-    const char* sep = "";
-    for (size_t i = kError; i < header.length; i++) {
-      String* s = header.value.p[i];
-      fprintf(stderr, "%s%s", sep, s->value);
-      sep = " ";
-    }
-    fprintf(stderr, "\n");
+  // We use the buffer to hold all the data received, in blocks.
+  if (is_chunked) {
+    ok = ReadChunkedContents(c, fd, buffer, &i);
+  } else if (content_length != -1) {
+    ok = ReadContents(c, fd, buffer, &i, content_length, print);
   } else {
-    // We are the end of the http headers in the buffer.  We now need to work
-    // out the length.  This is either from the CONTENT-LENGTH header or if
-    // TRANSFER-ENCODING is "chunked", we have a series of chunks, each of which
-    // is preceded by a hex length on a line of its own and terminated with a
-    // CRLF
-    MapKeyType k = {.p = "TRANSFER-ENCODING"};
-    const char* transfer_encoding = MapFind(&http_headers, k);
-    bool is_chunked = false;
-    int content_length = -1;
-    if (transfer_encoding != NULL &&
-        strcmp(transfer_encoding, "chunked") == 0) {
-      is_chunked = true;
-    } else {
-      MapKeyType k = {.p = "CONTENT-LENGTH"};
-      const char* v = MapFind(&http_headers, k);
-      if (v != NULL) {
-        content_length = (int)strtoll(v, NULL, 10);
-      }
+    if (print) {
+      fprintf(stderr,
+              "Don't know how many bytes to read, no Content-length in "
+              "headers\n");
     }
+    server_keeps_alive = false;
+  }
 
-    // We use the buffer to hold all the data received, in blocks.
-    if (is_chunked) {
-      ReadChunkedContents(c, fd, &buffer, i);
-    } else {
-      if (content_length == -1) {
-        fprintf(stderr,
-                "Don't know how many bytes to read, no Content-length in "
-                "headers\n");
-      } else {
-        ReadContents(c, fd, &buffer, i, content_length, true);
+  // Keep anything after the response for the next one.
+  BufferRemoveFront(buffer, i);
+  *keep_alive = ok && server_keeps_alive;
+  return ok;
+}
+
+// A connection in the pool.  It takes jobs until there are none left,
+// keeping the connection open between them if the server allows it.  If a
+// reused connection fails (the server may have closed it while idle) the
+// job is retried on a new one.
+void Client(Coroutine* c) {
+  ServerData* data = CoroutineGetUserData(c);
+  Buffer buffer = {0};
+  CoroutineWriter writer;
+  int fd = -1;
+  bool reused = false;
+
+  while (data->jobs_remaining > 0 && !CoroutineIsCancelled(c)) {
+    data->jobs_remaining--;
+    if (fd == -1) {
+      fd = Connect(c, data);
+      if (fd == -1) {
+        break;
       }
+      CoroutineWriterInit(&writer, c, fd);
+      reused = false;
+    }
+    bool keep_alive;
+    bool ok = Get(c, &writer, data, &buffer, &keep_alive);
+    if (!ok && reused) {
+      data->jobs_remaining++;
     }
+    if (!keep_alive) {
+      CoroutineClose(c, fd);
+      CoroutineWriterDestruct(&writer);
+      fd = -1;
+      BufferClear(&buffer);
+    }
+    reused = true;
+  }
+  if (fd != -1) {
+    CoroutineClose(c, fd);
+    CoroutineWriterDestruct(&writer);
   }
-
-  close(fd);
   BufferDestruct(&buffer);
-  MapDestruct(&http_headers);
-  VectorDestructWithContents(&header, (VectorElementDestructor)StringDestruct,
-                             true);
+}
+
+// Cancels the connections if they haven't finished the jobs in time.  Their
+// I/O fails and they close their sockets and return.
+static void Deadline(Coroutine* c) {
+  ServerData* data = CoroutineGetUserData(c);
+  CoroutineSleep(c, data->timeout);
+  if (!CoroutineIsCancelled(c)) {
+    fprintf(stderr, "timed out with %d jobs not started\n",
+            data->jobs_remaining);
+    CoroutineGroupCancel(data->clients);
+  }
+}
+
+// Runs the pool of connections and waits for them all to finish, and then
+// for the deadline, which is cancelled if it hasn't gone off.
+static void Fetch(Coroutine* c) {
+  ServerData* data = CoroutineGetUserData(c);
+  CoroutineGroup clients;
+  CoroutineGroupInit(&clients, c->machine);
+  data->clients = &clients;
+  for (int i = 0; i < data->num_connections; i++) {
+    CoroutineGroupSpawn(&clients, Client, data);
+  }
+  CoroutineGroup timers;
+  CoroutineGroupInit(&timers, c->machine);
+  if (data->timeout > 0) {
+    CoroutineGroupSpawn(&timers, Deadline, data);
+  }
+  CoroutineGroupJoin(&clients, c);
+  CoroutineGroupCancel(&timers);
+  CoroutineGroupJoin(&timers, c);
+  data->clients = NULL;
+  CoroutineGroupDestruct(&timers);
+  CoroutineGroupDestruct(&clients);
 }
 
 int main(int argc, const char* argv[]) {
+  // Unbuffered streams format onto the stack through a BUFSIZ buffer, which
+  // would overflow a coroutine's stack.
+  setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
   String host = {};
   String filename = {};
   int num_jobs = 1;
+  int num_connections = 0;  // One for each job.
+  int port = 80;
+  const char* dns_server = NULL;
+  int timeout_seconds = 0;
   for (int i = 1; i < argc; i++) {
     if (argv[i][0] == '-') {
       if (strcmp(argv[i], "-j") == 0) {
@@ -366,6 +384,17 @@ int main(int argc, const char* argv[]) {
       } else if (argv[i][1] == 'j' && isdigit(argv[i][2])) {
         // Allow -jN where N is a number.
         num_jobs = atoi(&argv[i][2]);
+      } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc &&
+                 isdigit(argv[i + 1][0])) {
+        num_connections = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc &&
+                 isdigit(argv[i + 1][0])) {
+        port = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc &&
+                 isdigit(argv[i + 1][0])) {
+        timeout_seconds = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+        dns_server = argv[++i];
       } else {
         Usage();
       }
@@ -383,24 +412,36 @@ int main(int argc, const char* argv[]) {
     Usage();
   }
 
-  struct hostent* entry = gethostbyname(host.value);
-  if (entry == NULL) {
-    fprintf(stderr, "unknown host %s\n", host.value);
+  // The host is looked up by the coroutines, without blocking the machine.
+  Resolver resolver;
+  ResolverInit(&resolver);
+  if (dns_server != NULL &&
+      !ResolverSetServer(&resolver, dns_server, kCoResolverPort)) {
+    fprintf(stderr, "invalid name server address %s\n", dns_server);
     exit(1);
   }
-  in_addr_t ipaddr = ((struct in_addr*)entry->h_addr_list[0])->s_addr;
 
   CoroutineMachine m;
   CoroutineMachineInit(&m);
 
-  ServerData server_data = {.server_name = host.value,
-    ipaddr = ipaddr, .filename = &filename};
-  for (int i = 0; i < num_jobs; i++) {
-    Coroutine* client = NewCoroutineWithUserData(&m, Client, &server_data);
-    CoroutineStart(client);
+  // A pool of connections shares the jobs.
+  if (num_connections <= 0 || num_connections > num_jobs) {
+    num_connections = num_jobs;
   }
+  ServerData server_data = {
+      .server_name = host.value,
+      .resolver = &resolver,
+      .port = port,
+      .filename = &filename,
+      .jobs_remaining = num_jobs,
+      .num_connections = num_connections,
+      .timeout = (uint64_t)timeout_seconds * 1000000000,
+      .clients = NULL};
+  Coroutine* fetch = NewCoroutineWithUserData(&m, Fetch, &server_data);
+  CoroutineStart(fetch);
 
   // Run the main loop
   CoroutineMachineRun(&m);
   CoroutineMachineDestruct(&m);
+  ResolverDestruct(&resolver);
 }
@@ -34,6 +34,15 @@ void BufferDelete(Buffer* buf) {
 
 void BufferClear(Buffer* buf) { buf->length = 0; }
 
+void BufferRemoveFront(Buffer* buf, size_t length) {
+  if (length >= buf->length) {
+    buf->length = 0;
+    return;
+  }
+  memmove(buf->value, &buf->value[length], buf->length - length);
+  buf->length -= length;
+}
+
 static void ExpandMemory(Buffer* buf, size_t new_length) {
   buf->capacity = new_length * 2;
   if (buf->value == NULL) {
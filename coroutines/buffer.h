@@ -38,6 +38,9 @@ void BufferDelete(Buffer* buf);
 
 void BufferClear(Buffer* buf);
 
+// Removes the first 'length' bytes, moving the rest to the start.
+void BufferRemoveFront(Buffer* buf, size_t length);
+
 // Appends a character array to the Buffer, reallocating the space
 // as necessary.
 void BufferAppend(Buffer* buf, char* value, size_t length);
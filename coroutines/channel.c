@@ -0,0 +1,324 @@
+//
+//  channel.c
+//  coroutines
+//
+
+#include "channel.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void ChannelInit(Channel* ch, size_t element_size, size_t capacity) {
+  // A cell's sequence number can't tell full from free with only one cell.
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  ch->buffer = malloc(size * element_size);
+  ch->sequence = malloc(size * sizeof(_Atomic(uint64_t)));
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&ch->sequence[i], i);
+  }
+  ch->element_size = element_size;
+  ch->capacity = size;
+  atomic_init(&ch->head, 0);
+  atomic_init(&ch->tail, 0);
+  atomic_init(&ch->receiver, NULL);
+  atomic_init(&ch->senders, NULL);
+  atomic_init(&ch->sending, 0);
+  atomic_init(&ch->closed, false);
+}
+
+Channel* NewChannel(size_t element_size, size_t capacity) {
+  Channel* ch = malloc(sizeof(Channel));
+  ChannelInit(ch, element_size, capacity);
+  return ch;
+}
+
+void ChannelDestruct(Channel* ch) {
+  free(ch->buffer);
+  free(ch->sequence);
+  ch->buffer = NULL;
+  ch->sequence = NULL;
+}
+
+void ChannelDelete(Channel* ch) {
+  ChannelDestruct(ch);
+  free(ch);
+}
+
+// A cell whose sequence number equals the tail is free for the sender that
+// claims that position.  Once written its sequence number is one more,
+// which tells the receiver that it's full.  The receiver then sets it to
+// the position it will next be free for, a lap later.
+static bool Enqueue(Channel* ch, const void* element) {
+  uint64_t pos = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+  _Atomic(uint64_t)* seq;
+  for (;;) {
+    seq = &ch->sequence[pos & (ch->capacity - 1)];
+    uint64_t s = atomic_load_explicit(seq, memory_order_acquire);
+    int64_t diff = (int64_t)(s - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ch->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The cell hasn't been received from yet, we're full.
+      return false;
+    } else {
+      // Another sender claimed the position.
+      pos = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+    }
+  }
+  memcpy(&ch->buffer[(pos & (ch->capacity - 1)) * ch->element_size], element,
+         ch->element_size);
+  atomic_store_explicit(seq, pos + 1, memory_order_release);
+  return true;
+}
+
+// Only the receiver dequeues, so the head doesn't need a CAS.  A cell that
+// has been claimed by a sender but not yet written looks empty.
+static bool Dequeue(Channel* ch, void* element) {
+  uint64_t pos = atomic_load_explicit(&ch->head, memory_order_relaxed);
+  _Atomic(uint64_t)* seq = &ch->sequence[pos & (ch->capacity - 1)];
+  if (atomic_load_explicit(seq, memory_order_acquire) != pos + 1) {
+    return false;
+  }
+  memcpy(element, &ch->buffer[(pos & (ch->capacity - 1)) * ch->element_size],
+         ch->element_size);
+  atomic_store_explicit(seq, pos + ch->capacity, memory_order_release);
+  atomic_store_explicit(&ch->head, pos + 1, memory_order_relaxed);
+  return true;
+}
+
+static bool IsFull(Channel* ch) {
+  uint64_t pos = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+  uint64_t s = atomic_load_explicit(&ch->sequence[pos & (ch->capacity - 1)],
+                                    memory_order_acquire);
+  return (int64_t)(s - pos) < 0;
+}
+
+static bool IsEmpty(Channel* ch) {
+  uint64_t pos = atomic_load_explicit(&ch->head, memory_order_relaxed);
+  uint64_t s = atomic_load_explicit(&ch->sequence[pos & (ch->capacity - 1)],
+                                    memory_order_acquire);
+  return s != pos + 1;
+}
+
+// Waking.  A waiter registers itself and then checks the channel again.
+// The other side changes the channel and then looks for waiters.  The
+// fences make sure that one of them sees the other, so a wakeup is never
+// lost.
+
+// A parked sender or receiver.  It is on the waiter's stack, so the waiter
+// waits until whoever takes it off the channel has finished with it, even
+// if it finds room or data in the channel first.  The waker marks it as
+// woken before unparking it and as released once it has, as until then the
+// waiter's coroutine must not go away.
+typedef struct ChannelWaiter {
+  Coroutine* coroutine;
+  struct ChannelWaiter* next;
+  atomic_bool woken;
+  atomic_bool released;
+} ChannelWaiter;
+
+static void Wake(ChannelWaiter* w) {
+  atomic_store_explicit(&w->woken, true, memory_order_release);
+  CoroutineUnpark(w->coroutine);
+  atomic_store_explicit(&w->released, true, memory_order_release);
+}
+
+static void WakeReceiver(Channel* ch) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&ch->receiver, memory_order_relaxed) == NULL) {
+    return;
+  }
+  ChannelWaiter* r = atomic_exchange(&ch->receiver, NULL);
+  if (r != NULL) {
+    Wake(r);
+  }
+}
+
+// All the parked senders are woken and race for the room.  The losers park
+// again.  Taking the whole list at once means there's no ABA problem.
+static void WakeSenders(Channel* ch) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&ch->senders, memory_order_relaxed) == NULL) {
+    return;
+  }
+  ChannelWaiter* w = atomic_exchange(&ch->senders, NULL);
+  while (w != NULL) {
+    // The waiter can go away as soon as it's released.
+    ChannelWaiter* next = w->next;
+    Wake(w);
+    w = next;
+  }
+}
+
+// For waiting on another thread that is only a few instructions away from
+// letting us go.
+static void Spin(int* spins) {
+  if (++*spins < 100) {
+#if defined(__SSE2__)
+    _mm_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+// Parks until woken, then waits for the waker to finish unparking us.
+static void WaitUntilReleased(ChannelWaiter* w) {
+  while (!atomic_load_explicit(&w->woken, memory_order_acquire)) {
+    CoroutinePark(w->coroutine);
+  }
+  int spins = 0;
+  while (!atomic_load_explicit(&w->released, memory_order_acquire)) {
+    Spin(&spins);
+  }
+}
+
+// Closing.  A sender counts itself in 'sending' before it checks that the
+// channel is open, and counts itself out once its elements are in the
+// ring.  A receiver that sees the channel closed waits for the count to
+// drop to zero.  After that no more elements can arrive and all those
+// whose sends succeeded can be dequeued, so an empty channel is finished.
+static void EndSend(Channel* ch) {
+  atomic_fetch_sub_explicit(&ch->sending, 1, memory_order_release);
+}
+
+static bool BeginSend(Channel* ch) {
+  atomic_fetch_add(&ch->sending, 1);
+  if (atomic_load(&ch->closed)) {
+    EndSend(ch);
+    return false;
+  }
+  return true;
+}
+
+static void WaitForSenders(Channel* ch) {
+  int spins = 0;
+  while (atomic_load_explicit(&ch->sending, memory_order_acquire) != 0) {
+    Spin(&spins);
+  }
+}
+
+static void AddSender(Channel* ch, ChannelWaiter* w) {
+  ChannelWaiter* head =
+      atomic_load_explicit(&ch->senders, memory_order_relaxed);
+  do {
+    w->next = head;
+  } while (!atomic_compare_exchange_weak(&ch->senders, &head, w));
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void ChannelClose(Channel* ch) {
+  atomic_store(&ch->closed, true);
+  WakeReceiver(ch);
+  WakeSenders(ch);
+}
+
+bool ChannelIsClosed(Channel* ch) { return atomic_load(&ch->closed); }
+
+bool ChannelTrySend(Channel* ch, const void* element) {
+  if (!BeginSend(ch)) {
+    return false;
+  }
+  bool sent = Enqueue(ch, element);
+  EndSend(ch);
+  if (sent) {
+    WakeReceiver(ch);
+  }
+  return sent;
+}
+
+bool ChannelTryReceive(Channel* ch, void* element) {
+  if (!Dequeue(ch, element)) {
+    return false;
+  }
+  WakeSenders(ch);
+  return true;
+}
+
+size_t ChannelSendBatch(Channel* ch, Coroutine* c, const void* elements,
+                        size_t n) {
+  const char* p = elements;
+  size_t sent = 0;
+  while (sent < n && BeginSend(ch)) {
+    size_t before = sent;
+    while (sent < n && Enqueue(ch, &p[sent * ch->element_size])) {
+      sent++;
+    }
+    EndSend(ch);
+    if (sent > before) {
+      // One wakeup for all the elements that fitted.
+      WakeReceiver(ch);
+    }
+    if (sent == n) {
+      break;
+    }
+    // Full.  If the receiver made room before it could see us, nobody will
+    // wake us so we take ourselves (and any others) off the list again.
+    ChannelWaiter w = {.coroutine = c};
+    atomic_init(&w.woken, false);
+    atomic_init(&w.released, false);
+    AddSender(ch, &w);
+    if (!IsFull(ch) || atomic_load(&ch->closed)) {
+      WakeSenders(ch);
+    }
+    WaitUntilReleased(&w);
+  }
+  return sent;
+}
+
+size_t ChannelReceiveBatch(Channel* ch, Coroutine* c, void* elements,
+                           size_t max) {
+  char* p = elements;
+  for (;;) {
+    // Once senders that got past the close have finished, everything sent
+    // is in the channel.
+    bool closed = atomic_load(&ch->closed);
+    if (closed) {
+      WaitForSenders(ch);
+    }
+    size_t received = 0;
+    while (received < max && Dequeue(ch, &p[received * ch->element_size])) {
+      received++;
+    }
+    if (received > 0) {
+      // One wakeup for all the room we made.
+      WakeSenders(ch);
+      return received;
+    }
+    if (closed || max == 0) {
+      return 0;
+    }
+    ChannelWaiter w = {.coroutine = c};
+    atomic_init(&w.woken, false);
+    atomic_init(&w.released, false);
+    atomic_store(&ch->receiver, &w);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (IsEmpty(ch) && !atomic_load(&ch->closed)) {
+      CoroutinePark(c);
+    }
+    // We might have found data without parking, or been unparked by
+    // something else (like CoroutineCancel).  Unless we take ourselves off
+    // first, a sender has us and we wait for it to be done with us.
+    if (atomic_exchange(&ch->receiver, NULL) != &w) {
+      WaitUntilReleased(&w);
+    }
+  }
+}
+
+bool ChannelSend(Channel* ch, Coroutine* c, const void* element) {
+  return ChannelSendBatch(ch, c, element, 1) == 1;
+}
+
+bool ChannelReceive(Channel* ch, Coroutine* c, void* element) {
+  return ChannelReceiveBatch(ch, c, element, 1) == 1;
+}
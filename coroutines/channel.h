@@ -0,0 +1,98 @@
+//
+//  channel.h
+//  coroutines
+//
+
+#ifndef channel_h
+#define channel_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "coroutine.h"
+
+// A Channel carries fixed size elements from any number of sending
+// coroutines to a single receiving coroutine, in the order they were sent
+// (per sender).  It is a bounded lock-free ring (Vyukov's bounded queue, with
+// a sequence number for each cell) so the senders and the receiver can be
+// on different machines of a CoroutineScheduler, or all on one machine.
+//
+// A sender parks when the channel is full and the receiver parks when it is
+// empty (see CoroutinePark).  The batch functions move as many elements as
+// they can each time they run, so a producer and consumer pair switch once a
+// batch rather than once an element.
+//
+// Channel ch;
+// ChannelInit(&ch, sizeof(int), 64);
+//
+// In the producer:
+// for (int i = 0; i < 100; i++) {
+//   ChannelSend(&ch, c, &i);
+// }
+// ChannelClose(&ch);
+//
+// In the consumer:
+// int v;
+// while (ChannelReceive(&ch, c, &v)) {
+//   ...
+// }
+
+struct ChannelWaiter;
+
+typedef struct {
+  // Written by senders.
+  _Alignas(64) _Atomic(uint64_t) tail;
+  _Atomic(struct ChannelWaiter*) senders;  // Parked senders.
+  _Atomic(uint64_t) sending;               // Senders adding elements.
+  // Written by the receiver.
+  _Alignas(64) _Atomic(uint64_t) head;
+  _Atomic(struct ChannelWaiter*) receiver;  // Parked receiver.
+  // Fixed when initialized.
+  _Alignas(64) char* buffer;
+  _Atomic(uint64_t)* sequence;  // For each cell.
+  size_t element_size;
+  size_t capacity;  // Power of 2.
+  atomic_bool closed;
+} Channel;
+
+// Initialize a channel for elements of the given size.  The capacity is
+// rounded up to a power of 2.
+void ChannelInit(Channel* ch, size_t element_size, size_t capacity);
+Channel* NewChannel(size_t element_size, size_t capacity);
+void ChannelDestruct(Channel* ch);
+void ChannelDelete(Channel* ch);
+
+// Closing a channel makes sends fail and wakes everything parked on it.
+// The receiver gets every element whose send succeeded, including those
+// that raced with the close.
+void ChannelClose(Channel* ch);
+bool ChannelIsClosed(Channel* ch);
+
+// Send an element, parking the coroutine while the channel is full.
+// Returns false if the channel has been closed.
+bool ChannelSend(Channel* ch, Coroutine* c, const void* element);
+
+// Receive an element, parking the coroutine while the channel is empty.
+// Only one coroutine may receive from a channel.  Returns false if the
+// channel is closed and there is nothing left in it.
+bool ChannelReceive(Channel* ch, Coroutine* c, void* element);
+
+// Send 'n' elements from the 'elements' array.  Returns the number sent,
+// which is less than 'n' only if the channel is closed.
+size_t ChannelSendBatch(Channel* ch, Coroutine* c, const void* elements,
+                        size_t n);
+
+// Receive at least one and up to 'max' elements into the 'elements' array,
+// parking while the channel is empty.  Returns the number received, 0
+// when the channel is closed and empty.
+size_t ChannelReceiveBatch(Channel* ch, Coroutine* c, void* elements,
+                           size_t max);
+
+// Send or receive without parking.  These return false if the channel is
+// full (or closed) or empty.  ChannelTrySend can be called from any thread,
+// not just from a coroutine.
+bool ChannelTrySend(Channel* ch, const void* element);
+bool ChannelTryReceive(Channel* ch, void* element);
+
+#endif /* channel_h */
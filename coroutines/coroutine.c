@@ -5,11 +5,22 @@
 //  Created by David Allison on 3/13/23.
 //
 
+#if defined(__linux__)
+#define _GNU_SOURCE  // For accept4.
+#endif
+
 #include "coroutine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include "bitset.h"
+#include "group.h"
+#if defined(COROUTINE_TRACE)
+#include "trace.h"
+#endif
 
 #if defined(__APPLE__)
 #include <sys/event.h>
@@ -17,7 +28,10 @@
 #include <sys/types.h>
 
 #elif defined(__linux__)
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include "uring.h"
 
 #else
 #error "Unknown operating system"
@@ -68,73 +82,505 @@ static void ClearEvent(int fd) {
 #endif
 }
 
-void CoroutineInit(Coroutine* c, struct CoroutineMachine* machine,
+// The poller is responsible for waiting for the file descriptors that
+// coroutines are waiting for.  The poll poller keeps an array of the pollfds
+// being waited for to pass to poll.  The native pollers (epoll and kqueue) keep
+// file descriptors registered across waits and only return those that
+// have events.
+//
+// The 'wait_fd' function is called when a coroutine is about to wait for
+// c->wait_fd.  If it returns false the fd can't be waited for (epoll won't
+// accept regular files) and the coroutine is treated as if the fd is ready.
+// The 'resumed' function is called when the coroutine has been resumed
+// after a wait.  The 'poll' function waits for events for up to 'timeout'
+// milliseconds (-1 is forever) and appends the coroutines that can run to
+// m->runnables, setting the revents in their wait_fd.  It returns -1 on
+// error.  A 'one_shot' poller reports each coroutine only once, so one
+// that isn't run straight away must still be made ready.  The optional
+// 'cancel' function is called when a waiting coroutine is cancelled.  If
+// it returns true the poller reports the coroutine itself once it is safe
+// to resume.
+typedef struct CoroutinePoller {
+  bool (*init)(CoroutineMachine* m);
+  void (*destruct)(CoroutineMachine* m);
+  bool (*wait_fd)(Coroutine* c);
+  void (*resumed)(Coroutine* c);
+  int (*poll)(CoroutineMachine* m, int timeout);
+  void (*forget)(CoroutineMachine* m, int fd);
+  bool (*cancel)(Coroutine* c);
+  bool one_shot;
+} CoroutinePoller;
+
+// Metrics.  The machine's counters are only written by its own thread, so
+// they are updated with relaxed loads and stores rather than atomic adds.
+// Without COROUTINE_METRICS the counting compiles to nothing.
+#if defined(COROUTINE_METRICS)
+static void CountAdd(_Atomic(uint64_t)* counter, uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static void CountMax(_Atomic(uint64_t)* counter, uint64_t n) {
+  if (n > atomic_load_explicit(counter, memory_order_relaxed)) {
+    atomic_store_explicit(counter, n, memory_order_relaxed);
+  }
+}
+
+// The coroutine is able to run.  It keeps the time it first became ready
+// until it runs.  Reading the cycle counter costs as much as a switch so
+// the time of the last switch or poll is used, except that a coroutine
+// that yields is given the time it switches away.
+static void CountReady(Coroutine* c) {
+  if (c->ready_since == 0) {
+    c->ready_since = c->machine->counters.last_cycles;
+  }
+}
+
+// Accounts for a switch away from 'from' (NULL for the machine) to 'to'
+// (NULL for the machine).
+static void CountSwitch(CoroutineMachine* m, Coroutine* from, Coroutine* to) {
+  CoroutineMachineCounters* counters = &m->counters;
+  uint64_t now = CoroutineCycles();
+  counters->last_cycles = now;
+  if (from != NULL) {
+    uint64_t run =
+        now - atomic_load_explicit(&counters->run_start, memory_order_relaxed);
+    from->metrics.run_cycles += run;
+    if (run > from->metrics.max_run_cycles) {
+      from->metrics.max_run_cycles = run;
+    }
+    if (from->is_ready) {
+      from->ready_since = now;
+    }
+  }
+  if (to == NULL) {
+    atomic_store_explicit(&counters->current_id, (size_t)-1,
+                          memory_order_relaxed);
+    return;
+  }
+  to->metrics.resumes++;
+  if (to->ready_since != 0) {
+    uint64_t ready = now - to->ready_since;
+    to->metrics.ready_cycles += ready;
+    to->ready_since = 0;
+    CountAdd(&counters->ready_cycles, ready);
+    CountMax(&counters->max_ready_cycles, ready);
+  }
+  CountAdd(&counters->switches, 1);
+  atomic_store_explicit(&counters->run_start, now, memory_order_relaxed);
+  atomic_store_explicit(&counters->current_id, to->id, memory_order_relaxed);
+}
+
+static void CountReadyDepth(CoroutineMachine* m) {
+  size_t depth = m->num_ready;
+  int bucket = depth == 0 ? 0 : 64 - __builtin_clzll(depth);
+  if (bucket >= kCoReadyDepthBuckets) {
+    bucket = kCoReadyDepthBuckets - 1;
+  }
+  CountAdd(&m->counters.ready_depth[bucket], 1);
+}
+
+#define CountEvent(m, name) CountAdd(&(m)->counters.name, 1)
+#define CountPollStart(m) uint64_t poll_start = CoroutineCycles()
+#define CountPollEnd(m)                                            \
+  do {                                                             \
+    (m)->counters.last_cycles = CoroutineCycles();                 \
+    CountAdd(&(m)->counters.polls, 1);                             \
+    CountAdd(&(m)->counters.poll_cycles,                           \
+             (m)->counters.last_cycles - poll_start);              \
+  } while (0)
+#define CountNotReady(c) ((c)->ready_since = 0)
+#else
+#define CountSwitch(m, from, to)
+#define CountReady(c)
+#define CountReadyDepth(m)
+#define CountEvent(m, name)
+#define CountPollStart(m)
+#define CountPollEnd(m)
+#define CountNotReady(c)
+#endif
+
+// Tracing, see trace.h.  Events are only recorded on machines that have
+// had tracing started.
+#if defined(COROUTINE_TRACE)
+#define TraceEvent(m, type, c, fd, mask)                           \
+  do {                                                             \
+    if ((m)->trace != NULL) {                                      \
+      CoroutineTraceRecord((m)->trace, (type), (c), (fd), (mask)); \
+    }                                                              \
+  } while (0)
+
+// Records why a coroutine is switching away.
+static void TraceSuspend(Coroutine* c) {
+  CoroutineTraceEventType type = kCoTracePark;
+  if (c->state == kCoDead) {
+    type = kCoTraceExit;
+  } else if (c->state == kCoWaiting) {
+    type = kCoTraceWait;
+  } else if (c->is_ready) {
+    type = kCoTraceYield;
+  }
+  TraceEvent(c->machine, type, c, c->wait_fd.fd, c->wait_fd.events);
+}
+#else
+#define TraceEvent(m, type, c, fd, mask)
+#define TraceSuspend(c)
+#endif
+
+// Stacks come from the machine's stack pool or malloc.  A pooled stack is
+// 'pool_size' bytes, which may be less than the '*size' asked for (see
+// ChooseStackSize), and the pool may round it up.  If the pool can't map a
+// stack (each one takes two memory map entries, of which a process has a
+// limited number) we use malloc rather than fail, and set '*on_heap'.  A
+// stack from malloc has no guard page so it gets the full size.
+static void* AllocateStack(CoroutineMachine* m, size_t pool_size,
+                           size_t* size, bool* on_heap) {
+  if (m->stack_allocator == kCoStackPool) {
+    void* stack = StackPoolAllocate(&m->stack_pool, &pool_size);
+    if (stack != NULL) {
+      *size = pool_size;
+      *on_heap = false;
+      return stack;
+    }
+  }
+  *on_heap = true;
+  return malloc(*size);
+}
+
+static void FreeStack(CoroutineMachine* m, void* stack, size_t size,
+                      bool on_heap) {
+  if (on_heap) {
+    free(stack);
+  } else {
+    StackPoolFree(&m->stack_pool, stack, size);
+  }
+}
+
+// Stack profiling.  Stacks grow down, so the deepest a coroutine has been
+// is the lowest byte that no longer holds the canary.
+
+static void PaintStack(Coroutine* c) {
+  memset(c->stack, kCoStackCanary, c->stack_size);
+  c->stack_painted = true;
+}
+
+size_t CoroutineStackHighWater(Coroutine* c) {
+  if (!c->stack_painted) {
+    return 0;
+  }
+  // Stacks are word aligned, so compare a word at a time.
+  const uint64_t canary = 0x0101010101010101ULL * kCoStackCanary;
+  const uint64_t* words = c->stack;
+  size_t num_words = c->stack_size / sizeof(uint64_t);
+  size_t i = 0;
+  while (i < num_words && words[i] == canary) {
+    i++;
+  }
+  return c->stack_size - i * sizeof(uint64_t);
+}
+
+static CoroutineStackProfile* FindStackProfile(CoroutineMachine* m,
+                                               CoroutineFunctor functor) {
+  return HashMapFindPointerKey(&m->stack_profiles, (void*)functor);
+}
+
+// Adds the stack use of a coroutine that has exited to its functor's
+// profile.
+static void RecordStackUse(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  CoroutineStackProfile* p = FindStackProfile(m, c->functor);
+  if (p == NULL) {
+    p = calloc(1, sizeof(CoroutineStackProfile));
+    p->functor = c->functor;
+    HashMapInsert(&m->stack_profiles,
+                  (MapKeyValue){.key.p = (void*)c->functor, .value.p = p});
+  }
+  size_t used = CoroutineStackHighWater(c);
+  p->samples++;
+  if (used >= p->max_used) {
+    p->max_used = used;
+    p->stack_size = c->stack_size;
+  }
+}
+
+static void FreeStackProfile(MapKeyValue* kv) { free(kv->value.p); }
+
+// The stack size for a new coroutine that asks for 'stack_size'.  Stacks
+// are only made smaller when they come from the pool, whose guard pages
+// catch a coroutine that goes deeper than any measured before it.
+static size_t ChooseStackSize(CoroutineMachine* m, CoroutineFunctor functor,
+                              size_t stack_size) {
+  if (m->stack_sizing != kCoStackSizeAdaptive ||
+      m->stack_allocator != kCoStackPool) {
+    return stack_size;
+  }
+  CoroutineStackProfile* p = FindStackProfile(m, functor);
+  if (p == NULL || p->samples < kCoStackProfileSamples) {
+    return stack_size;
+  }
+  size_t size = 2 * p->max_used;
+  if (size < kCoDefaultStackSize) {
+    size = kCoDefaultStackSize;
+  }
+  return size < stack_size ? size : stack_size;
+}
+
+// Whether a new coroutine's stack is to be measured.
+static bool ShouldPaintStack(CoroutineMachine* m, CoroutineFunctor functor) {
+  switch (m->stack_sizing) {
+    case kCoStackSizeFixed:
+      return false;
+    case kCoStackSizeProfile:
+      return true;
+    case kCoStackSizeAdaptive:
+      break;
+  }
+  CoroutineStackProfile* p = FindStackProfile(m, functor);
+  if (p == NULL || p->samples < kCoStackProfileSamples) {
+    return true;
+  }
+  if (++p->unmeasured < kCoStackProfileInterval) {
+    return false;
+  }
+  p->unmeasured = 0;
+  return true;
+}
+
+void CoroutineMachineSetStackSizing(CoroutineMachine* m,
+                                    CoroutineStackSizing sizing) {
+  m->stack_sizing = sizing;
+}
+
+bool CoroutineMachineGetStackProfile(CoroutineMachine* m,
+                                     CoroutineFunctor functor,
+                                     CoroutineStackProfile* profile) {
+  CoroutineStackProfile* p = FindStackProfile(m, functor);
+  if (p == NULL) {
+    memset(profile, 0, sizeof(*profile));
+    return false;
+  }
+  *profile = *p;
+  return true;
+}
+
+bool CoroutineInit(Coroutine* c, struct CoroutineMachine* machine,
                    CoroutineFunctor functor) {
-  CoroutineInitWithStackSize(c, machine, functor, kCoDefaultStackSize);
+  return CoroutineInitWithStackSize(c, machine, functor, kCoDefaultStackSize);
 }
 
-void CoroutineInitWithStackSize(Coroutine* c, struct CoroutineMachine* machine,
-                                CoroutineFunctor functor, size_t stack_size) {
+// Parking.  A coroutine's park_state says whether it is parked or has been
+// unparked while not parked (a permit, which the next park uses up).  The
+// coroutine moves itself from unparked to parked and only its unparker
+// moves it back, so exactly one unpark makes a parked coroutine runnable.
+enum {
+  kCoUnparked,
+  kCoPermit,
+  kCoParked,
+};
+
+// Initializes the parts of a coroutine that don't depend on a machine.
+static void InitDetached(Coroutine* c, CoroutineFunctor functor,
+                         size_t stack_size) {
   StringInit(&c->name, NULL);
-  c->id = CoroutineMachineAllocateId(machine);
-  StringPrintf(&c->name, "co-%d", c->id);
+  c->id = 0;
+  c->generation = 0;
   c->functor = functor;
   c->stack_size = stack_size;
   c->state = kCoNew;
-  c->machine = machine;
-  c->stack = malloc(stack_size);
+  c->machine = NULL;
+  c->stack = NULL;
+  c->inline_size = 0;
   c->needs_free = false;
+  c->stack_on_heap = false;
+  c->stack_painted = false;
   c->yielded_address = NULL;
   ListElementInit(&c->element);
-  c->event_fd.fd = NewEventFd();
-  c->event_fd.events = POLLIN;
-
   c->wait_fd.fd = -1;
   c->wait_fd.events = POLLIN;
+  c->poller_slot = 0;
 
   c->caller = NULL;
   c->result = NULL;
   c->result_size = 0;
   c->user_data = NULL;
   c->last_tick = 0;
+  ListElementInit(&c->ready_element);
+  c->is_ready = false;
+  c->priority = kCoPriorityNormal;
+  c->serial = 0;
+  c->sp = NULL;
+  TimerInit(&c->timer);
+  c->timed_out = false;
+  c->cancelled = false;
+  c->inbox_next = NULL;
+  atomic_init(&c->park_state, kCoUnparked);
+  c->io_op = NULL;
+  c->io_result = 0;
+  c->group = NULL;
+  ListElementInit(&c->group_element);
+#if defined(COROUTINE_METRICS)
+  memset(&c->metrics, 0, sizeof(c->metrics));
+  c->ready_since = 0;
+#endif
+}
+
+// Gives a coroutine its ID and, unless it already has one, a stack from the
+// machine.  Returns false, leaving the coroutine detached, if there's no
+// memory for the stack.
+static bool AttachToMachine(Coroutine* c, CoroutineMachine* machine) {
+  if (c->stack == NULL) {
+    size_t size = c->stack_size;
+    c->stack =
+        AllocateStack(machine, ChooseStackSize(machine, c->functor, size),
+                      &size, &c->stack_on_heap);
+    if (c->stack == NULL) {
+      return false;
+    }
+    c->stack_size = size;
+  }
+  c->id = CoroutineMachineAllocateId(machine);
+  c->generation = machine->ids[c->id].generation;
+  c->machine = machine;
+  if (ShouldPaintStack(machine, c->functor)) {
+    PaintStack(c);
+  }
+  c->serial = machine->next_serial++;
+  CountEvent(machine, spawns);
+  TraceEvent(machine, kCoTraceSpawn, c, -1, 0);
+  return true;
+}
+
+bool CoroutineInitWithStackSize(Coroutine* c, struct CoroutineMachine* machine,
+                                CoroutineFunctor functor, size_t stack_size) {
+  InitDetached(c, functor, stack_size);
+  if (!AttachToMachine(c, machine)) {
+    return false;
+  }
 
   // Add to machine but do not start it.
   CoroutineMachineAddCoroutine(machine, c);
+  return true;
 }
 
-Coroutine* NewCoroutine(CoroutineMachine* machine, CoroutineFunctor functor) {
-  Coroutine* c =
-      NewCoroutineWithStackSize(machine, functor, kCoDefaultStackSize);
+// Coroutines made by NewCoroutine share an allocation with their stack and
+// any inline user data, laid out as:
+//
+//   guard page | stack ... | user data | Coroutine
+//
+// so starting one takes a block from the machine's stack pool and nothing
+// from the heap.  The parts are aligned to cache lines.  The block is
+// returned to the pool by CoroutineDelete.
+#define kCoInlineAlignment 64
+
+static size_t InlineAlign(size_t size) {
+  return (size + kCoInlineAlignment - 1) & ~(size_t)(kCoInlineAlignment - 1);
+}
+
+static Coroutine* NewInlineCoroutine(CoroutineMachine* machine,
+                                     CoroutineFunctor functor,
+                                     size_t stack_size,
+                                     size_t user_data_size) {
+  size_t coroutine_size = InlineAlign(sizeof(Coroutine));
+  size_t inline_size = coroutine_size + InlineAlign(user_data_size);
+  size_t pool_size =
+      InlineAlign(ChooseStackSize(machine, functor, stack_size)) + inline_size;
+  size_t size = InlineAlign(stack_size) + inline_size;
+  bool on_heap;
+  char* block = AllocateStack(machine, pool_size, &size, &on_heap);
+  if (block == NULL) {
+    return NULL;
+  }
+  // The pool may have rounded up the size, the stack gets the extra.
+  Coroutine* c = (Coroutine*)(block + size - coroutine_size);
+  InitDetached(c, functor, size - inline_size);
+  c->stack = block;
+  c->stack_on_heap = on_heap;
+  c->inline_size = inline_size;
+  c->needs_free = true;
+  if (user_data_size > 0) {
+    c->user_data = block + size - inline_size;
+    memset(c->user_data, 0, user_data_size);
+  }
+  AttachToMachine(c, machine);
+  CoroutineMachineAddCoroutine(machine, c);
+  return c;
+}
+
+Coroutine* NewDetachedCoroutine(CoroutineFunctor functor, size_t stack_size,
+                                void* user_data) {
+  Coroutine* c = malloc(sizeof(Coroutine));
+  InitDetached(c, functor, stack_size);
+  c->needs_free = true;
+  c->user_data = user_data;
+  return c;
+}
+
+Coroutine* NewDetachedCoroutineWithInlineUserData(CoroutineFunctor functor,
+                                                  size_t stack_size,
+                                                  size_t user_data_size) {
+  // There's no machine to take a stack from yet, so the user data follows
+  // the coroutine in one heap allocation.
+  size_t coroutine_size = InlineAlign(sizeof(Coroutine));
+  Coroutine* c = malloc(coroutine_size + user_data_size);
+  InitDetached(c, functor, stack_size);
   c->needs_free = true;
+  if (user_data_size > 0) {
+    c->user_data = (char*)c + coroutine_size;
+    memset(c->user_data, 0, user_data_size);
+  }
   return c;
 }
 
+Coroutine* NewCoroutine(CoroutineMachine* machine, CoroutineFunctor functor) {
+  return NewInlineCoroutine(machine, functor, kCoDefaultStackSize, 0);
+}
+
 Coroutine* NewCoroutineWithStackSize(CoroutineMachine* machine,
                                      CoroutineFunctor functor,
                                      size_t stack_size) {
-  Coroutine* c = malloc(sizeof(Coroutine));
-  CoroutineInitWithStackSize(c, machine, functor, stack_size);
-  return c;
+  return NewInlineCoroutine(machine, functor, stack_size, 0);
+}
+
+Coroutine* NewCoroutineWithInlineUserData(CoroutineMachine* machine,
+                                          CoroutineFunctor functor,
+                                          size_t user_data_size) {
+  return NewInlineCoroutine(machine, functor, kCoDefaultStackSize,
+                            user_data_size);
+}
+
+Coroutine* NewCoroutineWithStackSizeAndInlineUserData(
+    CoroutineMachine* machine, CoroutineFunctor functor, size_t stack_size,
+    size_t user_data_size) {
+  return NewInlineCoroutine(machine, functor, stack_size, user_data_size);
 }
 
-void CoroutineInitWithUserData(Coroutine* c, struct CoroutineMachine* machine,
+bool CoroutineInitWithUserData(Coroutine* c, struct CoroutineMachine* machine,
                                CoroutineFunctor functor, void* user_data) {
-  CoroutineInit(c, machine, functor);
+  if (!CoroutineInit(c, machine, functor)) {
+    return false;
+  }
   c->user_data = user_data;
+  return true;
 }
 
-void CoroutineInitWithStackSizeAndUserData(Coroutine* c,
+bool CoroutineInitWithStackSizeAndUserData(Coroutine* c,
                                            struct CoroutineMachine* machine,
                                            CoroutineFunctor functor,
                                            size_t stack_size, void* user_data) {
-  CoroutineInitWithStackSize(c, machine, functor, stack_size);
+  if (!CoroutineInitWithStackSize(c, machine, functor, stack_size)) {
+    return false;
+  }
   c->user_data = user_data;
+  return true;
 }
 
 Coroutine* NewCoroutineWithUserData(struct CoroutineMachine* machine,
                                     CoroutineFunctor functor, void* user_data) {
   Coroutine* c = NewCoroutine(machine, functor);
-  c->user_data = user_data;
+  if (c != NULL) {
+    c->user_data = user_data;
+  }
   return c;
 }
 
@@ -142,231 +588,1484 @@ Coroutine* NewCoroutineWithStackSizeAndUserData(
     struct CoroutineMachine* machine, CoroutineFunctor functor,
     size_t stack_size, void* user_data) {
   Coroutine* c = NewCoroutineWithStackSize(machine, functor, stack_size);
-  c->user_data = user_data;
+  if (c != NULL) {
+    c->user_data = user_data;
+  }
   return c;
 }
 
 void CoroutineDestruct(Coroutine* c) {
   StringDestruct(&c->name);
-  free(c->stack);
-  CloseEventFd(c->event_fd.fd);
-  CloseEventFd(c->wait_fd.fd);
+  if (c->machine == NULL) {
+    // Detached, never started.
+    return;
+  }
+  TimerWheelCancel(&c->machine->timers, &c->timer);
+  if (c->inline_size == 0) {
+    FreeStack(c->machine, c->stack, c->stack_size, c->stack_on_heap);
+  }
 }
 
 void CoroutineDelete(Coroutine* c) {
   CoroutineDestruct(c);
-  free(c);
+  if (c->inline_size != 0) {
+    // The coroutine goes back to the pool with its stack.
+    FreeStack(c->machine, c->stack, c->stack_size + c->inline_size,
+              c->stack_on_heap);
+  } else {
+    free(c);
+  }
 }
 
-void CoroutineExit(Coroutine* c) { longjmp(c->exit, 1); }
+// Context switching.  A coroutine that is not running has its callee-saved
+// registers saved on its own stack and its stack pointer saved in c->sp.
+// The machine's main loop has its stack pointer saved in m->sp while a
+// coroutine is running.  Switching saves the registers of the current
+// context, stores its stack pointer and loads those of the new context.
+//
+// CoroutineSwitchContext is written in assembly below.  It saves the
+// current context's stack pointer in *from and switches to the stack 'to'.
+void CoroutineSwitchContext(void** from, void* to);
 
-void CoroutineStart(Coroutine* c) {
-  if (c->state == kCoNew) {
-    c->state = kCoReady;
-  }
+// Called on a coroutine's stack to start it.  The new context's return
+// address points to CoroutineTrampoline which calls this with the coroutine.
+void CoroutineTrampoline(void);
+
+#if defined(__APPLE__)
+#define CO_ASM_SYMBOL(name) "_" #name
+#define CO_ASM_FUNCTION(name) \
+  ".private_extern " CO_ASM_SYMBOL(name) "\n" CO_ASM_SYMBOL(name) ":\n"
+#else
+#define CO_ASM_SYMBOL(name) #name
+#define CO_ASM_FUNCTION(name)           \
+  ".hidden " CO_ASM_SYMBOL(name) "\n"   \
+  ".type " CO_ASM_SYMBOL(name) ", %function\n" CO_ASM_SYMBOL(name) ":\n"
+#endif
+
+#if defined(__aarch64__)
+// Callee-saved registers are x19-x28, the frame pointer (x29), the link
+// register (x30) and the low 64 bits of v8-v15.  Frame layout from sp:
+// 0: x19, x20, x21, x22, x23, x24, x25, x26, x27, x28, x29, x30
+// 96: d8, d9, d10, d11, d12, d13, d14, d15
+#define kCoContextWords 20
+asm(".text\n"
+    ".p2align 4\n"
+    ".globl " CO_ASM_SYMBOL(CoroutineSwitchContext) "\n"
+    CO_ASM_FUNCTION(CoroutineSwitchContext)
+    "sub sp, sp, #160\n"
+    "stp x19, x20, [sp, #0]\n"
+    "stp x21, x22, [sp, #16]\n"
+    "stp x23, x24, [sp, #32]\n"
+    "stp x25, x26, [sp, #48]\n"
+    "stp x27, x28, [sp, #64]\n"
+    "stp x29, x30, [sp, #80]\n"
+    "stp d8, d9, [sp, #96]\n"
+    "stp d10, d11, [sp, #112]\n"
+    "stp d12, d13, [sp, #128]\n"
+    "stp d14, d15, [sp, #144]\n"
+    "mov x9, sp\n"
+    "str x9, [x0]\n"  // Save stack pointer in *from.
+    "mov sp, x1\n"    // Switch to new stack.
+    "ldp x19, x20, [sp, #0]\n"
+    "ldp x21, x22, [sp, #16]\n"
+    "ldp x23, x24, [sp, #32]\n"
+    "ldp x25, x26, [sp, #48]\n"
+    "ldp x27, x28, [sp, #64]\n"
+    "ldp x29, x30, [sp, #80]\n"
+    "ldp d8, d9, [sp, #96]\n"
+    "ldp d10, d11, [sp, #112]\n"
+    "ldp d12, d13, [sp, #128]\n"
+    "ldp d14, d15, [sp, #144]\n"
+    "add sp, sp, #160\n"
+    "ret\n"
+    ".p2align 4\n"
+    ".globl " CO_ASM_SYMBOL(CoroutineTrampoline) "\n"
+    CO_ASM_FUNCTION(CoroutineTrampoline)
+    "mov x0, x19\n"  // Coroutine.
+    "blr x20\n"      // Entry function, never returns.
+    "brk #0\n");
+#elif defined(__x86_64__)
+// Callee-saved registers are rbp, rbx and r12-r15.  Frame layout from rsp:
+// r15, r14, r13, r12, rbx, rbp, return address.
+#define kCoContextWords 8
+asm(".text\n"
+    ".p2align 4\n"
+    ".globl " CO_ASM_SYMBOL(CoroutineSwitchContext) "\n"
+    CO_ASM_FUNCTION(CoroutineSwitchContext)
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    "movq %rsp, (%rdi)\n"  // Save stack pointer in *from.
+    "movq %rsi, %rsp\n"    // Switch to new stack.
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".p2align 4\n"
+    ".globl " CO_ASM_SYMBOL(CoroutineTrampoline) "\n"
+    CO_ASM_FUNCTION(CoroutineTrampoline)
+    "movq %r12, %rdi\n"  // Coroutine.
+    "andq $-16, %rsp\n"  // Align the stack for the call.
+    "callq *%r13\n"      // Entry function, never returns.
+    "ud2\n");
+#else
+#error "Unknown architecture"
+#endif
+
+static void Reap(Coroutine* c);
+
+// Switches from the running coroutine back to the machine's main loop.
+static void SwitchToMachine(Coroutine* c) {
+  CountSwitch(c->machine, c, NULL);
+  TraceSuspend(c);
+  CoroutineSwitchContext(&c->sp, c->machine->sp);
 }
 
-void CoroutineSetName(Coroutine* c, const char* name) {
-  StringSet(&c->name, name);
+// Builds the initial context on a new coroutine's stack so that switching
+// to it calls 'entry' with the coroutine as its argument.
+static void InitContext(Coroutine* c, void (*entry)(Coroutine*)) {
+  uintptr_t top = ((uintptr_t)c->stack + c->stack_size) & ~(uintptr_t)15;
+  void** sp = (void**)top - kCoContextWords;
+  memset(sp, 0, kCoContextWords * sizeof(void*));
+#if defined(__aarch64__)
+  sp[0] = c;                          // x19
+  sp[1] = (void*)entry;               // x20
+  sp[11] = (void*)CoroutineTrampoline;  // x30
+#elif defined(__x86_64__)
+  sp[3] = c;                          // r12
+  sp[2] = (void*)entry;               // r13
+  sp[6] = (void*)CoroutineTrampoline;  // Return address.
+#endif
+  c->sp = sp;
 }
 
-const char* CoroutineGetName(Coroutine* c) {
-  return c->name.value;
+// Switches to coroutine 'to', saving the current context's stack pointer
+// in *from.  If 'to' has never run its initial context is built first.
+static void SwitchToCoroutine(void** from, Coroutine* to);
+
+// Runs the coroutine's functor on its own stack.  When the functor returns
+// the coroutine is dead and we switch back to the machine, which will
+// destruct it.
+static void CoroutineEntry(Coroutine* c) {
+  c->functor(c);
+  CoroutineExit(c);
 }
 
-void CoroutineWait(Coroutine* c, int fd, int event_mask) {
-  c->state = kCoWaiting;
-  c->wait_fd.fd = fd;
-  c->wait_fd.events = event_mask;
-  c->yielded_address = __builtin_return_address(0);
-  c->last_tick = c->machine->tick_count;
-  if (setjmp(c->resume) == 0) {
-    longjmp(c->machine->yield, 1);
+static void SwitchToCoroutine(void** from, Coroutine* to) {
+  if (to->state == kCoReady) {
+    to->yielded_address = NULL;
+    InitContext(to, CoroutineEntry);
   }
-  c->wait_fd.fd = -1;
+  CountSwitch(to->machine, to->machine->current, to);
+  if (to->machine->current != NULL) {
+    TraceSuspend(to->machine->current);
+  }
+  TraceEvent(to->machine, kCoTraceResume, to, -1, 0);
+  // Only the machine's thread writes the slice, so it needs no atomic add.
+  uint64_t slice = atomic_load_explicit(&to->machine->slice,
+                                        memory_order_relaxed);
+  atomic_store_explicit(&to->machine->slice, (slice | 1) + 2,
+                        memory_order_relaxed);
+  to->state = kCoRunning;
+  to->machine->current = to;
+  CoroutineSwitchContext(from, to->sp);
 }
 
-void CoroutineTriggerEvent(Coroutine* c) { TriggerEvent(c->event_fd.fd); }
+// Switches directly between two coroutines without going through the
+// machine.
+static void CoroutineSwitch(Coroutine* from, Coroutine* to) {
+  SwitchToCoroutine(&from->sp, to);
+}
 
-void CoroutineClearEvent(Coroutine* c) { ClearEvent(c->event_fd.fd); }
+void CoroutineExit(Coroutine* c) {
+  c->state = kCoDead;
+  SwitchToMachine(c);
+  // Never get here.
+}
 
-static struct pollfd* GetPollFd(Coroutine* c) {
-  static struct pollfd empty = {.fd = -1, .events = 0, .revents = 0};
-  switch (c->state) {
-    case kCoReady:
-    case kCoYielded:
-      return &c->event_fd;
-    case kCoWaiting:
-      return &c->wait_fd;
-    case kCoNew:
-    case kCoRunning:
-    case kCoDead:
-      return &empty;
-  }
+// The ready queues are intrusive lists of the ready_element members of the
+// coroutines, one for each priority.  A coroutine is on its priority's
+// queue when it is able to run without waiting for anything, so the
+// machine can run it without a call to poll.
+static Coroutine* ReadyElementToCoroutine(ListElement* e) {
+  return (Coroutine*)((char*)e - offsetof(Coroutine, ready_element));
 }
 
-bool CoroutineIsAlive(Coroutine* c, Coroutine* query) {
-  return BitSetContains(&c->machine->coroutine_ids, query->id);
+static void LinkReady(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  ListAppend(&m->ready_coroutines[c->priority], &c->ready_element);
+  m->ready_levels |= 1u << c->priority;
+  m->num_ready++;
 }
 
-void CoroutineYield(Coroutine* c) {
-  c->state = kCoYielded;
-  c->yielded_address = __builtin_return_address(0);
-  c->last_tick = c->machine->tick_count;
-  if (setjmp(c->resume) == 0) {
-    CoroutineTriggerEvent(c);
-    longjmp(c->machine->yield, 1);
-    // Never get here.
+static void UnlinkReadyLevel(CoroutineMachine* m, int level, Coroutine* c) {
+  List* queue = &m->ready_coroutines[level];
+  ListDeleteElement(queue, &c->ready_element);
+  ListElementInit(&c->ready_element);
+  if (queue->length == 0) {
+    m->ready_levels &= ~(1u << level);
   }
-  // We get here when resumed.
+  m->num_ready--;
 }
 
-void CoroutineYieldValue(Coroutine* c, void* value) {
-  // Copy value.
-  if (c->result != NULL) {
-    memcpy(c->result, value, c->result_size);
-  }
-  if (c->caller != NULL) {
-    // Tell caller that there's a value available.
-    CoroutineTriggerEvent(c->caller);
-  }
+static void UnlinkReady(Coroutine* c) {
+  UnlinkReadyLevel(c->machine, c->priority, c);
+}
 
-  // Yield control to another coroutine but don't trigger a wakup event.
-  // This will be done when another call is made.
-  c->state = kCoYielded;
+static void AddToReadyQueue(Coroutine* c) {
+  if (c->is_ready) {
+    return;
+  }
+  c->is_ready = true;
+  // For the priority aging in PopReadyQueue.
   c->last_tick = c->machine->tick_count;
-  if (setjmp(c->resume) == 0) {
-    longjmp(c->machine->yield, 1);
-    // Never get here.
+  CountReady(c);
+  if (c != c->machine->current) {
+    TraceEvent(c->machine, kCoTraceWake, c, -1, 0);
   }
-  // We get here when resumed from another call.
+  LinkReady(c);
 }
 
-void CoroutineCall(Coroutine* c, Coroutine* callee, void* result,
-                   size_t result_size) {
-  // Tell the callee that it's being called and where to store the value.
-  callee->caller = c;
-  callee->result = result;
-  callee->result_size = result_size;
-
-  // Start the callee running if it's not already running.  If it's running
-  // we trigger its event to wake it up.
-  if (callee->state == kCoNew) {
-    CoroutineStart(callee);
-  } else {
-    CoroutineTriggerEvent(callee);
+static void RemoveFromReadyQueue(Coroutine* c) {
+  if (!c->is_ready) {
+    return;
   }
-  c->state = kCoYielded;
-  c->last_tick = c->machine->tick_count;
-  if (setjmp(c->resume) == 0) {
-    longjmp(c->machine->yield, 1);
-    // Never get here.
+  UnlinkReady(c);
+  c->is_ready = false;
+}
+
+// Takes the oldest coroutine of the highest priority that has one ready,
+// unless the oldest of a lower priority has waited too long.
+static Coroutine* PopReadyQueue(CoroutineMachine* m) {
+  // Usually only normal priority coroutines are ready.  Loading the head
+  // of their queue with the mask means that case doesn't wait for the ctz.
+  uint32_t levels = m->ready_levels;
+  ListElement* first = m->ready_coroutines[kCoPriorityNormal].first;
+  int level = kCoPriorityNormal;
+  if (levels != 1u << kCoPriorityNormal) {
+    if (levels == 0) {
+      return NULL;
+    }
+    level = __builtin_ctz(levels);
+    for (uint32_t lower = levels & (levels - 1); lower != 0;
+         lower &= lower - 1) {
+      int l = __builtin_ctz(lower);
+      Coroutine* oldest =
+          ReadyElementToCoroutine(m->ready_coroutines[l].first);
+      if (m->tick_count - oldest->last_tick > kCoPriorityMaxWaitTicks) {
+        level = l;
+        break;
+      }
+    }
+    first = m->ready_coroutines[level].first;
   }
-  // When we get here, the callee has done its work.  Remove this coroutine's
-  // state from it.
-  callee->caller = NULL;
-  callee->result = NULL;
+  Coroutine* c = ReadyElementToCoroutine(first);
+  UnlinkReadyLevel(m, level, c);
+  c->is_ready = false;
+  return c;
 }
 
-// This invokes the coroutine's functor and long jumps to the exit environment.
-// The coroutine's stack pointer is set to the allocated stack and restored
-// aferwards.
-static void SwitchStackAndRun(void* sp, CoroutineFunctor f, void* arg,
-                              jmp_buf exit) {
-#if defined(__aarch64__)
-  asm("mov x12, sp\n"      // Save current stack pointer.
-      "mov x13, x29\n"     // Save current frame pointer
-      "mov x29, #0\n"      // FP = 0
-      "sub sp, %0, #32\n"  // Set new stack pointer.
-      "stp x12, x13, [sp, #16]\n"
-      "str %3, [sp]\n"
-      "mov x0, %2\n"  // Load arg to functor
-      "blr %1\n"      // Invoke functor on new stack
-      "ldr x0, [sp]\n"
-      "ldp x12, x29, [sp, #16]\n"
-      "mov sp, x12\n"  // Restore stack pointer
-      "mov w1, #1\n"
-#if defined(__APPLE__)
-      "bl _longjmp\n"
-#else
-      "bl longjmp\n"
-#endif
-      : /* no output regs*/
-      : "r"(sp), "r"(f), "r"(arg), "r"(exit)
-      : "x12", "x13");
-#elif defined(__x86_64__)
-  asm("movq %%rsp, %%r14\n"  // Save current stack pointer.
-      "movq %%rbp, %%r15\n"  // Save current frame pointer
-      "movq $0, %%rbp\n"     // FP = 0
-      "movq %0, %%rsp\n"
-      "pushq %%r14\n"     // Push rsp
-      "pushq %%r15\n"     // Push rbp
-      "pushq %3\n"        // Push env
-      "subq $8, %%rsp\n"  // Align to 16
-      "movq %2, %%rdi\n"
-      "callq *%1\n"
-      "addq $8, %%rsp\n"  // Remove alignment.
-      "popq %%rdi\n"      // Pop env
-      "popq %%rbp\n"
-      "popq %%rsp\n"
-      "movl $1, %%esi\n"
-      "callq longjmp\n"
-      : /* no output regs*/
-      : "r"(sp), "r"(f), "r"(arg), "r"(exit)
-      : "%r14", "%r15");
-#else
-#error "Unknown architecture"
-#endif
+void CoroutineSetPriority(Coroutine* c, CoroutinePriority priority) {
+  if (c->is_ready) {
+    // Keeps its place in time but joins the back of the new queue.
+    UnlinkReady(c);
+    c->priority = priority;
+    LinkReady(c);
+  } else {
+    c->priority = priority;
+  }
 }
 
-static void Resume(Coroutine* c) {
-  switch (c->state) {
-    case kCoReady:
-      c->state = kCoRunning;
-      c->yielded_address = NULL;
-      if (setjmp(c->exit) == 0) {
-        SwitchStackAndRun(c->stack + c->stack_size, c->functor, c, c->exit);
-      }
-      // Trigger the caller when we exit.
-      if (c->caller != NULL) {
-        CoroutineTriggerEvent(c->caller);
-      }
-      // Functor returned, we are dead.
-      c->state = kCoDead;
-      CoroutineMachineRemoveCoroutine(c->machine, c);
+CoroutinePriority CoroutineGetPriority(Coroutine* c) { return c->priority; }
 
-      // Destruct the coroutine, freeing the memory if necessary.
-      if (c->needs_free) {
-        CoroutineDelete(c);
-      } else {
-        CoroutineDestruct(c);
-      }
-      break;
-    case kCoYielded:
-    case kCoWaiting:
-      c->state = kCoRunning;
-      longjmp(c->resume, 1);
-      break;
-    case kCoRunning:
-    case kCoNew:
-      // Should never get here.
-      break;
-    case kCoDead:
-      longjmp(c->exit, 1);
-      break;
+void CoroutineStart(Coroutine* c) {
+  if (c->state == kCoNew) {
+    c->state = kCoReady;
+    AddToReadyQueue(c);
   }
 }
 
-void CoroutineSetUserData(Coroutine* c, void* user_data) {
-  c->user_data = user_data;
+void CoroutineSetName(Coroutine* c, const char* name) {
+  StringSet(&c->name, name);
+  if (c->machine != NULL) {
+    TraceEvent(c->machine, kCoTraceName, c, -1, 0);
+  }
 }
 
-void* CoroutineGetUserData(Coroutine* c) { return c->user_data; }
+const char* CoroutineGetName(Coroutine* c) {
+  if (c->name.length == 0 && c->machine != NULL) {
+    StringPrintf(&c->name, "co-%zd", c->id);
+  }
+  return c->name.value;
+}
+
+// Timers.  The machine's timer wheel ticks once a millisecond.
+#define kCoTimerTickNanos 1000000
+#define kCoNoTimeout UINT64_MAX
+
+static uint64_t NowNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t NowTicks(void) { return NowNanos() / kCoTimerTickNanos; }
+
+static Coroutine* TimerToCoroutine(Timer* t) {
+  return (Coroutine*)((char*)t - offsetof(Coroutine, timer));
+}
+
+// Sets the coroutine's timer to expire after at least 'nanos'.  The expiry
+// is rounded up to the next tick so that we never wake early.
+static void StartTimer(Coroutine* c, uint64_t nanos) {
+  uint64_t expiry = (NowNanos() + nanos + kCoTimerTickNanos - 1) /
+                    kCoTimerTickNanos;
+  c->timed_out = false;
+  TimerWheelAdd(&c->machine->timers, &c->timer, expiry);
+}
+
+// Waits for the fd or the timeout, whichever comes first.  A coroutine
+// waiting only for a timer has a wait_fd of -1.
+static CoroutineWaitStatus Wait(Coroutine* c, int fd, int event_mask,
+                                uint64_t nanos) {
+  CoroutineMachine* m = c->machine;
+  if (c->cancelled) {
+    return kCoWaitCancelled;
+  }
+  c->wait_fd.fd = fd;
+  c->wait_fd.events = event_mask;
+  c->wait_fd.revents = 0;
+  c->last_tick = m->tick_count;
+  if (fd != -1 && !m->poller->wait_fd(c)) {
+    // The poller can't wait for this fd, so it's always ready.  Just
+    // yield to let others run.
+    c->wait_fd.revents = event_mask;
+    c->state = kCoYielded;
+    AddToReadyQueue(c);
+    SwitchToMachine(c);
+    c->wait_fd.fd = -1;
+    return c->cancelled ? kCoWaitCancelled : kCoWaitReady;
+  }
+  if (nanos != kCoNoTimeout) {
+    StartTimer(c, nanos);
+  }
+  c->state = kCoWaiting;
+  m->num_waiting++;
+  SwitchToMachine(c);
+  // The machine has removed us from the poller when it woke us.
+  c->wait_fd.fd = -1;
+  TimerWheelCancel(&m->timers, &c->timer);
+  bool timed_out = c->timed_out;
+  c->timed_out = false;
+  if (c->cancelled) {
+    return kCoWaitCancelled;
+  }
+  return timed_out ? kCoWaitTimeout : kCoWaitReady;
+}
+
+CoroutineWaitStatus CoroutineWait(Coroutine* c, int fd, int event_mask) {
+  c->yielded_address = __builtin_return_address(0);
+  return Wait(c, fd, event_mask, kCoNoTimeout);
+}
+
+CoroutineWaitStatus CoroutineWaitWithTimeout(Coroutine* c, int fd,
+                                             int event_mask, uint64_t nanos) {
+  c->yielded_address = __builtin_return_address(0);
+  return Wait(c, fd, event_mask, nanos);
+}
+
+void CoroutineSleep(Coroutine* c, uint64_t nanos) {
+  if (c->cancelled) {
+    return;
+  }
+  if (nanos == 0) {
+    CoroutineYield(c);
+    return;
+  }
+  c->yielded_address = __builtin_return_address(0);
+  Wait(c, -1, 0, nanos);
+}
+
+// The inbox is a lock-free stack of detached coroutines.  The machine's
+// thread takes the whole stack at once so there is no ABA problem.  Only
+// the push that finds the inbox empty needs to wake the machine.
+void CoroutineStartOnMachine(CoroutineMachine* m, Coroutine* c) {
+  if (m->hooks != NULL) {
+    m->hooks->added(m);
+  }
+  Coroutine* head = atomic_load_explicit(&m->inbox, memory_order_relaxed);
+  do {
+    c->inbox_next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &m->inbox, &head, c, memory_order_release, memory_order_relaxed));
+  if (head == NULL) {
+    CoroutineMachineInterrupt(m);
+  }
+}
+
+void CoroutineMachineAdopt(CoroutineMachine* m, Coroutine* c) {
+  if (!AttachToMachine(c, m)) {
+    // It was counted by the scheduler when it was started.
+    if (m->hooks != NULL) {
+      m->hooks->removed(m);
+    }
+    if (c->needs_free) {
+      CoroutineDelete(c);
+    } else {
+      CoroutineDestruct(c);
+    }
+    return;
+  }
+  ListAppend(&m->coroutines, &c->element);
+  CoroutineStart(c);
+}
+
+// Starts the coroutines in the inbox in the order they were pushed.
+static void DrainInbox(CoroutineMachine* m) {
+  Coroutine* c =
+      atomic_exchange_explicit(&m->inbox, NULL, memory_order_acquire);
+  Coroutine* reversed = NULL;
+  while (c != NULL) {
+    Coroutine* next = c->inbox_next;
+    c->inbox_next = reversed;
+    reversed = c;
+    c = next;
+  }
+  while (reversed != NULL) {
+    Coroutine* next = reversed->inbox_next;
+    reversed->inbox_next = NULL;
+    CoroutineMachineAdopt(m, reversed);
+    reversed = next;
+  }
+}
+
+// The machine running on this thread.
+static _Thread_local CoroutineMachine* current_machine;
+
+void CoroutinePark(Coroutine* c) {
+  int expected = kCoPermit;
+  if (atomic_compare_exchange_strong(&c->park_state, &expected,
+                                     kCoUnparked)) {
+    return;
+  }
+  expected = kCoUnparked;
+  if (!atomic_compare_exchange_strong(&c->park_state, &expected, kCoParked)) {
+    // Unparked by another thread since the check above.
+    atomic_store(&c->park_state, kCoUnparked);
+    return;
+  }
+  // Not on the ready queue, so only an unpark will resume us.
+  c->state = kCoYielded;
+  c->yielded_address = __builtin_return_address(0);
+  c->last_tick = c->machine->tick_count;
+  SwitchToMachine(c);
+}
+
+// Another thread has unparked one of our coroutines.  The wakeups are a
+// lock-free stack like the inbox.  They are only drained on our thread,
+// after the coroutine has switched out, so it's safe to push one before the
+// coroutine has finished parking.
+static void PushWakeup(CoroutineMachine* m, Coroutine* c) {
+  Coroutine* head = atomic_load_explicit(&m->wakeups, memory_order_relaxed);
+  do {
+    c->inbox_next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &m->wakeups, &head, c, memory_order_release, memory_order_relaxed));
+  if (head == NULL) {
+    CoroutineMachineInterrupt(m);
+  }
+}
+
+static void DrainWakeups(CoroutineMachine* m) {
+  Coroutine* c =
+      atomic_exchange_explicit(&m->wakeups, NULL, memory_order_acquire);
+  Coroutine* reversed = NULL;
+  while (c != NULL) {
+    Coroutine* next = c->inbox_next;
+    c->inbox_next = reversed;
+    reversed = c;
+    c = next;
+  }
+  while (reversed != NULL) {
+    Coroutine* next = reversed->inbox_next;
+    reversed->inbox_next = NULL;
+    AddToReadyQueue(reversed);
+    reversed = next;
+  }
+}
+
+// Completions are another lock-free stack that only this thread drains.
+// Pushing one is the last thing the posting thread does with it.
+void CoroutinePostCompletion(CoroutineCompletion* completion) {
+  CoroutineMachine* m = completion->c->machine;
+  CoroutineCompletion* head =
+      atomic_load_explicit(&m->completions, memory_order_relaxed);
+  do {
+    completion->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &m->completions, &head, completion, memory_order_release,
+      memory_order_relaxed));
+  if (head == NULL) {
+    CoroutineMachineInterrupt(m);
+  }
+}
+
+static void DrainCompletions(CoroutineMachine* m) {
+  CoroutineCompletion* completion =
+      atomic_exchange_explicit(&m->completions, NULL, memory_order_acquire);
+  while (completion != NULL) {
+    CoroutineCompletion* next = completion->next;
+    completion->done = true;
+    CoroutineUnpark(completion->c);
+    completion = next;
+  }
+}
+
+void CoroutineUnpark(Coroutine* c) {
+  int state = atomic_load(&c->park_state);
+  for (;;) {
+    if (state == kCoPermit) {
+      return;
+    }
+    int next = state == kCoParked ? kCoUnparked : kCoPermit;
+    if (atomic_compare_exchange_weak(&c->park_state, &state, next)) {
+      break;
+    }
+  }
+  if (state != kCoParked) {
+    return;
+  }
+  if (c->machine == current_machine) {
+    AddToReadyQueue(c);
+  } else {
+    PushWakeup(c->machine, c);
+  }
+}
+
+void CoroutineClose(Coroutine* c, int fd) {
+  c->machine->poller->forget(c->machine, fd);
+  close(fd);
+}
+
+// Triggering a coroutine's event places it on the ready queue.  Only
+// coroutines that have yielded (or are ready to start) can be triggered.
+// A coroutine waiting for a file descriptor will be woken by the fd.
+void CoroutineTriggerEvent(Coroutine* c) {
+  if (c->state == kCoReady || c->state == kCoYielded) {
+    AddToReadyQueue(c);
+  }
+}
+
+void CoroutineClearEvent(Coroutine* c) {
+  RemoveFromReadyQueue(c);
+  CountNotReady(c);
+}
+
+bool CoroutineIsAlive(Coroutine* c, Coroutine* query) {
+  CoroutineMachine* m = c->machine;
+  return query->id < m->num_ids &&
+         m->ids[query->id].generation == query->generation;
+}
+
+void CoroutineYield(Coroutine* c) {
+  c->state = kCoYielded;
+  c->yielded_address = __builtin_return_address(0);
+  c->last_tick = c->machine->tick_count;
+  AddToReadyQueue(c);
+  SwitchToMachine(c);
+  // We get here when resumed.
+}
+
+// Direct switches between callers and callees bypass the machine.  To
+// stop a pair of coroutines from hogging the CPU, every kCoReadyRunLength
+// direct switches we go through the machine instead.
+static bool CanSwitchDirectly(CoroutineMachine* m) {
+  if (++m->direct_switches < kCoReadyRunLength) {
+    return true;
+  }
+  m->direct_switches = 0;
+  return false;
+}
+
+void CoroutineYieldValue(Coroutine* c, void* value) {
+  // Copy value.
+  if (c->result != NULL) {
+    memcpy(c->result, value, c->result_size);
+  }
+
+  // Yield control to another coroutine but don't trigger a wakup event.
+  // This will be done when another call is made.
+  c->state = kCoYielded;
+  c->last_tick = c->machine->tick_count;
+  Coroutine* caller = c->caller;
+  if (caller != NULL && caller->state == kCoYielded && !caller->is_ready &&
+      CanSwitchDirectly(c->machine)) {
+    // The caller is parked waiting for the value, switch straight to it.
+    CoroutineSwitch(c, caller);
+  } else {
+    if (caller != NULL) {
+      // Tell caller that there's a value available.
+      CoroutineTriggerEvent(caller);
+    }
+    SwitchToMachine(c);
+  }
+  // We get here when resumed from another call.
+}
+
+void CoroutineCall(Coroutine* c, Coroutine* callee, void* result,
+                   size_t result_size) {
+  // Tell the callee that it's being called and where to store the value.
+  callee->caller = c;
+  callee->result = result;
+  callee->result_size = result_size;
+
+  // Start the callee running if it's not already running.
+  if (callee->state == kCoNew) {
+    CoroutineStart(callee);
+  }
+  c->state = kCoYielded;
+  c->last_tick = c->machine->tick_count;
+  if ((callee->state == kCoReady || callee->state == kCoYielded) &&
+      CanSwitchDirectly(c->machine)) {
+    // The callee can run now so switch straight to it.
+    RemoveFromReadyQueue(callee);
+    CoroutineSwitch(c, callee);
+  } else {
+    // If it's running we trigger its event to wake it up.  If it's
+    // waiting for a fd it will run when that is ready.
+    CoroutineTriggerEvent(callee);
+    SwitchToMachine(c);
+  }
+  // When we get here, the callee has done its work.  Remove this coroutine's
+  // state from it.
+  callee->caller = NULL;
+  callee->result = NULL;
+}
+
+// Called when a coroutine gives the machine back a slice that a watchdog
+// wanted ended, with the address it yielded from.  The coroutines waiting
+// for I/O and timers have waited long enough, so the machine polls next
+// rather than finishing its run of ready coroutines.
+static void ReportOverrun(CoroutineMachine* m, Coroutine* c) {
+  m->overruns++;
+  m->ready_run = 0;
+  if (!m->report_overruns) {
+    return;
+  }
+  uint64_t since =
+      atomic_load_explicit(&m->preempt_since, memory_order_relaxed);
+  fprintf(stderr,
+          "Coroutine %zd: %s: ran for %.1fms without yielding: address: %p\n",
+          c->id, CoroutineGetName(c), (NowNanos() - since) / 1e6,
+          c->yielded_address);
+}
+
+// Runs a coroutine from the machine's main loop.
+static void Resume(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  switch (c->state) {
+    case kCoReady:
+    case kCoYielded:
+    case kCoWaiting:
+      SwitchToCoroutine(&m->sp, c);
+      break;
+    case kCoRunning:
+    case kCoNew:
+    case kCoDead:
+      // Should never get here.
+      return;
+  }
+  // We get here when a coroutine switches back to the machine.  This might
+  // not be the coroutine we resumed if it switched directly to another.
+  Coroutine* current = m->current;
+  m->current = NULL;
+  uint64_t slice = atomic_load_explicit(&m->slice, memory_order_relaxed);
+  atomic_store_explicit(&m->slice, slice + 1, memory_order_relaxed);
+  if (atomic_load_explicit(&m->preempt_slice, memory_order_acquire) ==
+      slice) {
+    ReportOverrun(m, current);
+  }
+  if (current->state == kCoDead) {
+    Reap(current);
+  }
+}
+
+// Cleans up after a coroutine has died.  This is called on the machine's
+// stack since the coroutine's stack is freed.
+static void Reap(Coroutine* c) {
+  // Trigger the caller when we exit.
+  if (c->caller != NULL) {
+    CoroutineTriggerEvent(c->caller);
+  }
+  if (c->group != NULL) {
+    CoroutineGroupRemove(c->group, c);
+  }
+  CoroutineMachineRemoveCoroutine(c->machine, c);
+  CountEvent(c->machine, exits);
+  if (c->stack_painted) {
+    RecordStackUse(c);
+  }
+
+  // Destruct the coroutine, freeing the memory if necessary.
+  if (c->needs_free) {
+    CoroutineDelete(c);
+  } else {
+    CoroutineDestruct(c);
+  }
+}
+
+void CoroutineSetUserData(Coroutine* c, void* user_data) {
+  c->user_data = user_data;
+}
+
+void* CoroutineGetUserData(Coroutine* c) { return c->user_data; }
+
+static void AddPollFd(CoroutineMachine* m, struct pollfd* fd) {
+  if (m->num_pollfds >= m->pollfd_capacity) {
+    nfds_t new_capacity = m->pollfd_capacity == 0 ? 2 : m->pollfd_capacity * 2;
+    m->pollfds = realloc(m->pollfds, new_capacity * sizeof(*fd));
+    m->pollfd_capacity = new_capacity;
+  }
+  m->pollfds[m->num_pollfds] = *fd;
+  m->num_pollfds++;
+}
+
+// Only coroutines waiting for file descriptors need to be polled.  Everything
+// else that can run is on the ready queue.  The set of pollfds is kept up to
+// date as coroutines start and stop waiting, so polling never has to look at
+// the coroutines that aren't ready, and the pollfds are packed together.
+static bool PollInit(CoroutineMachine* m) {
+  m->num_pollfds = 0;
+  VectorClear(&m->blocked_coroutines);
+  AddPollFd(m, &m->interrupt_fd);
+  return true;
+}
+
+static void PollDestruct(CoroutineMachine* m) {
+  free(m->pollfds);
+  m->pollfds = NULL;
+  m->pollfd_capacity = 0;
+}
+
+static bool PollWaitFd(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  c->poller_slot = m->num_pollfds;
+  AddPollFd(m, &c->wait_fd);
+  VectorAppend(&m->blocked_coroutines, c);
+  return true;
+}
+
+// Removes the coroutine's pollfd, moving the last one into its slot.
+static void PollResumed(Coroutine* c) {
+  if (c->poller_slot == 0) {
+    return;
+  }
+  CoroutineMachine* m = c->machine;
+  nfds_t last = m->num_pollfds - 1;
+  if (c->poller_slot != last) {
+    Coroutine* moved = m->blocked_coroutines.value.p[last - 1];
+    m->pollfds[c->poller_slot] = m->pollfds[last];
+    m->blocked_coroutines.value.p[c->poller_slot - 1] = moved;
+    moved->poller_slot = c->poller_slot;
+  }
+  m->num_pollfds--;
+  VectorPop(&m->blocked_coroutines);
+  c->poller_slot = 0;
+}
+
+static int PollPoll(CoroutineMachine* m, int timeout) {
+  int num_ready = poll(m->pollfds, m->num_pollfds, timeout);
+  if (num_ready <= 0) {
+    return num_ready;
+  }
+  if (m->pollfds[0].revents != 0) {
+    // Interrupted.
+    ClearEvent(m->interrupt_fd.fd);
+  }
+  for (size_t i = 1; i < m->num_pollfds; i++) {
+    struct pollfd* fd = &m->pollfds[i];
+    if (fd->revents != 0) {
+      Coroutine* c = m->blocked_coroutines.value.p[i - 1];
+      c->wait_fd.revents = fd->revents;
+      VectorAppend(&m->runnables, c);
+    }
+  }
+  return num_ready;
+}
+
+static void PollForget(CoroutineMachine* m, int fd) {}
+
+static const CoroutinePoller poll_poller = {
+    .init = PollInit,
+    .destruct = PollDestruct,
+    .wait_fd = PollWaitFd,
+    .resumed = PollResumed,
+    .poll = PollPoll,
+    .forget = PollForget,
+};
+
+// Functions common to the native pollers.
+
+// Maximum number of events we get from the kernel in one call.
+#define kCoMaxPollerEvents 256
+
+static CoroutinePollerFd* GetPollerFd(CoroutineMachine* m, int fd) {
+  if (fd >= m->poller_fds_capacity) {
+    size_t new_capacity =
+        m->poller_fds_capacity == 0 ? 64 : m->poller_fds_capacity;
+    while (new_capacity <= fd) {
+      new_capacity *= 2;
+    }
+    m->poller_fds =
+        realloc(m->poller_fds, new_capacity * sizeof(CoroutinePollerFd));
+    memset(&m->poller_fds[m->poller_fds_capacity], 0,
+           (new_capacity - m->poller_fds_capacity) * sizeof(CoroutinePollerFd));
+    m->poller_fds_capacity = new_capacity;
+  }
+  return &m->poller_fds[fd];
+}
+
+// Sets the coroutine as the waiter for the fd and works out the events we
+// need to have registered.  Returns true if the current registration
+// already covers them, in which case no system call is needed.
+static bool SetPollerFdWaiter(Coroutine* c, CoroutinePollerFd* pfd,
+                              short* events) {
+  short mask = c->wait_fd.events;
+  if ((mask & POLLIN) != 0) {
+    pfd->in_waiter = c;
+  }
+  if ((mask & POLLOUT) != 0) {
+    pfd->out_waiter = c;
+  }
+  short wanted = (pfd->in_waiter != NULL ? POLLIN : 0) |
+                 (pfd->out_waiter != NULL ? POLLOUT : 0);
+  if (pfd->serial == c->serial && pfd->events == wanted) {
+    // Registration was made by this coroutine and is still armed.
+    return true;
+  }
+  *events = wanted;
+  return false;
+}
+
+static void ClearPollerFdWaiter(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  int fd = c->wait_fd.fd;
+  if (fd < 0 || fd >= m->poller_fds_capacity) {
+    return;
+  }
+  CoroutinePollerFd* pfd = &m->poller_fds[fd];
+  if (pfd->in_waiter == c) {
+    pfd->in_waiter = NULL;
+  }
+  if (pfd->out_waiter == c) {
+    pfd->out_waiter = NULL;
+  }
+}
+
+// Adds a coroutine woken by the poller to the runnables.  A coroutine
+// waiting for both input and output can be woken twice.
+static void AddRunnable(CoroutineMachine* m, Coroutine* c, short revents) {
+  if (c->state != kCoWaiting) {
+    return;
+  }
+  if (c->wait_fd.revents == 0) {
+    VectorAppend(&m->runnables, c);
+    CountReady(c);
+  }
+  c->wait_fd.revents |= revents;
+}
+
+#if defined(__linux__)
+static bool EpollControl(CoroutineMachine* m, int op, int fd, short events) {
+  struct epoll_event e = {.events = events, .data.fd = fd};
+  int r = epoll_ctl(m->poller_fd, op, fd, &e);
+  if (r == -1 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+    // The fd has been closed and reopened since it was registered.
+    r = epoll_ctl(m->poller_fd, EPOLL_CTL_ADD, fd, &e);
+  } else if (r == -1 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+    r = epoll_ctl(m->poller_fd, EPOLL_CTL_MOD, fd, &e);
+  }
+  return r == 0;
+}
+
+static bool EpollInit(CoroutineMachine* m) {
+  m->poller_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (m->poller_fd == -1) {
+    return false;
+  }
+  if (!EpollControl(m, EPOLL_CTL_ADD, m->interrupt_fd.fd, EPOLLIN)) {
+    close(m->poller_fd);
+    m->poller_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+static void EpollDestruct(CoroutineMachine* m) {
+  if (m->poller_fd != -1) {
+    close(m->poller_fd);
+    m->poller_fd = -1;
+  }
+}
+
+static bool EpollWaitFd(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  int fd = c->wait_fd.fd;
+  CoroutinePollerFd* pfd = GetPollerFd(m, fd);
+  short events;
+  if (SetPollerFdWaiter(c, pfd, &events)) {
+    return true;
+  }
+  int op = pfd->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (!EpollControl(m, op, fd, events)) {
+    // Probably a regular file (EPERM).  These are always ready.
+    ClearPollerFdWaiter(c);
+    pfd->events = 0;
+    return false;
+  }
+  pfd->events = events;
+  pfd->serial = c->serial;
+  return true;
+}
+
+static void EpollDisarm(CoroutineMachine* m, int fd, CoroutinePollerFd* pfd,
+                        short unwanted) {
+  short events = pfd->events & ~unwanted;
+  if (events == 0) {
+    epoll_ctl(m->poller_fd, EPOLL_CTL_DEL, fd, NULL);
+  } else {
+    EpollControl(m, EPOLL_CTL_MOD, fd, events);
+  }
+  pfd->events = events;
+}
+
+static int EpollPoll(CoroutineMachine* m, int timeout) {
+  struct epoll_event events[kCoMaxPollerEvents];
+  int num_events = epoll_wait(m->poller_fd, events, kCoMaxPollerEvents, timeout);
+  if (num_events <= 0) {
+    return num_events;
+  }
+  for (int i = 0; i < num_events; i++) {
+    int fd = events[i].data.fd;
+    uint32_t revents = events[i].events;
+    if (fd == m->interrupt_fd.fd) {
+      // Interrupted.
+      ClearEvent(fd);
+      continue;
+    }
+    CoroutinePollerFd* pfd = GetPollerFd(m, fd);
+    // Error and hangup are reported to all waiters.
+    uint32_t error = revents & (EPOLLERR | EPOLLHUP);
+    short unwanted = 0;
+    if ((revents & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) != 0) {
+      if (pfd->in_waiter != NULL) {
+        AddRunnable(m, pfd->in_waiter, revents & (EPOLLIN | error));
+      } else {
+        unwanted |= POLLIN;
+      }
+    }
+    if ((revents & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0) {
+      if (pfd->out_waiter != NULL) {
+        AddRunnable(m, pfd->out_waiter, revents & (EPOLLOUT | error));
+      } else {
+        unwanted |= POLLOUT;
+      }
+    }
+    // Events for which there is no waiter are disarmed here, so a fd
+    // that nobody is waiting for doesn't keep waking us up.
+    if ((unwanted & pfd->events) != 0) {
+      EpollDisarm(m, fd, pfd, unwanted);
+    }
+  }
+  return num_events;
+}
+
+static void EpollForget(CoroutineMachine* m, int fd) {
+  if (fd < 0 || fd >= m->poller_fds_capacity) {
+    return;
+  }
+  CoroutinePollerFd* pfd = &m->poller_fds[fd];
+  if (pfd->events != 0) {
+    epoll_ctl(m->poller_fd, EPOLL_CTL_DEL, fd, NULL);
+  }
+  memset(pfd, 0, sizeof(*pfd));
+}
+
+static const CoroutinePoller native_poller = {
+    .init = EpollInit,
+    .destruct = EpollDestruct,
+    .wait_fd = EpollWaitFd,
+    .resumed = ClearPollerFdWaiter,
+    .poll = EpollPoll,
+    .forget = EpollForget,
+};
+
+// The io_uring poller.  A coroutine waiting for a fd submits a one-shot
+// IORING_OP_POLL_ADD and a coroutine doing I/O submits the operation
+// itself.  The submissions are made when the machine next polls, in one
+// system call that also waits for completions.
+//
+// Each submission has a CoroutineIoOp as its user data.  A coroutine that
+// stops waiting for a poll before it completes (because its timer expired)
+// abandons the op, which is freed when its completion arrives.  I/O
+// operations are never abandoned as the kernel may still be using their
+// buffers.  A coroutine that is cancelled during one asks the kernel to
+// cancel it and waits for its completion.
+//
+// A poll or cancel that can't be queued because the submission queue is
+// full and can't be submitted (the completion queue has overflowed) is
+// deferred, as is the poll that re-arms the machine's interrupt.  The
+// machine queues them when it next polls, after taking the completions.
+//
+// io_uring fails I/O on a non-blocking fd that isn't ready with EAGAIN.
+// Once we know that the fd would block, the operation is linked behind a
+// poll for it, so the kernel waits for the fd and then does the I/O, all
+// in one submission.  The poll's user data is the op's with
+// kCoUringLinkedPoll set.
+
+#define kCoUringEntries 256
+
+// User data for completions that aren't for an op.
+#define kCoUringInterrupt 0
+#define kCoUringIgnore 1
+#define kCoUringLinkedPoll 1  // A bit in an op's address.
+
+typedef struct CoroutineIoOp {
+  Coroutine* coroutine;  // NULL if abandoned.
+  int32_t result;
+  bool done;
+  bool is_poll;     // A wait for a fd rather than I/O.
+  bool linked;      // Behind a poll for its fd.
+  bool cancelling;  // Cancelled, or an abandoned poll being cancelled.
+  bool deferred;    // On the machine's deferred list.
+  struct CoroutineIoOp* next;  // In the free or deferred list.
+} CoroutineIoOp;
+
+static CoroutineIoOp* NewIoOp(CoroutineMachine* m, Coroutine* c,
+                              bool is_poll) {
+  CoroutineIoOp* op = m->free_io_ops;
+  if (op != NULL) {
+    m->free_io_ops = op->next;
+  } else {
+    op = malloc(sizeof(CoroutineIoOp));
+    VectorAppend(&m->io_ops, op);
+  }
+  op->coroutine = c;
+  op->result = 0;
+  op->done = false;
+  op->is_poll = is_poll;
+  op->linked = false;
+  op->cancelling = false;
+  op->deferred = false;
+  c->io_op = op;
+  return op;
+}
+
+static void FreeIoOp(CoroutineMachine* m, CoroutineIoOp* op) {
+  op->next = m->free_io_ops;
+  m->free_io_ops = op;
+}
+
+static void PreparePoll(struct io_uring_sqe* sqe, int fd, short events,
+                        uint64_t user_data) {
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = user_data;
+}
+
+static void PrepareCancel(struct io_uring_sqe* sqe, uint64_t user_data) {
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data;
+  sqe->user_data = kCoUringIgnore;
+}
+
+// Asks the kernel to cancel an I/O operation and the poll it's behind.
+// Returns false if there's no room.
+static bool QueueCancel(CoroutineMachine* m, CoroutineIoOp* op) {
+  if (!UringReserve(m->uring, 2)) {
+    return false;
+  }
+  PrepareCancel(UringGetSqe(m->uring), (uintptr_t)op);
+  if (op->linked) {
+    PrepareCancel(UringGetSqe(m->uring), (uintptr_t)op | kCoUringLinkedPoll);
+  }
+  return true;
+}
+
+static bool ArmInterrupt(CoroutineMachine* m) {
+  struct io_uring_sqe* sqe = UringGetSqe(m->uring);
+  if (sqe == NULL) {
+    return false;
+  }
+  PreparePoll(sqe, m->interrupt_fd.fd, POLLIN, kCoUringInterrupt);
+  return true;
+}
+
+static void UringPollerDestruct(CoroutineMachine* m) {
+  if (m->uring != NULL) {
+    UringDestruct(m->uring);
+    free(m->uring);
+    m->uring = NULL;
+  }
+  for (size_t i = 0; i < m->io_ops.length; i++) {
+    free(m->io_ops.value.p[i]);
+  }
+  VectorClear(&m->io_ops);
+  m->free_io_ops = NULL;
+  m->deferred_io_ops = NULL;
+  m->interrupt_deferred = false;
+}
+
+static bool UringPollerInit(CoroutineMachine* m) {
+  m->uring = malloc(sizeof(Uring));
+  if (!UringInit(m->uring, kCoUringEntries) || !ArmInterrupt(m)) {
+    UringPollerDestruct(m);
+    return false;
+  }
+  return true;
+}
+
+static void DeferIoOp(CoroutineMachine* m, CoroutineIoOp* op) {
+  op->deferred = true;
+  op->next = m->deferred_io_ops;
+  m->deferred_io_ops = op;
+}
+
+// Queues a deferred poll, or the cancel for a deferred I/O operation or
+// abandoned poll.
+static bool QueueDeferredOp(CoroutineMachine* m, CoroutineIoOp* op) {
+  if (op->cancelling) {
+    return QueueCancel(m, op);
+  }
+  struct io_uring_sqe* sqe = UringGetSqe(m->uring);
+  if (sqe == NULL) {
+    return false;
+  }
+  Coroutine* c = op->coroutine;
+  PreparePoll(sqe, c->wait_fd.fd, c->wait_fd.events, (uintptr_t)op);
+  return true;
+}
+
+// Queues the interrupt's poll and the deferred ops, as far as there is
+// room.  Ops that have completed, and polls that were given up before they
+// were queued, don't need queuing any more.  Those that have no coroutine
+// are freed.  Returns false if some are still deferred.
+static bool QueueDeferred(CoroutineMachine* m) {
+  if (m->interrupt_deferred) {
+    if (!ArmInterrupt(m)) {
+      return false;
+    }
+    m->interrupt_deferred = false;
+  }
+  while (m->deferred_io_ops != NULL) {
+    CoroutineIoOp* op = m->deferred_io_ops;
+    bool queue = !op->done && (op->coroutine != NULL || op->cancelling);
+    if (queue && !QueueDeferredOp(m, op)) {
+      return false;
+    }
+    m->deferred_io_ops = op->next;
+    op->deferred = false;
+    if (op->coroutine == NULL && !queue) {
+      FreeIoOp(m, op);
+    }
+  }
+  return true;
+}
+
+// The wait always goes ahead, now or, if there's no room, once the machine
+// has taken the completions.
+static bool UringPollerWaitFd(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  CoroutineIoOp* op = NewIoOp(m, c, true);
+  struct io_uring_sqe* sqe = UringGetSqe(m->uring);
+  if (sqe == NULL) {
+    DeferIoOp(m, op);
+    return true;
+  }
+  PreparePoll(sqe, c->wait_fd.fd, c->wait_fd.events, (uintptr_t)op);
+  return true;
+}
+
+// Picks up the result of the coroutine's op, or abandons it and asks the
+// kernel to cancel it if it hasn't completed.
+static void UringPollerResumed(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  CoroutineIoOp* op = c->io_op;
+  if (op == NULL) {
+    return;
+  }
+  c->io_op = NULL;
+  if (op->done) {
+    c->io_result = op->cancelling ? -ECANCELED : op->result;
+    if (op->deferred) {
+      // Its cancel hasn't been queued; the deferred list frees it.
+      op->coroutine = NULL;
+    } else {
+      FreeIoOp(m, op);
+    }
+    return;
+  }
+  op->coroutine = NULL;
+  c->io_result = -ECANCELED;
+  if (op->deferred) {
+    // Never queued; the deferred list frees it.
+    return;
+  }
+  // Until the poll is cancelled the kernel holds on to the fd.
+  op->cancelling = true;
+  if (!QueueCancel(m, op)) {
+    DeferIoOp(m, op);
+  }
+}
+
+// An I/O operation can't be abandoned, so the coroutine waits for the
+// kernel to cancel it, or for it to complete first.  Either way the
+// coroutine gets ECANCELED.
+static bool UringPollerCancel(Coroutine* c) {
+  CoroutineIoOp* op = c->io_op;
+  if (op == NULL || op->is_poll) {
+    return false;
+  }
+  op->cancelling = true;
+  if (!QueueCancel(c->machine, op)) {
+    DeferIoOp(c->machine, op);
+  }
+  return true;
+}
+
+static int UringPollerPoll(CoroutineMachine* m, int timeout) {
+  if (!QueueDeferred(m)) {
+    // Come straight back for the rest.
+    timeout = 0;
+  }
+  // If the kernel can't take the submissions yet, taking the completions
+  // will make room.
+  if (UringSubmitAndWait(m->uring, timeout) == -1 && errno != EBUSY &&
+      errno != EAGAIN) {
+    return -1;
+  }
+  int num_events = 0;
+  struct io_uring_cqe* cqe;
+  while ((cqe = UringPeekCqe(m->uring)) != NULL) {
+    uint64_t user_data = cqe->user_data;
+    int32_t result = cqe->res;
+    UringSeenCqe(m->uring);
+    num_events++;
+    if (user_data == kCoUringInterrupt) {
+      ClearEvent(m->interrupt_fd.fd);
+      if (!ArmInterrupt(m)) {
+        m->interrupt_deferred = true;
+      }
+      continue;
+    }
+    if (user_data == kCoUringIgnore ||
+        (user_data & kCoUringLinkedPoll) != 0) {
+      // The op linked to a poll has its own completion.
+      continue;
+    }
+    CoroutineIoOp* op = (CoroutineIoOp*)(uintptr_t)user_data;
+    op->done = true;
+    op->result = result;
+    if (op->coroutine == NULL) {
+      // One still on the deferred list is freed from there.
+      if (!op->deferred) {
+        FreeIoOp(m, op);
+      }
+      continue;
+    }
+    // A poll's result is its revents.  Completed I/O makes the coroutine
+    // ready for what it was waiting for.
+    Coroutine* c = op->coroutine;
+    short revents = c->wait_fd.events;
+    if (op->is_poll) {
+      revents = result > 0 ? (short)result : POLLERR;
+    }
+    AddRunnable(m, c, revents);
+  }
+  return num_events;
+}
+
+static void UringPollerForget(CoroutineMachine* m, int fd) {}
+
+static const CoroutinePoller uring_poller = {
+    .init = UringPollerInit,
+    .destruct = UringPollerDestruct,
+    .wait_fd = UringPollerWaitFd,
+    .resumed = UringPollerResumed,
+    .poll = UringPollerPoll,
+    .forget = UringPollerForget,
+    .cancel = UringPollerCancel,
+    .one_shot = true,
+};
+
+#elif defined(__APPLE__)
+// Applies the changes to a filter for a fd.  The kqueue keeps read and
+// write filters separately.
+static bool KqueueChangeFilters(CoroutineMachine* m, int fd, short old_events,
+                                short new_events, bool force) {
+  struct kevent changes[2];
+  int num_changes = 0;
+  if ((new_events & POLLIN) != 0 && (force || (old_events & POLLIN) == 0)) {
+    EV_SET(&changes[num_changes++], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+  } else if ((new_events & POLLIN) == 0 && (old_events & POLLIN) != 0) {
+    EV_SET(&changes[num_changes++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  }
+  if ((new_events & POLLOUT) != 0 && (force || (old_events & POLLOUT) == 0)) {
+    EV_SET(&changes[num_changes++], fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+  } else if ((new_events & POLLOUT) == 0 && (old_events & POLLOUT) != 0) {
+    EV_SET(&changes[num_changes++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+  }
+  if (num_changes == 0) {
+    return true;
+  }
+  return kevent(m->poller_fd, changes, num_changes, NULL, 0, NULL) == 0;
+}
+
+static bool KqueueInit(CoroutineMachine* m) {
+  m->poller_fd = kqueue();
+  if (m->poller_fd == -1) {
+    return false;
+  }
+  // The interrupt fd is a kqueue too and can be waited for in ours.
+  if (!KqueueChangeFilters(m, m->interrupt_fd.fd, 0, POLLIN, true)) {
+    close(m->poller_fd);
+    m->poller_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+static void KqueueDestruct(CoroutineMachine* m) {
+  if (m->poller_fd != -1) {
+    close(m->poller_fd);
+    m->poller_fd = -1;
+  }
+}
+
+static bool KqueueWaitFd(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  int fd = c->wait_fd.fd;
+  CoroutinePollerFd* pfd = GetPollerFd(m, fd);
+  short events;
+  if (SetPollerFdWaiter(c, pfd, &events)) {
+    return true;
+  }
+  // If the registration wasn't made by this coroutine, the fd might have
+  // been closed and reused, so make sure that the filters are added.
+  bool force = pfd->serial != c->serial;
+  if (!KqueueChangeFilters(m, fd, pfd->events, events, force)) {
+    ClearPollerFdWaiter(c);
+    pfd->events = 0;
+    return false;
+  }
+  pfd->events = events;
+  pfd->serial = c->serial;
+  return true;
+}
+
+static int KqueuePoll(CoroutineMachine* m, int timeout) {
+  struct kevent events[kCoMaxPollerEvents];
+  struct timespec ts;
+  struct timespec* tsp = NULL;
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    tsp = &ts;
+  }
+  int num_events =
+      kevent(m->poller_fd, NULL, 0, events, kCoMaxPollerEvents, tsp);
+  if (num_events <= 0) {
+    return num_events;
+  }
+  for (int i = 0; i < num_events; i++) {
+    int fd = (int)events[i].ident;
+    if (fd == m->interrupt_fd.fd) {
+      // Interrupted.
+      ClearEvent(fd);
+      continue;
+    }
+    CoroutinePollerFd* pfd = GetPollerFd(m, fd);
+    short error = (events[i].flags & EV_EOF) != 0 ? POLLHUP : 0;
+    if ((events[i].flags & EV_ERROR) != 0) {
+      error |= POLLERR;
+    }
+    if (events[i].filter == EVFILT_READ) {
+      if (pfd->in_waiter != NULL) {
+        AddRunnable(m, pfd->in_waiter, POLLIN | error);
+      } else if ((pfd->events & POLLIN) != 0) {
+        // Nobody waiting, disarm it.
+        KqueueChangeFilters(m, fd, pfd->events, pfd->events & ~POLLIN, false);
+        pfd->events &= ~POLLIN;
+      }
+    } else if (events[i].filter == EVFILT_WRITE) {
+      if (pfd->out_waiter != NULL) {
+        AddRunnable(m, pfd->out_waiter, POLLOUT | error);
+      } else if ((pfd->events & POLLOUT) != 0) {
+        KqueueChangeFilters(m, fd, pfd->events, pfd->events & ~POLLOUT, false);
+        pfd->events &= ~POLLOUT;
+      }
+    }
+  }
+  return num_events;
+}
+
+static void KqueueForget(CoroutineMachine* m, int fd) {
+  if (fd < 0 || fd >= m->poller_fds_capacity) {
+    return;
+  }
+  CoroutinePollerFd* pfd = &m->poller_fds[fd];
+  if (pfd->events != 0) {
+    KqueueChangeFilters(m, fd, pfd->events, 0, false);
+  }
+  memset(pfd, 0, sizeof(*pfd));
+}
+
+static const CoroutinePoller native_poller = {
+    .init = KqueueInit,
+    .destruct = KqueueDestruct,
+    .wait_fd = KqueueWaitFd,
+    .resumed = ClearPollerFdWaiter,
+    .poll = KqueuePoll,
+    .forget = KqueueForget,
+};
+#endif
+
+void CoroutineMachineOptionsInit(CoroutineMachineOptions* options) {
+  options->poller = kCoDefaultPoller;
+  options->scheduler_mode = kCoScheduleBatch;
+  options->stack_allocator = kCoStackPool;
+  options->max_free_stacks = kCoDefaultMaxFreeStacks;
+  options->stack_sizing = kCoStackSizeFixed;
+}
 
 void CoroutineMachineInit(CoroutineMachine* m) {
+  CoroutineMachineOptions options;
+  CoroutineMachineOptionsInit(&options);
+  CoroutineMachineInitWithOptions(m, &options);
+}
+
+void CoroutineMachineInitWithPoller(CoroutineMachine* m,
+                                    CoroutinePollerType poller) {
+  CoroutineMachineOptions options;
+  CoroutineMachineOptionsInit(&options);
+  options.poller = poller;
+  CoroutineMachineInitWithOptions(m, &options);
+}
+
+void CoroutineMachineInitWithOptions(CoroutineMachine* m,
+                                     const CoroutineMachineOptions* options) {
   ListInit(&m->coroutines);
-  BitSetInit(&m->coroutine_ids);
-  m->next_coroutine_id = 0;
+  m->ids = NULL;
+  m->num_ids = 0;
+  m->ids_capacity = 0;
+  m->free_id = kCoNoFreeId;
   m->running = false;
   m->pollfds = NULL;
   m->pollfd_capacity = 0;
@@ -375,164 +2074,390 @@ void CoroutineMachineInit(CoroutineMachine* m) {
   m->interrupt_fd.fd = NewEventFd();
   m->interrupt_fd.events = POLLIN;
   m->tick_count = 0;
-  m->last_freed_coroutine_id = -1;
-}
+  for (int i = 0; i < kCoNumPriorities; i++) {
+    ListInit(&m->ready_coroutines[i]);
+  }
+  m->ready_levels = 0;
+  m->num_ready = 0;
+  m->ready_run = 0;
+  m->poller_fd = -1;
+  m->poller_fds = NULL;
+  m->poller_fds_capacity = 0;
+  m->num_waiting = 0;
+  VectorInit(&m->runnables);
+  m->next_serial = 0;
+  m->scheduler_mode = options->scheduler_mode;
+  m->stack_allocator = options->stack_allocator;
+  StackPoolInit(&m->stack_pool, options->max_free_stacks);
+  m->stack_sizing = options->stack_sizing;
+  HashMapInitForPointerKeys(&m->stack_profiles);
+  m->sp = NULL;
+  m->current = NULL;
+  m->direct_switches = 0;
+  atomic_init(&m->slice, 0);
+  atomic_init(&m->preempt_slice, 0);
+  atomic_init(&m->preempt_since, 0);
+  m->overruns = 0;
+  m->report_overruns = false;
+  TimerWheelInit(&m->timers, NowTicks());
+  atomic_init(&m->inbox, NULL);
+  atomic_init(&m->wakeups, NULL);
+  atomic_init(&m->completions, NULL);
+  m->thread_pool = NULL;
+  m->hooks = NULL;
+  m->hooks_arg = NULL;
+  m->uring = NULL;
+  m->free_io_ops = NULL;
+  m->deferred_io_ops = NULL;
+  m->interrupt_deferred = false;
+  VectorInit(&m->io_ops);
+  m->buffers_registered = false;
+#if defined(COROUTINE_METRICS)
+  memset(&m->counters, 0, sizeof(m->counters));
+  atomic_store(&m->counters.current_id, (size_t)-1);
+#endif
+#if defined(COROUTINE_TRACE)
+  m->trace = NULL;
+#endif
 
-static void AddPollFd(CoroutineMachine* m, struct pollfd* fd) {
-  if (m->num_pollfds >= m->pollfd_capacity) {
-    nfds_t new_capacity = m->pollfd_capacity == 0 ? 2 : m->pollfd_capacity * 2;
-    m->pollfds = realloc(m->pollfds, new_capacity * sizeof(*fd));
-    m->pollfd_capacity = new_capacity;
+  CoroutinePollerType type = options->poller;
+#if defined(__linux__)
+  if (type == kCoPollerUring) {
+    m->poller = &uring_poller;
+    if (m->poller->init(m)) {
+      return;
+    }
+  }
+#endif
+  // Fall back to poll if we can't make the native poller.
+  m->poller = type == kCoPollerPoll ? &poll_poller : &native_poller;
+  if (!m->poller->init(m)) {
+    m->poller = &poll_poller;
+    m->poller->init(m);
   }
-  m->pollfds[m->num_pollfds] = *fd;
-  m->num_pollfds++;
 }
 
+// Orders coroutines by priority and then so that the one that has been
+// waiting longest (the lowest last_tick) comes first.  The ticks are
+// compared rather than subtracted as the difference doesn't fit in an int.
 static int CompareTick(const void* a, const void* b) {
   Coroutine* const* c1 = a;
   Coroutine* const* c2 = b;
-  uint64_t t1 = (*c1)->machine->tick_count - (*c1)->last_tick;
-  uint64_t t2 = (*c2)->machine->tick_count -  (*c2)->last_tick;
-  return (int)(t2 - t1);
+  if ((*c1)->priority != (*c2)->priority) {
+    return (*c1)->priority < (*c2)->priority ? -1 : 1;
+  }
+  uint64_t t1 = (*c1)->last_tick;
+  uint64_t t2 = (*c2)->last_tick;
+  if (t1 < t2) {
+    return -1;
+  }
+  if (t1 > t2) {
+    return 1;
+  }
+  return 0;
 }
 
-static void BuildPollFds(CoroutineMachine* m) {
-  m->num_pollfds = 0;
-  AddPollFd(m, &m->interrupt_fd);
-  VectorClear(&m->blocked_coroutines);
-  for (ListElement* e = m->coroutines.first; e != NULL; e = e->next) {
-    Coroutine* c = (Coroutine*)e;
-    if (c->state == kCoNew || c->state == kCoRunning || c->state == kCoDead) {
-      continue;
-    }
-    struct pollfd* fd = GetPollFd(c);
-    AddPollFd(m, fd);
-    VectorAppend(&m->blocked_coroutines, c);
-    if (c->state == kCoReady) {
-      // Coroutine is ready to go, trigger its event so that we can start
-      // it.
-      CoroutineTriggerEvent(c);
+// A waiting coroutine that has been chosen to run is no longer waiting for
+// its fd.
+static void WakeWaiter(Coroutine* c) {
+  c->state = kCoYielded;
+  c->machine->num_waiting--;
+  c->machine->poller->resumed(c);
+}
+
+// Called for a coroutine whose timer has expired.  If it was also woken by
+// its fd in this poll it is already in the runnables and the fd wins.
+static void TimerExpired(Timer* t, void* arg) {
+  Coroutine* c = TimerToCoroutine(t);
+  if (c->state != kCoWaiting || c->wait_fd.revents != 0) {
+    return;
+  }
+  c->timed_out = true;
+  WakeWaiter(c);
+  AddToReadyQueue(c);
+}
+
+// A waiting coroutine is woken like one whose timer has expired, but with
+// only the flag to say why.  One that its fd has already woken will see
+// the flag when it runs.  The poller may need to wait for the kernel before
+// it can let the coroutine go.
+void CoroutineCancel(Coroutine* c) {
+  if (c->cancelled || c->state == kCoDead) {
+    return;
+  }
+  c->cancelled = true;
+  if (c->state == kCoWaiting && c->wait_fd.revents == 0) {
+    const CoroutinePoller* poller = c->machine->poller;
+    if (poller->cancel == NULL || !poller->cancel(c)) {
+      WakeWaiter(c);
+      AddToReadyQueue(c);
     }
+  } else if (c->state == kCoYielded && !c->is_ready) {
+    CoroutineUnpark(c);
+  }
+}
+
+bool CoroutineIsCancelled(Coroutine* c) { return c->cancelled; }
+
+// Works out the poll timeout in milliseconds.  We don't block if there are
+// coroutines ready to run, and otherwise only until the next timer.
+static int PollTimeout(CoroutineMachine* m, bool have_ready) {
+  if (have_ready) {
+    return 0;
+  }
+  uint64_t next = TimerWheelNextTick(&m->timers);
+  if (next == kCoTimerNever) {
+    return -1;
   }
+  uint64_t now = NowTicks();
+  if (next <= now) {
+    return 0;
+  }
+  return next - now > INT_MAX ? INT_MAX : (int)(next - now);
 }
 
 // Schedule the next coroutine to run.  This scheduler chooses the
-// coroutine that has been waiting longest.  Unless they are just new
-// no two coroutines can have been waiting for the same amount of time.
-// This is a completely fair scheduler with all coroutines given the
-// same priority.
-//
-// We could use malloc/free here but that is a memory allocation.  The
-// use of alloca or a VLA is much faster, albeit not in POSIX.
+// coroutine with the highest priority that has been waiting longest.
+// Unless they are just new no two coroutines can have been waiting for the
+// same amount of time.  Within a priority this is a completely fair
+// scheduler.  If a coroutine of a higher priority is already ready, the
+// chosen one is queued behind it.
 //
-// If you want this to be more portable, call malloc or calloc and free it
-// after the chosen coroutine is determined.
+// In kCoScheduleOne mode the coroutines that are not chosen remain waiting
+// and will be returned by the poller again.  In kCoScheduleBatch mode, or
+// if the poller won't return them again (an io_uring completion has been
+// consumed), they are all placed on the ready queue in the order they have
+// been waiting and will all be run before we poll again.
+static Coroutine* ChooseRunnable(CoroutineMachine* m) {
+  if (m->runnables.length == 0) {
+    // Only interrrupt set with no coroutines ready.
+    return NULL;
+  }
 
-static Coroutine* ChooseRunnable(CoroutineMachine* m, int num_ready) {
-#ifndef __cplusplus__
-  Coroutine* runnables[num_ready];      // VLA: C99
-#else
-  Coroutine** runnables = alloca(num_ready * sizeof(Coroutine*));
-#endif
-  size_t index = 0;
-  for (size_t i = 1; i < m->num_pollfds; i++) {
-    struct pollfd* fd = &m->pollfds[i];
-    if (fd->revents != 0) {
-      runnables[index++] = m->blocked_coroutines.value.p[i-1];
+  VectorSortPointers(&m->runnables, CompareTick);
+  Coroutine* chosen = m->runnables.value.p[0];
+  WakeWaiter(chosen);
+  TraceEvent(m, kCoTraceWake, chosen, -1, 0);
+  for (size_t i = 1; i < m->runnables.length; i++) {
+    Coroutine* c = m->runnables.value.p[i];
+    if (m->scheduler_mode == kCoScheduleBatch || m->poller->one_shot) {
+      WakeWaiter(c);
+      AddToReadyQueue(c);
+    } else {
+      c->wait_fd.revents = 0;
     }
   }
-  if (index == 0) {
-    // Only interrrupt set with no coroutines ready.
+  if ((m->ready_levels & ((1u << chosen->priority) - 1)) != 0) {
+    AddToReadyQueue(chosen);
     return NULL;
   }
-  
-  qsort(runnables, index, sizeof(Coroutine*), CompareTick);
-  return runnables[0];
+  return chosen;
 }
 
+// The ready queue is drained without any system calls.  The poller is
+// only called when there are coroutines waiting for file descriptors, and then
+// only when the ready queue is empty or once we have run a round of the
+// ready coroutines.  This stops waiting coroutines from being starved by
+// coroutines that continually yield.
 static Coroutine* GetRunnableCoroutine(CoroutineMachine* m) {
-  BuildPollFds(m);
+  // One more tick.
+  m->tick_count++;
+  CountReadyDepth(m);
 
-  // Wait for coroutines (or the interrupt fd) to trigger.
-  int num_ready = poll(m->pollfds, m->num_pollfds, -1);
-  if (num_ready <= 0) {
-    return NULL;
+  if (m->ready_run > 0 && m->num_ready > 0) {
+    m->ready_run--;
+    return PopReadyQueue(m);
   }
 
-  // One more tick.
-  m->tick_count++;
-  
-  if (m->interrupt_fd.revents != 0) {
-    // Interrupted.
-    ClearEvent(m->interrupt_fd.fd);
+  // Pick up coroutines started by other threads and, with a scheduler,
+  // work from other machines.
+  if (atomic_load_explicit(&m->inbox, memory_order_relaxed) != NULL) {
+    DrainInbox(m);
+  }
+  if (atomic_load_explicit(&m->wakeups, memory_order_relaxed) != NULL) {
+    DrainWakeups(m);
+  }
+  if (atomic_load_explicit(&m->completions, memory_order_relaxed) != NULL) {
+    DrainCompletions(m);
+  }
+  if (m->hooks != NULL) {
+    m->hooks->find_work(m, m->num_ready == 0);
+  }
+
+  bool have_ready = m->num_ready > 0;
+  VectorClear(&m->runnables);
+
+  // If there is nothing waiting for I/O we don't need to poll at all.
+  if (m->num_waiting > 0 || !have_ready) {
+    // Wait for coroutines (or the interrupt fd) to trigger.  If there are
+    // coroutines on the ready queue we just check without blocking.
+    int timeout = PollTimeout(m, have_ready);
+    bool sleeping = false;
+    if (timeout != 0 && m->hooks != NULL) {
+      sleeping = m->hooks->sleep(m);
+      if (!sleeping) {
+        timeout = 0;
+      }
+    }
+    CountPollStart(m);
+    TraceEvent(m, kCoTracePollEnter, NULL, timeout, 0);
+    int num_ready = m->poller->poll(m, timeout);
+    TraceEvent(m, kCoTracePollExit, NULL, num_ready, 0);
+    CountPollEnd(m);
+    if (sleeping) {
+      m->hooks->wake(m);
+    }
+    if (num_ready < 0) {
+      return NULL;
+    }
   }
+
+  // Coroutines whose timers have expired go on the ready queue.
+  if (m->timers.num_timers > 0) {
+    TimerWheelAdvance(&m->timers, NowTicks(), TimerExpired, m);
+  }
+
   if (!m->running) {
     // If we have been asked to stop, there's nothing else to do.
     return NULL;
   }
-  
-  Coroutine* chosen = ChooseRunnable(m, num_ready);
 
-  if (chosen != NULL) {
-    CoroutineClearEvent(chosen);
+  Coroutine* chosen = ChooseRunnable(m);
+  if (chosen == NULL) {
+    chosen = PopReadyQueue(m);
   }
+
+  // Start a new round of the coroutines that are on the ready queue now.
+  // Any that yield during the round go to the back and wait for the next.
+  m->ready_run = m->num_ready;
   return chosen;
 }
 
 void CoroutineMachineDestruct(CoroutineMachine* m) {
-  ListDestruct(&m->coroutines);
-  BitSetDestruct(&m->coroutine_ids);
+  // Coroutines that were started on the machine but never run.
+  Coroutine* c = atomic_exchange(&m->inbox, NULL);
+  while (c != NULL) {
+    Coroutine* next = c->inbox_next;
+    CoroutineDelete(c);
+    c = next;
+  }
+  // Coroutines that hadn't finished when the machine stopped.  Most live
+  // in their stack's block, which has to go back to the pool before the
+  // pool is unmapped.
+  ListElement* e = m->coroutines.first;
+  while (e != NULL) {
+    ListElement* next = e->next;
+    Coroutine* co = (Coroutine*)e;
+    if (co->needs_free) {
+      CoroutineDelete(co);
+    } else {
+      CoroutineDestruct(co);
+    }
+    e = next;
+  }
+  ListInit(&m->coroutines);
+  m->poller->destruct(m);
+  StackPoolDestruct(&m->stack_pool);
+  HashMapDestructWithContents(&m->stack_profiles, FreeStackProfile);
+  free(m->poller_fds);
+  VectorDestruct(&m->runnables);
+  VectorDestruct(&m->blocked_coroutines);
+  VectorDestruct(&m->io_ops);
+  free(m->ids);
+  m->ids = NULL;
   CloseEventFd(m->interrupt_fd.fd);
+#if defined(COROUTINE_TRACE)
+  CoroutineMachineStopTrace(m);
+#endif
 }
 
 void CoroutineMachineRun(CoroutineMachine* m) {
+  CoroutineMachine* previous_machine = current_machine;
+  current_machine = m;
   m->running = true;
   while (m->running) {
-    if (m->coroutines.length == 0) {
-      // No coroutines, nothing to do.
+    if (m->coroutines.length == 0 && m->hooks == NULL &&
+        atomic_load(&m->inbox) == NULL) {
+      // No coroutines, nothing to do.  A machine run by a scheduler keeps
+      // going until the scheduler stops it.
       break;
     }
-    setjmp(m->yield);
-    // We get here any time a coroutine yields or waits.
-
     Coroutine* c = GetRunnableCoroutine(m);
     if (c != NULL) {
       Resume(c);
     }
   }
+  current_machine = previous_machine;
 }
 
 void CoroutineMachineAddCoroutine(CoroutineMachine* m, Coroutine* c) {
   ListAppend(&m->coroutines, &c->element);
+  if (m->hooks != NULL) {
+    m->hooks->added(m);
+  }
+}
+
+// Ends the current generation of the ID and pushes it on the free stack.
+static void FreeId(CoroutineMachine* m, size_t id) {
+  m->ids[id].generation++;
+  m->ids[id].next_free = m->free_id;
+  m->free_id = (uint32_t)id;
 }
 
 // Removes a coroutine but doesn't free it.
 void CoroutineMachineRemoveCoroutine(CoroutineMachine* m, Coroutine* c) {
   ListDeleteElement(&m->coroutines, &c->element);
-  BitSetRemove(&m->coroutine_ids, c->id);
-  m->last_freed_coroutine_id = c->id;
+  FreeId(m, c->id);
+  if (m->hooks != NULL) {
+    m->hooks->removed(m);
+  }
 }
 
+// IDs are taken from the top of the free stack, so the most recently freed
+// ID is reused first, or a new one is added to the table.
 size_t CoroutineMachineAllocateId(CoroutineMachine* m) {
-  size_t id;
-  if (m->last_freed_coroutine_id != -1) {
-    id = m->last_freed_coroutine_id;
-    m->last_freed_coroutine_id = -1;
+  uint32_t id = m->free_id;
+  if (id != kCoNoFreeId) {
+    m->free_id = m->ids[id].next_free;
   } else {
-    id = BitSetFindFirstClear(&m->coroutine_ids);
-    if (id == (size_t)-1) {
-      id = m->next_coroutine_id++;
+    if (m->num_ids == m->ids_capacity) {
+      m->ids_capacity = m->ids_capacity == 0 ? 64 : m->ids_capacity * 2;
+      m->ids = realloc(m->ids, m->ids_capacity * sizeof(CoroutineIdSlot));
     }
+    id = m->num_ids++;
+    m->ids[id].generation = 0;
   }
-  BitSetInsert(&m->coroutine_ids, id);
+  m->ids[id].generation++;
   return id;
 }
 
+void CoroutineMachineSetSchedulerMode(CoroutineMachine* m,
+                                      CoroutineSchedulerMode mode) {
+  m->scheduler_mode = mode;
+}
+
 void CoroutineMachineStop(CoroutineMachine* m) {
   m->running = false;
   TriggerEvent(m->interrupt_fd.fd);
 }
 
+void CoroutineMachineInterrupt(CoroutineMachine* m) {
+  TriggerEvent(m->interrupt_fd.fd);
+}
+
+void CoroutineMachineSetHooks(CoroutineMachine* m,
+                              const CoroutineMachineHooks* hooks, void* arg) {
+  m->hooks = hooks;
+  m->hooks_arg = arg;
+}
+
+static void ShowStackProfile(MapKeyValue* kv, void* data) {
+  CoroutineStackProfile* p = kv->value.p;
+  fprintf(stderr,
+          "  functor %p: %zu coroutines: deepest %zu bytes of %zu\n",
+          (void*)p->functor, p->samples, p->max_used, p->stack_size);
+}
+
 void CoroutineMachineShow(CoroutineMachine* m) {
   for (ListElement* e = m->coroutines.first; e != NULL; e = e->next) {
     Coroutine* co = (Coroutine*)e;
@@ -557,7 +2482,515 @@ void CoroutineMachineShow(CoroutineMachine* m) {
         state = "yielded";
         break;
     }
-    fprintf(stderr, "Coroutine %zd: %s: state: %s: address: %p\n", co->id, co->name.value,
-            state, co->yielded_address);
+    fprintf(stderr, "Coroutine %zd: %s: state: %s: address: %p\n", co->id,
+            CoroutineGetName(co), state, co->yielded_address);
+#if defined(COROUTINE_METRICS)
+    double us = 1e6 / CoroutineCycleFrequency();
+    fprintf(stderr,
+            "  resumes: %llu: running: %.0fus: longest run: %.0fus: "
+            "ready: %.0fus\n",
+            (unsigned long long)co->metrics.resumes,
+            co->metrics.run_cycles * us, co->metrics.max_run_cycles * us,
+            co->metrics.ready_cycles * us);
+#endif
+    if (co->stack_painted) {
+      fprintf(stderr, "  stack: %zu of %zu bytes used\n",
+              CoroutineStackHighWater(co), co->stack_size);
+    }
+  }
+  if (m->stack_profiles.length > 0) {
+    fprintf(stderr, "Stack profiles:\n");
+    HashMapTraverse(&m->stack_profiles, ShowStackProfile, NULL);
+  }
+}
+
+bool CoroutineGetMetrics(Coroutine* c, CoroutineMetrics* metrics) {
+#if defined(COROUTINE_METRICS)
+  *metrics = c->metrics;
+  return true;
+#else
+  memset(metrics, 0, sizeof(*metrics));
+  return false;
+#endif
+}
+
+bool CoroutineMachineGetMetrics(CoroutineMachine* m,
+                                CoroutineMachineMetrics* metrics) {
+  memset(metrics, 0, sizeof(*metrics));
+  metrics->current_id = (size_t)-1;
+#if defined(COROUTINE_METRICS)
+  CoroutineMachineCounters* counters = &m->counters;
+  metrics->switches = atomic_load_explicit(&counters->switches,
+                                           memory_order_relaxed);
+  metrics->polls = atomic_load_explicit(&counters->polls,
+                                        memory_order_relaxed);
+  metrics->poll_cycles = atomic_load_explicit(&counters->poll_cycles,
+                                              memory_order_relaxed);
+  metrics->spawns = atomic_load_explicit(&counters->spawns,
+                                         memory_order_relaxed);
+  metrics->exits = atomic_load_explicit(&counters->exits,
+                                        memory_order_relaxed);
+  metrics->ready_cycles = atomic_load_explicit(&counters->ready_cycles,
+                                               memory_order_relaxed);
+  metrics->max_ready_cycles = atomic_load_explicit(
+      &counters->max_ready_cycles, memory_order_relaxed);
+  for (int i = 0; i < kCoReadyDepthBuckets; i++) {
+    metrics->ready_depth[i] = atomic_load_explicit(&counters->ready_depth[i],
+                                                   memory_order_relaxed);
+  }
+  metrics->current_id = atomic_load_explicit(&counters->current_id,
+                                             memory_order_relaxed);
+  if (metrics->current_id != (size_t)-1) {
+    uint64_t start = atomic_load_explicit(&counters->run_start,
+                                          memory_order_relaxed);
+    uint64_t now = CoroutineCycles();
+    metrics->current_cycles = now > start ? now - start : 0;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+// The counter's rate is read from the CPU on ARM64.  On x86-64 the TSC is
+// timed against the monotonic clock for a few milliseconds.  Threads that
+// race to do this the first time get much the same answer.
+uint64_t CoroutineCycleFrequency(void) {
+  static _Atomic(uint64_t) frequency;
+  uint64_t f = atomic_load_explicit(&frequency, memory_order_relaxed);
+  if (f != 0) {
+    return f;
+  }
+#if defined(__aarch64__)
+  __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(f));
+#elif defined(__x86_64__)
+  uint64_t start_nanos = NowNanos();
+  uint64_t start = CoroutineCycles();
+  struct timespec ts = {.tv_sec = 0, .tv_nsec = 10000000};
+  nanosleep(&ts, NULL);
+  uint64_t nanos = NowNanos() - start_nanos;
+  f = (uint64_t)((CoroutineCycles() - start) * 1e9 / nanos);
+#else
+  f = 1000000000;
+#endif
+  atomic_store_explicit(&frequency, f, memory_order_relaxed);
+  return f;
+}
+
+// I/O.  With the io_uring poller the operation is submitted to the ring
+// and the coroutine waits for its completion like it would for a fd.
+// Otherwise we try the system call and wait for the fd if it would block.
+
+static ssize_t IoResult(int32_t result) {
+  if (result < 0) {
+    errno = -result;
+    return -1;
+  }
+  return result;
+}
+
+#if defined(__linux__)
+// Submits an operation and suspends the coroutine until it completes,
+// returning its result (a negative errno on failure).  The caller may have
+// linked more entries to the operation's, or linked it behind 'poll'.
+static int32_t WaitForIo(Coroutine* c, struct io_uring_sqe* poll,
+                         struct io_uring_sqe* sqe, int fd, short events) {
+  CoroutineMachine* m = c->machine;
+  CoroutineIoOp* op = NewIoOp(m, c, false);
+  sqe->user_data = (uintptr_t)op;
+  if (poll != NULL) {
+    PreparePoll(poll, fd, events, (uintptr_t)op | kCoUringLinkedPoll);
+    poll->flags = IOSQE_IO_LINK;
+    op->linked = true;
+  }
+  c->wait_fd.fd = fd;
+  c->wait_fd.events = events;
+  c->wait_fd.revents = 0;
+  c->last_tick = m->tick_count;
+  c->state = kCoWaiting;
+  m->num_waiting++;
+  SwitchToMachine(c);
+  c->wait_fd.fd = -1;
+  return c->io_result;
+}
+
+// Runs the operation described by 'op'.  A non-blocking fd that isn't
+// ready fails with EAGAIN, so once we know that it would block ('blocked'
+// to start with), the operation goes behind a poll for the fd.  If there's
+// no room in the ring we wait for the fd, which is queued when there is.
+static int32_t UringIo(Coroutine* c, const struct io_uring_sqe* op,
+                       short events, bool blocked) {
+  Uring* u = c->machine->uring;
+  for (;;) {
+    if (c->cancelled) {
+      return -ECANCELED;
+    }
+    if (!UringReserve(u, blocked ? 2 : 1)) {
+      Wait(c, op->fd, events, kCoNoTimeout);
+      continue;
+    }
+    struct io_uring_sqe* poll = blocked ? UringGetSqe(u) : NULL;
+    struct io_uring_sqe* sqe = UringGetSqe(u);
+    *sqe = *op;
+    int32_t result = WaitForIo(c, poll, sqe, op->fd, events);
+    if (result == -ECANCELED && poll != NULL && !c->cancelled) {
+      // The poll failed.  Without it, the operation gives the real error.
+      blocked = false;
+      continue;
+    }
+    if (result != -EAGAIN) {
+      return result;
+    }
+    blocked = true;
+  }
+}
+
+static void PrepareRw(struct io_uring_sqe* op, int opcode, int fd,
+                      const void* buf, size_t length) {
+  memset(op, 0, sizeof(*op));
+  op->opcode = opcode;
+  op->fd = fd;
+  op->addr = (uintptr_t)buf;
+  op->len = length;
+  op->off = (uint64_t)-1;  // The current file position.
+}
+#endif
+
+// Waits for the fd to be ready for I/O that would have blocked.  Returns
+// false, with errno set to ECANCELED, if the coroutine has been cancelled.
+static bool WaitForFd(Coroutine* c, int fd, short events) {
+  if (Wait(c, fd, events, kCoNoTimeout) == kCoWaitCancelled) {
+    errno = ECANCELED;
+    return false;
+  }
+  return true;
+}
+
+ssize_t CoroutineRead(Coroutine* c, int fd, void* buf, size_t length) {
+  c->yielded_address = __builtin_return_address(0);
+#if defined(__linux__)
+  if (c->machine->uring != NULL) {
+    struct io_uring_sqe op;
+    PrepareRw(&op, IORING_OP_READ, fd, buf, length);
+    return IoResult(UringIo(c, &op, POLLIN, false));
+  }
+#endif
+  for (;;) {
+    ssize_t n = read(fd, buf, length);
+    if (n != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return n;
+    }
+    if (!WaitForFd(c, fd, POLLIN)) {
+      return -1;
+    }
+  }
+}
+
+ssize_t CoroutineReadSome(Coroutine* c, int fd, void* buf, size_t length) {
+  for (;;) {
+    ssize_t n = read(fd, buf, length);
+    if (n != -1) {
+      return n;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    }
+    c->yielded_address = __builtin_return_address(0);
+#if defined(__linux__)
+    if (c->machine->uring != NULL) {
+      struct io_uring_sqe op;
+      PrepareRw(&op, IORING_OP_READ, fd, buf, length);
+      return IoResult(UringIo(c, &op, POLLIN, true));
+    }
+#endif
+    if (!WaitForFd(c, fd, POLLIN)) {
+      return -1;
+    }
+  }
+}
+
+ssize_t CoroutineWriteSome(Coroutine* c, int fd, const void* buf,
+                           size_t length) {
+  for (;;) {
+    ssize_t n = write(fd, buf, length);
+    if (n != -1) {
+      return n;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    }
+    c->yielded_address = __builtin_return_address(0);
+#if defined(__linux__)
+    if (c->machine->uring != NULL) {
+      struct io_uring_sqe op;
+      PrepareRw(&op, IORING_OP_WRITE, fd, buf, length);
+      return IoResult(UringIo(c, &op, POLLOUT, true));
+    }
+#endif
+    if (!WaitForFd(c, fd, POLLOUT)) {
+      return -1;
+    }
+  }
+}
+
+bool CoroutineSetNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1) {
+    return false;
+  }
+  return (flags & O_NONBLOCK) != 0 ||
+         fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+ssize_t CoroutineReadWithTimeout(Coroutine* c, int fd, void* buf,
+                                 size_t length, uint64_t nanos) {
+  c->yielded_address = __builtin_return_address(0);
+  uint64_t deadline = NowNanos() + nanos;
+  for (;;) {
+    // Data that has already arrived is read without suspending, with any
+    // poller.
+    ssize_t n = read(fd, buf, length);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return n;
+    }
+#if defined(__linux__)
+    Uring* u = c->machine->uring;
+    if (u != NULL && !c->cancelled && UringReserve(u, 3)) {
+      // The fd would block, so the read goes behind a poll for it, in one
+      // submission.  The poll is linked to a timeout that cancels it, and
+      // with it the read.  The timespec is copied by the kernel when the
+      // entries are submitted, before we can be resumed.
+      uint64_t now = NowNanos();
+      uint64_t left = deadline > now ? deadline - now : 0;
+      struct __kernel_timespec ts = {.tv_sec = left / 1000000000,
+                                     .tv_nsec = left % 1000000000};
+      struct io_uring_sqe* poll = UringGetSqe(u);
+      struct io_uring_sqe* timeout = UringGetSqe(u);
+      timeout->opcode = IORING_OP_LINK_TIMEOUT;
+      timeout->addr = (uintptr_t)&ts;
+      timeout->len = 1;
+      timeout->flags = IOSQE_IO_LINK;
+      timeout->user_data = kCoUringIgnore;
+      struct io_uring_sqe* sqe = UringGetSqe(u);
+      PrepareRw(sqe, IORING_OP_READ, fd, buf, length);
+      int32_t result = WaitForIo(c, poll, sqe, fd, POLLIN);
+      if (result == -ECANCELED) {
+        if (c->cancelled || NowNanos() >= deadline) {
+          errno = c->cancelled ? ECANCELED : ETIMEDOUT;
+          return -1;
+        }
+        // The poll failed.  Reading again gives the real error.
+        continue;
+      }
+      if (result != -EAGAIN) {
+        return IoResult(result);
+      }
+    }
+#endif
+    uint64_t now = NowNanos();
+    CoroutineWaitStatus status =
+        now >= deadline ? kCoWaitTimeout : Wait(c, fd, POLLIN, deadline - now);
+    if (status != kCoWaitReady) {
+      errno = status == kCoWaitTimeout ? ETIMEDOUT : ECANCELED;
+      return -1;
+    }
   }
 }
+
+ssize_t CoroutineWrite(Coroutine* c, int fd, const void* buf, size_t length) {
+  c->yielded_address = __builtin_return_address(0);
+#if defined(__linux__)
+  if (c->machine->uring != NULL) {
+    struct io_uring_sqe op;
+    PrepareRw(&op, IORING_OP_WRITE, fd, buf, length);
+    return IoResult(UringIo(c, &op, POLLOUT, false));
+  }
+#endif
+  for (;;) {
+    ssize_t n = write(fd, buf, length);
+    if (n != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return n;
+    }
+    if (!WaitForFd(c, fd, POLLOUT)) {
+      return -1;
+    }
+  }
+}
+
+ssize_t CoroutineWritev(Coroutine* c, int fd, const struct iovec* iov,
+                        int iovcnt) {
+  c->yielded_address = __builtin_return_address(0);
+#if defined(__linux__)
+  if (c->machine->uring != NULL) {
+    struct io_uring_sqe op;
+    PrepareRw(&op, IORING_OP_WRITEV, fd, iov, iovcnt);
+    return IoResult(UringIo(c, &op, POLLOUT, false));
+  }
+#endif
+  for (;;) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return n;
+    }
+    if (!WaitForFd(c, fd, POLLOUT)) {
+      return -1;
+    }
+  }
+}
+
+int CoroutineAccept(Coroutine* c, int fd, struct sockaddr* addr,
+                    socklen_t* addrlen) {
+  c->yielded_address = __builtin_return_address(0);
+#if defined(__linux__)
+  if (c->machine->uring != NULL) {
+    struct io_uring_sqe op;
+    memset(&op, 0, sizeof(op));
+    op.opcode = IORING_OP_ACCEPT;
+    op.fd = fd;
+    op.addr = (uintptr_t)addr;
+    op.addr2 = (uintptr_t)addrlen;
+    op.accept_flags = SOCK_NONBLOCK;
+    return (int)IoResult(UringIo(c, &op, POLLIN, false));
+  }
+#endif
+  for (;;) {
+#if defined(__linux__)
+    int s = accept4(fd, addr, addrlen, SOCK_NONBLOCK);
+#else
+    int s = accept(fd, addr, addrlen);
+    if (s != -1) {
+      fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+    }
+#endif
+    if (s != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return s;
+    }
+    if (!WaitForFd(c, fd, POLLIN)) {
+      return -1;
+    }
+  }
+}
+
+int CoroutineConnect(Coroutine* c, int fd, const struct sockaddr* addr,
+                     socklen_t addrlen) {
+  c->yielded_address = __builtin_return_address(0);
+  int r;
+#if defined(__linux__)
+  if (c->machine->uring != NULL) {
+    struct io_uring_sqe op;
+    memset(&op, 0, sizeof(op));
+    op.opcode = IORING_OP_CONNECT;
+    op.fd = fd;
+    op.addr = (uintptr_t)addr;
+    op.off = addrlen;
+    r = (int)IoResult(UringIo(c, &op, POLLOUT, false));
+  } else
+#endif
+  {
+    r = connect(fd, addr, addrlen);
+  }
+  if (r == 0 || errno != EINPROGRESS) {
+    return r;
+  }
+  // A non-blocking socket connects in the background.
+  if (!WaitForFd(c, fd, POLLOUT)) {
+    return -1;
+  }
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+    return -1;
+  }
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+ssize_t CoroutineSendfile(Coroutine* c, int out_fd, int in_fd, off_t* offset,
+                          size_t count) {
+  c->yielded_address = __builtin_return_address(0);
+  size_t sent = 0;
+  while (sent < count) {
+#if defined(__linux__)
+    ssize_t n = sendfile(out_fd, in_fd, offset, count - sent);
+    if (n > 0) {
+      sent += n;
+      continue;
+    }
+#else
+    // The number of bytes sent is set even if there's an error.
+    off_t len = count - sent;
+    ssize_t n = sendfile(in_fd, out_fd, *offset, &len, NULL, 0);
+    *offset += len;
+    sent += len;
+    if (n == 0) {
+      n = len;
+    }
+    if (n > 0) {
+      continue;
+    }
+#endif
+    if (n == 0) {
+      // The file is shorter than expected.
+      break;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      if (!WaitForFd(c, out_fd, POLLOUT)) {
+        return -1;
+      }
+      continue;
+    }
+    return -1;
+  }
+  return sent;
+}
+
+bool CoroutineMachineRegisterBuffers(CoroutineMachine* m,
+                                     const struct iovec* iov, int n) {
+#if defined(__linux__)
+  if (m->uring != NULL && UringRegisterBuffers(m->uring, iov, n)) {
+    m->buffers_registered = true;
+    return true;
+  }
+#endif
+  return false;
+}
+
+ssize_t CoroutineReadFixed(Coroutine* c, int fd, void* buf, size_t length,
+                           int buf_index) {
+#if defined(__linux__)
+  if (c->machine->buffers_registered) {
+    c->yielded_address = __builtin_return_address(0);
+    struct io_uring_sqe op;
+    PrepareRw(&op, IORING_OP_READ_FIXED, fd, buf, length);
+    op.buf_index = buf_index;
+    return IoResult(UringIo(c, &op, POLLIN, false));
+  }
+#endif
+  return CoroutineRead(c, fd, buf, length);
+}
+
+ssize_t CoroutineWriteFixed(Coroutine* c, int fd, const void* buf,
+                            size_t length, int buf_index) {
+#if defined(__linux__)
+  if (c->machine->buffers_registered) {
+    c->yielded_address = __builtin_return_address(0);
+    struct io_uring_sqe op;
+    PrepareRw(&op, IORING_OP_WRITE_FIXED, fd, buf, length);
+    op.buf_index = buf_index;
+    return IoResult(UringIo(c, &op, POLLOUT, false));
+  }
+#endif
+  return CoroutineWrite(c, fd, buf, length);
+}
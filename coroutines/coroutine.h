@@ -9,13 +9,24 @@
 #define coroutine_h
 
 #include <poll.h>
-#include <setjmp.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include "dstring.h"
+#include "hashmap.h"
 #include "list.h"
 #include "vector.h"
-#include "bitset.h"
+#include "stack.h"
+#include "timer.h"
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 
 struct CoroutineMachine;
 struct Coroutine;
@@ -23,6 +34,104 @@ struct Coroutine;
 typedef void (*CoroutineFunctor)(struct Coroutine* c);
 #define kCoDefaultStackSize 8192
 
+// Number of direct switches between a caller and its generator before the
+// machine gets a chance to run other coroutines.
+#define kCoReadyRunLength 64
+
+// The type of poller used by a CoroutineMachine to wait for file descriptors.
+// The native poller is epoll on Linux and kqueue on macOS.  The io_uring
+// poller (Linux 5.11 or later) also does the I/O for CoroutineRead and
+// friends; elsewhere, or if the kernel doesn't support it, the machine uses
+// the native poller instead.  Defining COROUTINE_USE_POLL or
+// COROUTINE_USE_URING at compile time changes the default.
+typedef enum {
+  kCoPollerPoll,
+  kCoPollerNative,
+  kCoPollerUring,
+} CoroutinePollerType;
+
+#if defined(COROUTINE_USE_POLL)
+#define kCoDefaultPoller kCoPollerPoll
+#elif defined(COROUTINE_USE_URING)
+#define kCoDefaultPoller kCoPollerUring
+#else
+#define kCoDefaultPoller kCoPollerNative
+#endif
+
+// How the machine schedules the coroutines woken by the poller.  In
+// kCoScheduleOne mode only the coroutine that has been waiting longest is
+// run and the poller is called again to find the next one.  In
+// kCoScheduleBatch mode all the coroutines found by one call to the poller
+// are run, in the order they have been waiting, before polling again.  The
+// io_uring poller only reports each completion once, so it always runs them
+// all like kCoScheduleBatch.
+typedef enum {
+  kCoScheduleBatch,
+  kCoScheduleOne,
+} CoroutineSchedulerMode;
+
+// Priority of a coroutine.  Each priority has its own ready queue and the
+// machine runs the coroutines from the highest priority queue that isn't
+// empty, so latency sensitive coroutines, like those accepting connections,
+// go ahead of bulk transfers.  To stop lower priorities being starved, a
+// coroutine that has been ready for more than kCoPriorityMaxWaitTicks
+// scheduling decisions is run even if there are higher priority coroutines
+// ready.  Coroutines woken by the poller are chosen by priority first, then
+// by how long they have been waiting.
+typedef enum {
+  kCoPriorityHigh,
+  kCoPriorityNormal,  // The default.
+  kCoPriorityLow,
+  kCoNumPriorities,
+} CoroutinePriority;
+
+#define kCoPriorityMaxWaitTicks 256
+
+// How a machine allocates coroutine stacks.  The pool allocates stacks
+// using mmap with a guard page and reuses freed stacks (see stack.h).  If
+// the pool can't map a stack, say because the process has run out of
+// memory map entries, the stack comes from malloc instead, without a
+// guard page.
+typedef enum {
+  kCoStackPool,
+  kCoStackMalloc,
+} CoroutineStackAllocator;
+
+// How a machine sizes coroutine stacks.  With kCoStackSizeProfile each
+// stack is filled with kCoStackCanary when it is given to a coroutine and,
+// when the coroutine exits, the deepest point it reached is found by
+// looking for the first byte that has changed.  The high-water marks are
+// kept for each functor (see CoroutineMachineGetStackProfile and
+// CoroutineMachineShow).  kCoStackSizeAdaptive does the same and, once a
+// functor's coroutines have been measured kCoStackProfileSamples times,
+// gives new ones twice the deepest use seen, but no less than
+// kCoDefaultStackSize (which leaves room for signal handlers) and no more
+// than they asked for.  After that only one in kCoStackProfileInterval of
+// them is measured, which keeps the profile up to date without the cost of
+// filling every stack.  Only stacks from the pool, whose guard pages catch
+// an overflow, are made smaller; with kCoStackMalloc, or when the pool
+// falls back to malloc, coroutines get the size they asked for.  Filling a
+// stack touches all its pages, so a profiled coroutine's stack is all
+// resident.
+typedef enum {
+  kCoStackSizeFixed,
+  kCoStackSizeProfile,
+  kCoStackSizeAdaptive,
+} CoroutineStackSizing;
+
+#define kCoStackCanary 0xa5
+#define kCoStackProfileSamples 16
+#define kCoStackProfileInterval 64
+
+// The stack use of the coroutines with one functor.
+typedef struct {
+  CoroutineFunctor functor;
+  size_t samples;     // Coroutines measured when they exited.
+  size_t max_used;    // Deepest any of them went, in bytes.
+  size_t stack_size;  // Size of the stack of the deepest.
+  size_t unmeasured;  // Started since one was last measured (adaptive).
+} CoroutineStackProfile;
+
 typedef enum {
   kCoNew,
   kCoReady,
@@ -32,46 +141,153 @@ typedef enum {
   kCoDead,
 } CoroutineState;
 
+// Result of waiting for a file descriptor.
+typedef enum {
+  kCoWaitReady,      // The file descriptor is ready.
+  kCoWaitTimeout,    // The timeout expired first.
+  kCoWaitCancelled,  // The coroutine has been cancelled.
+} CoroutineWaitStatus;
+
+// Runtime metrics.  Coroutines and machines count their switches and the
+// time spent running, ready and polling when the library is built with
+// COROUTINE_METRICS defined.  Without it the counters aren't compiled in
+// at all, so build everything that uses the library with the same setting.
+// Times are in the cycles counted by CoroutineCycles.
+
+// The ready queue lengths are counted in buckets: bucket 0 is an empty
+// queue and bucket i is a length from 2^(i-1) to 2^i - 1, except that the
+// last bucket counts anything longer too.
+#define kCoReadyDepthBuckets 16
+
+typedef struct {
+  uint64_t resumes;         // Times the coroutine has been run.
+  uint64_t run_cycles;      // Total time running.
+  uint64_t max_run_cycles;  // Longest run without switching away.
+  uint64_t ready_cycles;    // Total time able to run but not running.
+} CoroutineMetrics;
+
+typedef struct {
+  uint64_t switches;          // Coroutines run, including direct switches.
+  uint64_t polls;             // Calls to the poller.
+  uint64_t poll_cycles;       // Time in the poller, including blocked.
+  uint64_t spawns;            // Coroutines given to the machine.
+  uint64_t exits;             // Coroutines that finished.
+  uint64_t ready_cycles;      // Total time coroutines were ready to run.
+  uint64_t max_ready_cycles;  // Longest a coroutine was ready to run.
+  uint64_t ready_depth[kCoReadyDepthBuckets];  // Scheduling decisions.
+  size_t current_id;          // Running coroutine, or -1 if none.
+  uint64_t current_cycles;    // How long it has been running.
+} CoroutineMachineMetrics;
+
+#if defined(COROUTINE_METRICS)
+// The machine's counters, written by its thread and read by any thread.
+typedef struct {
+  _Atomic(uint64_t) switches;
+  _Atomic(uint64_t) polls;
+  _Atomic(uint64_t) poll_cycles;
+  _Atomic(uint64_t) spawns;
+  _Atomic(uint64_t) exits;
+  _Atomic(uint64_t) ready_cycles;
+  _Atomic(uint64_t) max_ready_cycles;
+  _Atomic(uint64_t) ready_depth[kCoReadyDepthBuckets];
+  _Atomic(size_t) current_id;
+  _Atomic(uint64_t) run_start;  // When the current coroutine was resumed.
+  uint64_t last_cycles;         // Time of the last switch or poll.
+} CoroutineMachineCounters;
+#endif
+
+// A cheap, monotonic cycle counter: the TSC on x86-64 and the virtual
+// counter on ARM64 (nanoseconds elsewhere).  CoroutineCycleFrequency
+// returns its rate, measured the first time it's called.
+static inline uint64_t CoroutineCycles(void) {
+#if defined(__x86_64__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t t;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+  return t;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Cycles per second counted by CoroutineCycles.
+uint64_t CoroutineCycleFrequency(void);
+
 // This is a Coroutine.  It executes its functor (pointer to a function).
 // It has its own stack.
 typedef struct Coroutine {
-  ListElement element;       // Must be at offset 0.
+  // Fields used by the scheduler every time it looks at a coroutine: to
+  // switch to it, to poll for it or to choose it.  They share the first
+  // cache line, which for coroutines from NewCoroutine is line aligned.
+  ListElement element;  // Must be at offset 0.
+  struct CoroutineMachine* machine;
+  void* sp;               // Saved stack pointer when not running.
+  uint64_t last_tick;     // Tick count when last suspended or made ready.
+  struct pollfd wait_fd;  // Pollfd for waiting for an fd.
+  CoroutineState state;
+  bool is_ready;         // On the machine's ready queue.
+  bool timed_out;        // Woken by the timer.
+  uint8_t priority;      // CoroutinePriority.
+  bool cancelled;        // See CoroutineCancel.
+  uint32_t poller_slot;  // Index in the poll poller's pollfds, 0 if none.
+
+  // Fields used when it is queued, woken or timed out.
+  ListElement ready_element;     // Link in machine's ready queue.
+  Timer timer;                   // For sleeping and wait timeouts.
+  atomic_int park_state;         // See CoroutinePark.
+  int32_t io_result;             // Result of the last io_uring operation.
+  struct Coroutine* inbox_next;  // Link in a machine's inbox or wakeups.
+
+  // The rest is only used when the coroutine is created, exits, calls or is
+  // shown.
   size_t id;                 // Coroutine ID.
-  String name;               // Optional name.
+  uint32_t generation;       // Of the ID, see CoroutineIsAlive.
+  uint64_t serial;           // Unique serial number, never reused.
   CoroutineFunctor functor;  // Coroutine body.
-  CoroutineState state;
-  void* stack;            // Stack, allocated from malloc.
-  void* yielded_address;  // Address at which we've yielded.
-  bool needs_free;        // Needs to be freed when done.
-  size_t stack_size;
-  jmp_buf resume;          // Program environemnt for resuming.
-  jmp_buf exit;            // Program environemt to exit.
-  struct pollfd event_fd;  // Pollfd for event.
-  struct pollfd wait_fd;   // Pollfd for waiting for an fd.
-  struct CoroutineMachine* machine;
-  struct Coroutine* caller;  // If being called, who is calling us.
-  void* result;              // Where to put result in YieldValue.
-  size_t result_size;        // Length of value to store.
   void* user_data;           // User data, not owned by this.
-  uint64_t last_tick;        // Tick count of last resume.
+  void* stack;               // Stack, allocated by the machine.
+  size_t stack_size;
+  size_t inline_size;           // Bytes above the stack holding this.
+  bool needs_free;              // Needs to be freed when done.
+  bool stack_on_heap;           // The pool couldn't map the stack.
+  bool stack_painted;           // Stack was filled with kCoStackCanary.
+  void* yielded_address;        // Address at which we've yielded.
+  struct Coroutine* caller;     // If being called, who is calling us.
+  void* result;                 // Where to put result in YieldValue.
+  size_t result_size;           // Length of value to store.
+  struct CoroutineIoOp* io_op;  // Outstanding io_uring operation.
+  struct CoroutineGroup* group;  // Group it belongs to, see group.h.
+  ListElement group_element;     // Link in the group's members.
+  String name;                  // Optional name, see CoroutineGetName.
+#if defined(COROUTINE_METRICS)
+  CoroutineMetrics metrics;
+  uint64_t ready_since;  // When it became ready to run, 0 if it isn't.
+#endif
 } Coroutine;
 
-// Initialize a coroutine with the default stack size.
-void CoroutineInit(Coroutine* c, struct CoroutineMachine* machine,
+// Initialize a coroutine with the default stack size.  These return false,
+// leaving the coroutine unusable, if there is no memory for its stack.
+bool CoroutineInit(Coroutine* c, struct CoroutineMachine* machine,
                    CoroutineFunctor functor);
 
 // Initialize a coroutine with given stack size.
-void CoroutineInitWithStackSize(Coroutine* c, struct CoroutineMachine* machine,
+bool CoroutineInitWithStackSize(Coroutine* c, struct CoroutineMachine* machine,
                                 CoroutineFunctor functor, size_t stack_size);
 
-void CoroutineInitWithUserData(Coroutine* c, struct CoroutineMachine* machine,
+bool CoroutineInitWithUserData(Coroutine* c, struct CoroutineMachine* machine,
                                CoroutineFunctor functor, void* user_data);
-void CoroutineInitWithStackSizeAndUserData(Coroutine* c,
+bool CoroutineInitWithStackSizeAndUserData(Coroutine* c,
                                            struct CoroutineMachine* machine,
                                            CoroutineFunctor functor,
                                            size_t stack_size, void* user_data);
 
-// Allocate new coroutine on heap with default stack size.
+// Allocate a new coroutine with the default stack size.  The coroutine
+// lives at the top of its stack, so creating one takes a single allocation
+// from the machine's stack pool and no heap allocation.  It is freed when
+// it exits.  These return NULL if there is no memory for the stack.
 Coroutine* NewCoroutine(struct CoroutineMachine* machine,
                         CoroutineFunctor functor);
 Coroutine* NewCoroutineWithStackSize(struct CoroutineMachine* machine,
@@ -84,6 +300,16 @@ Coroutine* NewCoroutineWithStackSizeAndUserData(
     struct CoroutineMachine* machine, CoroutineFunctor functor,
     size_t stack_size, void* user_data);
 
+// Allocate a new coroutine with 'user_data_size' bytes of zeroed user data
+// that share its allocation, between the coroutine and its stack.  The user
+// data is freed with the coroutine.
+Coroutine* NewCoroutineWithInlineUserData(struct CoroutineMachine* machine,
+                                          CoroutineFunctor functor,
+                                          size_t user_data_size);
+Coroutine* NewCoroutineWithStackSizeAndInlineUserData(
+    struct CoroutineMachine* machine, CoroutineFunctor functor,
+    size_t stack_size, size_t user_data_size);
+
 // Destruct a coroutine.
 void CoroutineDestruct(Coroutine* c);
 void CoroutineDelete(Coroutine* c);
@@ -100,42 +326,342 @@ void CoroutineCall(Coroutine* c, Coroutine* callee, void* result,
 // Yield control and store value.
 void CoroutineYieldValue(Coroutine* c, void* value);
 
-// Wait for a file descriptor to become ready.
-void CoroutineWait(Coroutine* c, int fd, int event_mask);
+// Allocate a coroutine on the heap that doesn't belong to a machine.  It
+// is given an ID and a stack by the machine that it is started on with
+// CoroutineStartOnMachine.  A detached coroutine can be created on any
+// thread.
+Coroutine* NewDetachedCoroutine(CoroutineFunctor functor, size_t stack_size,
+                                void* user_data);
+
+// As above, with 'user_data_size' bytes of zeroed user data allocated with
+// the coroutine.
+Coroutine* NewDetachedCoroutineWithInlineUserData(CoroutineFunctor functor,
+                                                  size_t stack_size,
+                                                  size_t user_data_size);
+
+// Sets the coroutine's priority, which is kCoPriorityNormal to start with.
+// A coroutine that is ready to run moves to the new priority's queue.
+void CoroutineSetPriority(Coroutine* c, CoroutinePriority priority);
+CoroutinePriority CoroutineGetPriority(Coroutine* c);
+
+// The number of bytes of the coroutine's stack that have been used since it
+// started, or 0 if its stack wasn't filled with the canary (the machine's
+// stack sizing is kCoStackSizeFixed).  Call this on the machine's thread.
+size_t CoroutineStackHighWater(Coroutine* c);
+
+// Start a detached coroutine on a machine.  This can be called from any
+// thread.  The coroutine is placed in the machine's inbox and the machine
+// is woken up to run it.
+void CoroutineStartOnMachine(struct CoroutineMachine* m, Coroutine* c);
+
+// Wait for a file descriptor to become ready.  Returns kCoWaitCancelled,
+// without waiting, once the coroutine has been cancelled.
+CoroutineWaitStatus CoroutineWait(Coroutine* c, int fd, int event_mask);
+
+// Wait for a file descriptor to become ready or for the timeout, in
+// nanoseconds, to expire.
+CoroutineWaitStatus CoroutineWaitWithTimeout(Coroutine* c, int fd,
+                                             int event_mask, uint64_t nanos);
+
+// Sleep for at least the given number of nanoseconds.  The machine's timers
+// have a resolution of a millisecond.  A cancelled coroutine doesn't sleep.
+void CoroutineSleep(Coroutine* c, uint64_t nanos);
+
+// Cancel a coroutine.  This is sticky: the coroutine is woken from any wait
+// for an fd, a timer or an io_uring operation (once the kernel has
+// cancelled the operation, as it may be using the coroutine's buffer), and
+// from then on its waits return kCoWaitCancelled at once and the I/O
+// functions fail with ECANCELED instead of waiting, so it can clean up and
+// return.  A parked coroutine is unparked so that it can check
+// CoroutineIsCancelled; the waits in channels, locks and
+// CoroutineRunBlocking go on until they are done.  Call this on the
+// coroutine's machine.
+void CoroutineCancel(Coroutine* c);
+bool CoroutineIsCancelled(Coroutine* c);
+
+// Park the coroutine until another coroutine or thread unparks it.  If it
+// has been unparked since it last parked this returns at once.  Parking can
+// also return for other reasons, so always check the condition that you
+// are waiting for again.  This is the building block for channels and the
+// like: register the coroutine as a waiter somewhere, check the condition
+// and park if it still doesn't hold.
+void CoroutinePark(Coroutine* c);
+
+// Make a parked coroutine runnable again or, if it isn't parked, make its
+// next park return at once.  This can be called from any thread.  A
+// coroutine parked on another machine is passed to that machine, which is
+// woken up to run it.
+void CoroutineUnpark(Coroutine* c);
+
+// Work done for a coroutine by another thread, like a CoroutineRunBlocking
+// call (see pool.h).  The coroutine parks until 'done' is set, which the
+// coroutine's machine does on its own thread when it takes the completion
+// from its queue.  The other thread doesn't touch the coroutine at all, so
+// nothing it does can race with the coroutine going away.
+typedef struct CoroutineCompletion {
+  struct CoroutineCompletion* next;  // Link in the machine's queue.
+  Coroutine* c;
+  bool done;
+} CoroutineCompletion;
+
+// Queue a completion for the coroutine's machine, waking it if necessary.
+// This can be called from any thread and the completion must not be
+// touched afterwards.
+void CoroutinePostCompletion(CoroutineCompletion* completion);
 
 void CoroutineTriggerEvent(Coroutine* c);
 void CoroutineClearEvent(Coroutine* c);
 void CoroutineExit(Coroutine* c);
 
+// Close a file descriptor that has been used in CoroutineWait.  This
+// removes any registration held by the machine's poller.  If you use
+// close directly and a new fd with the same number is waited for by the
+// same coroutine, the poller may not see its events.
+void CoroutineClose(Coroutine* c, int fd);
+
+// I/O.  These work like the system calls they are named after (returning
+// -1 and setting errno on error) but suspend the coroutine instead of
+// blocking the thread.  With the io_uring poller the operation is
+// submitted to the machine's ring, along with everything else submitted
+// before the machine next polls, and the coroutine is resumed with the
+// result.  That is one system call for any number of operations.  The
+// kernel waits for a blocking fd itself; a non-blocking one that isn't
+// ready fails the first submission and the operation is submitted again
+// behind a poll for the fd.  With the other pollers the system call is
+// tried first and the coroutine only waits for the fd if it would block,
+// so the fds must be non-blocking.
+ssize_t CoroutineRead(Coroutine* c, int fd, void* buf, size_t length);
+ssize_t CoroutineWrite(Coroutine* c, int fd, const void* buf, size_t length);
+ssize_t CoroutineWritev(Coroutine* c, int fd, const struct iovec* iov,
+                        int iovcnt);
+
+// Optimistic I/O.  These make the system call straight away, with any
+// poller, and only suspend the coroutine if the fd isn't ready.  If data
+// is already waiting in a socket, as it usually is when requests are
+// pipelined or a bulk transfer is under way, they return without a trip
+// through the scheduler.  With the io_uring poller an operation that would
+// block is then submitted to the ring behind a poll for the fd, so it
+// costs a single submission.  The fd must be non-blocking or these will
+// block the machine; see CoroutineSetNonBlocking.  Interrupted calls are
+// retried.
+ssize_t CoroutineReadSome(Coroutine* c, int fd, void* buf, size_t length);
+ssize_t CoroutineWriteSome(Coroutine* c, int fd, const void* buf,
+                           size_t length);
+
+// Puts a fd in non-blocking mode, if it isn't already.  Returns false with
+// errno set if it can't.
+bool CoroutineSetNonBlocking(int fd);
+
+// Read that gives up after 'nanos' nanoseconds, returning -1 with errno set
+// to ETIMEDOUT.  Nothing has been read if it times out.  Like the optimistic
+// I/O above it reads straight away, so the fd must be non-blocking.  With
+// the io_uring poller a read that would block is submitted behind a poll
+// for the fd, with the timeout on the poll.
+ssize_t CoroutineReadWithTimeout(Coroutine* c, int fd, void* buf,
+                                 size_t length, uint64_t nanos);
+
+// Accepts a connection.  The new socket is non-blocking.
+int CoroutineAccept(Coroutine* c, int fd, struct sockaddr* addr,
+                    socklen_t* addrlen);
+
+// Connects a socket, waiting until the connection is made or fails.
+int CoroutineConnect(Coroutine* c, int fd, const struct sockaddr* addr,
+                     socklen_t addrlen);
+
+// Sends 'count' bytes of a file from '*offset' to a socket, updating the
+// offset.  Returns the number of bytes sent, which is less than 'count'
+// only if the file is shorter.  io_uring has no sendfile so this always
+// waits for the socket and uses the system call (or copies the file where
+// there is no sendfile).
+ssize_t CoroutineSendfile(Coroutine* c, int out_fd, int in_fd, off_t* offset,
+                          size_t count);
+
+// Registers buffers with the machine's io_uring so that the kernel doesn't
+// have to map them for every operation.  Returns false (and nothing needs
+// to change) if the machine isn't using io_uring.  'buf_index' in these
+// reads and writes is the index of the registered buffer that holds 'buf'.
+bool CoroutineMachineRegisterBuffers(struct CoroutineMachine* m,
+                                     const struct iovec* iov, int n);
+ssize_t CoroutineReadFixed(Coroutine* c, int fd, void* buf, size_t length,
+                           int buf_index);
+ssize_t CoroutineWriteFixed(Coroutine* c, int fd, const void* buf,
+                            size_t length, int buf_index);
+
+// A coroutine without a name is called co-<id>, which is only formatted
+// when CoroutineGetName is first called for it.
 void CoroutineSetName(Coroutine* c, const char* name);
 const char* CoroutineGetName(Coroutine* c);
 
 void CoroutineSetUserData(Coroutine* c, void* user_data);
 void* CoroutineGetUserData(Coroutine* c);
 
-
+// Returns true if 'query' is alive on c's machine.  IDs are reused, so each
+// use of an ID has a generation number and a coroutine is only alive while
+// its generation is the current one for its ID.  The query's memory must
+// still be valid.
 bool CoroutineIsAlive(Coroutine* c, Coroutine* query);
 
+// Copies the coroutine's metrics.  Call this on its machine's thread.
+// Returns false if the library was built without COROUTINE_METRICS.
+bool CoroutineGetMetrics(Coroutine* c, CoroutineMetrics* metrics);
+
+// Registration of a file descriptor with the native poller.  The fd stays
+// registered for the events in 'events' across waits made by the coroutine
+// whose serial number is 'serial'.  There can be one coroutine waiting
+// for input and one for output on each fd.
+typedef struct {
+  Coroutine* in_waiter;
+  Coroutine* out_waiter;
+  uint64_t serial;
+  short events;
+} CoroutinePollerFd;
+
+struct CoroutinePoller;
+
+// Hooks that allow a CoroutineScheduler to share work between the machines
+// running on its threads.  All are called on the machine's own thread
+// except 'added', which is called by CoroutineStartOnMachine.
+typedef struct CoroutineMachineHooks {
+  // Called once a round of the ready queue with 'idle' set if the ready
+  // queue is empty.  Moves any work found onto the machine.
+  void (*find_work)(struct CoroutineMachine* m, bool idle);
+  // Called before the machine blocks in the poller.  Returns false if the
+  // machine must not block.
+  bool (*sleep)(struct CoroutineMachine* m);
+  // Called when the poller returns after 'sleep' returned true.
+  void (*wake)(struct CoroutineMachine* m);
+  // Called when a coroutine is given to the machine and when one finishes.
+  void (*added)(struct CoroutineMachine* m);
+  void (*removed)(struct CoroutineMachine* m);
+} CoroutineMachineHooks;
+
+// Coroutine IDs index a table of these.  The generation is odd while the ID
+// is in use and even while it is free, when it is on a stack of free IDs
+// linked through next_free.
+typedef struct {
+  uint32_t generation;
+  uint32_t next_free;
+} CoroutineIdSlot;
+
+#define kCoNoFreeId UINT32_MAX
+
 typedef struct CoroutineMachine {
   List coroutines;
-  BitSet coroutine_ids;
-  size_t next_coroutine_id;
-  ssize_t last_freed_coroutine_id;
-  jmp_buf yield;
-  bool running;
+  CoroutineIdSlot* ids;  // Indexed by ID.
+  uint32_t num_ids;      // IDs that have ever been used.
+  uint32_t ids_capacity;
+  uint32_t free_id;  // Top of the stack of free IDs, or kCoNoFreeId.
+  void* sp;                  // Saved stack pointer of main loop.
+  Coroutine* current;        // Coroutine that is running.
+  size_t direct_switches;    // Switches made without the machine.
+  // Every switch to a coroutine starts a new slice, so a watchdog thread
+  // can see one that runs for too long (see watchdog.h).  The slice is odd
+  // while a coroutine is running and even while the machine is.
+  _Atomic(uint64_t) slice;
+  _Atomic(uint64_t) preempt_slice;  // Slice a watchdog wants to end.
+  _Atomic(uint64_t) preempt_since;  // When the watchdog saw it start.
+  size_t overruns;        // Slices that ran past the watchdog's limit.
+  bool report_overruns;   // Print them as they end.
+  atomic_bool running;       // Can be cleared by another thread.
+  // The poll poller's set: the interrupt fd followed by the fds being
+  // waited for, with the coroutine waiting for pollfds[i] in
+  // blocked_coroutines[i - 1].
   struct pollfd* pollfds;
   nfds_t pollfd_capacity;
   nfds_t num_pollfds;
   Vector blocked_coroutines;
-  struct pollfd interrupt_fd;
+  struct pollfd interrupt_fd;  // Wakes the poller from another thread.
   uint64_t tick_count;
+  // FIFOs of coroutines that can run now, one for each priority, with a
+  // bit in ready_levels for each that isn't empty.
+  List ready_coroutines[kCoNumPriorities];
+  uint32_t ready_levels;
+  size_t num_ready;       // Coroutines on all the ready queues.
+  size_t ready_run;       // Ready coroutines to run before next poll.
+  const struct CoroutinePoller* poller;
+  int poller_fd;                  // epoll or kqueue fd for native poller.
+  CoroutinePollerFd* poller_fds;  // Registrations, indexed by fd.
+  size_t poller_fds_capacity;
+  size_t num_waiting;             // Coroutines waiting for fds.
+  Vector runnables;               // Coroutines woken by the poller.
+  uint64_t next_serial;
+  CoroutineSchedulerMode scheduler_mode;
+  CoroutineStackAllocator stack_allocator;
+  StackPool stack_pool;
+  CoroutineStackSizing stack_sizing;
+  HashMap stack_profiles;  // CoroutineStackProfile* for each functor.
+  TimerWheel timers;  // Ticks are milliseconds of monotonic time.
+  _Atomic(Coroutine*) inbox;  // Started from other threads, newest first.
+  _Atomic(Coroutine*) wakeups;  // Unparked by other threads, newest first.
+  _Atomic(CoroutineCompletion*) completions;  // Posted, newest first.
+  struct CoroutineThreadPool* thread_pool;   // For CoroutineRunBlocking.
+  struct Uring* uring;          // For the io_uring poller.
+  struct CoroutineIoOp* free_io_ops;
+  struct CoroutineIoOp* deferred_io_ops;  // Waiting for room in the ring.
+  bool interrupt_deferred;  // The interrupt's poll is waiting for room.
+  Vector io_ops;                // All the io_uring operations allocated.
+  bool buffers_registered;
+  const CoroutineMachineHooks* hooks;
+  void* hooks_arg;
+#if defined(COROUTINE_METRICS)
+  CoroutineMachineCounters counters;
+#endif
+#if defined(COROUTINE_TRACE)
+  struct CoroutineTrace* trace;  // Event ring, see trace.h.
+#endif
 } CoroutineMachine;
 
+// Yields if a watchdog has found the running coroutine's slice has gone on
+// for too long (see watchdog.h), and returns whether it did.  It is only a
+// couple of loads, so put it in loops that can run for a long time without
+// otherwise giving up the CPU.
+static inline bool CoroutineMaybeYield(Coroutine* c) {
+  CoroutineMachine* m = c->machine;
+  if (atomic_load_explicit(&m->preempt_slice, memory_order_relaxed) !=
+      atomic_load_explicit(&m->slice, memory_order_relaxed)) {
+    return false;
+  }
+  CoroutineYield(c);
+  return true;
+}
+
+// Options for initializing a CoroutineMachine.  Use
+// CoroutineMachineOptionsInit to set the defaults before changing the
+// ones you want.
+typedef struct {
+  CoroutinePollerType poller;
+  CoroutineSchedulerMode scheduler_mode;
+  CoroutineStackAllocator stack_allocator;
+  size_t max_free_stacks;  // Free stacks of each size kept in the pool.
+  CoroutineStackSizing stack_sizing;
+} CoroutineMachineOptions;
+
+void CoroutineMachineOptionsInit(CoroutineMachineOptions* options);
+
 void CoroutineMachineInit(CoroutineMachine* m);
+void CoroutineMachineInitWithPoller(CoroutineMachine* m,
+                                    CoroutinePollerType poller);
+void CoroutineMachineInitWithOptions(CoroutineMachine* m,
+                                     const CoroutineMachineOptions* options);
 CoroutineMachine* NewCoroutineMachine(void);
 void CoroutineMachineDestruct(CoroutineMachine* m);
 void CoroutineMachineDelete(CoroutineMachine* m);
 void CoroutineMachineStop(CoroutineMachine* m);
+
+// Wake up a machine that is blocked in its poller.  This can be called from
+// any thread.
+void CoroutineMachineInterrupt(CoroutineMachine* m);
+
+// Install hooks for a scheduler.  The 'arg' is kept in m->hooks_arg.
+void CoroutineMachineSetHooks(CoroutineMachine* m,
+                              const CoroutineMachineHooks* hooks, void* arg);
+
+// Start a detached coroutine on the machine.  Must be called on the
+// machine's thread.  If there is no memory for its stack the coroutine is
+// deleted as if it had exited without running.
+void CoroutineMachineAdopt(CoroutineMachine* m, Coroutine* c);
+void CoroutineMachineSetSchedulerMode(CoroutineMachine* m,
+                                      CoroutineSchedulerMode mode);
 size_t CoroutineMachineAllocateId(CoroutineMachine* m);
 
 void CoroutineMachineAddCoroutine(CoroutineMachine* m, Coroutine* c);
@@ -144,7 +670,26 @@ void CoroutineMachineStartCoroutine(Coroutine* c);
 
 void CoroutineMachineRun(CoroutineMachine* m);
 
-// Print the state of all the coroutines to stderr.
+// Print the state of all the coroutines to stderr, followed by the stack
+// profiles if stacks are being profiled.
 void CoroutineMachineShow(CoroutineMachine* m);
 
+// Changes how the machine sizes the stacks of coroutines created from now
+// on.  Call this on the machine's thread.
+void CoroutineMachineSetStackSizing(CoroutineMachine* m,
+                                    CoroutineStackSizing sizing);
+
+// Gets the stack use recorded for coroutines running 'functor'.  Returns
+// false if none of them have exited since stacks were profiled.
+bool CoroutineMachineGetStackProfile(CoroutineMachine* m,
+                                     CoroutineFunctor functor,
+                                     CoroutineStackProfile* profile);
+
+// Takes a snapshot of the machine's metrics.  This can be called from any
+// thread while the machine is running.  Each counter is read atomically but
+// they may not all be from the same moment.  Returns false if the library
+// was built without COROUTINE_METRICS.
+bool CoroutineMachineGetMetrics(CoroutineMachine* m,
+                                CoroutineMachineMetrics* metrics);
+
 #endif /* coroutine_h */
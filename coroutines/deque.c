@@ -0,0 +1,75 @@
+//
+//  deque.c
+//  coroutines
+//
+
+#include "deque.h"
+
+#define kCoWorkDequeMask (kCoWorkDequeSize - 1)
+
+void WorkDequeInit(WorkDeque* d) {
+  atomic_init(&d->top, 0);
+  atomic_init(&d->bottom, 0);
+  for (int i = 0; i < kCoWorkDequeSize; i++) {
+    atomic_init(&d->items[i], NULL);
+  }
+}
+
+bool WorkDequePush(WorkDeque* d, void* item) {
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+  if (b - t >= kCoWorkDequeSize) {
+    return false;
+  }
+  atomic_store_explicit(&d->items[b & kCoWorkDequeMask], item,
+                        memory_order_relaxed);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+  return true;
+}
+
+void* WorkDequeTake(WorkDeque* d) {
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+  if (t > b) {
+    // Empty.
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return NULL;
+  }
+  void* item = atomic_load_explicit(&d->items[b & kCoWorkDequeMask],
+                                    memory_order_relaxed);
+  if (t == b) {
+    // Last item, race against thieves for it.
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+      item = NULL;
+    }
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+  return item;
+}
+
+void* WorkDequeSteal(WorkDeque* d) {
+  int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  if (t >= b) {
+    return NULL;
+  }
+  void* item = atomic_load_explicit(&d->items[t & kCoWorkDequeMask],
+                                    memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    return NULL;
+  }
+  return item;
+}
+
+bool WorkDequeIsEmpty(WorkDeque* d) {
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+  return t >= b;
+}
@@ -0,0 +1,44 @@
+//
+//  deque.h
+//  coroutines
+//
+
+#ifndef deque_h
+#define deque_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A bounded lock-free work stealing deque (Chase and Lev, with the memory
+// ordering from Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient
+// Work-Stealing for Weak Memory Models").  The thread that owns the deque
+// pushes and takes from the bottom.  Any other thread can steal from the
+// top.
+
+// Must be a power of 2.
+#define kCoWorkDequeSize 1024
+
+typedef struct {
+  _Atomic(int64_t) top;
+  _Atomic(int64_t) bottom;
+  _Atomic(void*) items[kCoWorkDequeSize];
+} WorkDeque;
+
+void WorkDequeInit(WorkDeque* d);
+
+// Owner only.  Returns false if the deque is full.
+bool WorkDequePush(WorkDeque* d, void* item);
+
+// Owner only.  Returns the item pushed most recently or NULL if empty.
+void* WorkDequeTake(WorkDeque* d);
+
+// Any thread.  Returns the oldest item or NULL if the deque is empty or
+// another thread took the item first.
+void* WorkDequeSteal(WorkDeque* d);
+
+// Any thread.  An approximation as the deque can change at any time.
+bool WorkDequeIsEmpty(WorkDeque* d);
+
+#endif /* deque_h */
@@ -0,0 +1,77 @@
+//
+//  group.c
+//  coroutines
+//
+
+#include "group.h"
+
+static Coroutine* MemberOf(ListElement* e) {
+  return (Coroutine*)((char*)e - offsetof(Coroutine, group_element));
+}
+
+void CoroutineGroupInit(CoroutineGroup* g, CoroutineMachine* m) {
+  g->machine = m;
+  ListInit(&g->members);
+  g->joiner = NULL;
+  g->cancelled = false;
+}
+
+void CoroutineGroupDestruct(CoroutineGroup* g) {
+  ListElement* e = g->members.first;
+  while (e != NULL) {
+    ListElement* next = e->next;
+    Coroutine* c = MemberOf(e);
+    ListDeleteElement(&g->members, e);
+    ListElementInit(e);
+    c->group = NULL;
+    e = next;
+  }
+}
+
+Coroutine* CoroutineGroupSpawn(CoroutineGroup* g, CoroutineFunctor functor,
+                               void* user_data) {
+  Coroutine* c = NewCoroutineWithUserData(g->machine, functor, user_data);
+  if (c == NULL) {
+    return NULL;
+  }
+  CoroutineGroupAdd(g, c);
+  CoroutineStart(c);
+  return c;
+}
+
+void CoroutineGroupAdd(CoroutineGroup* g, Coroutine* c) {
+  c->group = g;
+  ListAppend(&g->members, &c->group_element);
+  if (g->cancelled) {
+    CoroutineCancel(c);
+  }
+}
+
+void CoroutineGroupCancel(CoroutineGroup* g) {
+  g->cancelled = true;
+  for (ListElement* e = g->members.first; e != NULL; e = e->next) {
+    CoroutineCancel(MemberOf(e));
+  }
+}
+
+void CoroutineGroupJoin(CoroutineGroup* g, Coroutine* c) {
+  g->joiner = c;
+  while (g->members.length > 0) {
+    if (CoroutineIsCancelled(c) && !g->cancelled) {
+      CoroutineGroupCancel(g);
+    }
+    CoroutinePark(c);
+  }
+  g->joiner = NULL;
+}
+
+size_t CoroutineGroupSize(CoroutineGroup* g) { return g->members.length; }
+
+void CoroutineGroupRemove(CoroutineGroup* g, Coroutine* c) {
+  ListDeleteElement(&g->members, &c->group_element);
+  ListElementInit(&c->group_element);
+  c->group = NULL;
+  if (g->members.length == 0 && g->joiner != NULL) {
+    CoroutineUnpark(g->joiner);
+  }
+}
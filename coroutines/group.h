@@ -0,0 +1,62 @@
+//
+//  group.h
+//  coroutines
+//
+
+#ifndef group_h
+#define group_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "coroutine.h"
+#include "list.h"
+
+// A group of coroutines that are joined and cancelled together, like the
+// helpers of a connection.  The coroutine that owns the group spawns the
+// members into it and joins it before going away, so none of them outlives
+// it: cancelling the group wakes every member from what it is waiting for
+// with a cancelled status (see CoroutineCancel) and joining waits until
+// they have all returned and been freed.  A joiner that is itself
+// cancelled cancels the group, so cancellation spreads from a coroutine to
+// the groups it is joining.
+//
+// A group and its members belong to one machine and are only used on its
+// thread.
+
+typedef struct CoroutineGroup {
+  CoroutineMachine* machine;
+  List members;       // Coroutines linked through their group_element.
+  Coroutine* joiner;  // Coroutine in CoroutineGroupJoin, if any.
+  bool cancelled;     // Members added from now on start cancelled.
+} CoroutineGroup;
+
+void CoroutineGroupInit(CoroutineGroup* g, CoroutineMachine* m);
+
+// Takes any members that are left out of the group, which should have been
+// joined first.
+void CoroutineGroupDestruct(CoroutineGroup* g);
+
+// Creates a coroutine with the default stack size in the group and starts
+// it.  Returns NULL, leaving the group as it was, if there is no memory for
+// the coroutine.
+Coroutine* CoroutineGroupSpawn(CoroutineGroup* g, CoroutineFunctor functor,
+                               void* user_data);
+
+// Adds a coroutine that hasn't exited to the group.  It must be on the
+// group's machine and not in another group.
+void CoroutineGroupAdd(CoroutineGroup* g, Coroutine* c);
+
+// Cancels all the members.
+void CoroutineGroupCancel(CoroutineGroup* g);
+
+// Parks 'c' until all the members have exited.  Only one coroutine can join
+// a group at a time.
+void CoroutineGroupJoin(CoroutineGroup* g, Coroutine* c);
+
+// Number of members that haven't exited.
+size_t CoroutineGroupSize(CoroutineGroup* g);
+
+// Called by the machine when a member exits.
+void CoroutineGroupRemove(CoroutineGroup* g, Coroutine* c);
+
+#endif /* group_h */
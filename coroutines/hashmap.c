@@ -0,0 +1,461 @@
+//
+//  hashmap.c
+//  coroutines
+//
+
+#include "hashmap.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "dstring.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Control bytes.  Full slots hold the low 7 bits of the hash, so they are
+// never negative.
+#define kCoHashMapEmpty ((int8_t)-128)
+#define kCoHashMapDeleted ((int8_t)-2)
+
+// A table never has fewer slots than this.
+#define kCoHashMapMinCapacity kCoHashMapGroupSize
+
+// Matching a group gives a mask with a bit set for each matching slot.
+// NEON has no movemask so its masks have 4 bits for each slot, of which
+// we keep the top one.
+#if defined(__ARM_NEON) && !defined(__SSE2__)
+#define kCoHashMapMaskShift 2
+#else
+#define kCoHashMapMaskShift 0
+#endif
+
+typedef uint64_t GroupMask;
+
+#if defined(__SSE2__)
+static GroupMask MatchByte(const int8_t* group, int8_t byte) {
+  __m128i ctrl = _mm_load_si128((const __m128i*)group);
+  __m128i eq = _mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte));
+  return (uint16_t)_mm_movemask_epi8(eq);
+}
+
+// Empty and deleted are the only negative control bytes.
+static GroupMask MatchEmptyOrDeleted(const int8_t* group) {
+  __m128i ctrl = _mm_load_si128((const __m128i*)group);
+  return (uint16_t)_mm_movemask_epi8(ctrl);
+}
+#elif defined(__ARM_NEON)
+static GroupMask NarrowMask(uint8x16_t eq) {
+  uint64_t mask = vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+  return mask & 0x8888888888888888ULL;
+}
+
+static GroupMask MatchByte(const int8_t* group, int8_t byte) {
+  return NarrowMask(vceqq_s8(vld1q_s8(group), vdupq_n_s8(byte)));
+}
+
+static GroupMask MatchEmptyOrDeleted(const int8_t* group) {
+  return NarrowMask(vcltzq_s8(vld1q_s8(group)));
+}
+#else
+static GroupMask MatchByte(const int8_t* group, int8_t byte) {
+  GroupMask mask = 0;
+  for (int i = 0; i < kCoHashMapGroupSize; i++) {
+    if (group[i] == byte) {
+      mask |= (GroupMask)1 << i;
+    }
+  }
+  return mask;
+}
+
+static GroupMask MatchEmptyOrDeleted(const int8_t* group) {
+  GroupMask mask = 0;
+  for (int i = 0; i < kCoHashMapGroupSize; i++) {
+    if (group[i] < 0) {
+      mask |= (GroupMask)1 << i;
+    }
+  }
+  return mask;
+}
+#endif
+
+static GroupMask MatchEmpty(const int8_t* group) {
+  return MatchByte(group, kCoHashMapEmpty);
+}
+
+// The slot in a group for the lowest bit in a mask.
+static size_t MaskFirst(GroupMask mask) {
+  return __builtin_ctzll(mask) >> kCoHashMapMaskShift;
+}
+
+static GroupMask MaskNext(GroupMask mask) { return mask & (mask - 1); }
+
+// Finalizer from MurmurHash3, used to spread the bits of integer keys.
+static uint64_t MixBits(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// FNV-1a over the bytes, mixed so that all the bits depend on all of them.
+static uint64_t HashBytes(const char* p, size_t length, bool case_blind) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char ch = p[i];
+    if (case_blind) {
+      ch = tolower(ch);
+    }
+    h = (h ^ ch) * 0x100000001b3ULL;
+  }
+  return MixBits(h);
+}
+
+static uint64_t HashInt64(MapKeyType key) { return MixBits(key.w); }
+
+static bool EqualInt64s(MapKeyType a, MapKeyType b) { return a.w == b.w; }
+
+static uint64_t HashPointer(MapKeyType key) {
+  return MixBits((uint64_t)(uintptr_t)key.p);
+}
+
+static bool EqualPointers(MapKeyType a, MapKeyType b) { return a.p == b.p; }
+
+static uint64_t HashString(MapKeyType key) {
+  String* s = key.p;
+  return HashBytes(s->value, s->length, false);
+}
+
+static bool EqualStrings(MapKeyType a, MapKeyType b) {
+  String* s1 = a.p;
+  String* s2 = b.p;
+  return s1->length == s2->length &&
+         memcmp(s1->value, s2->value, s1->length) == 0;
+}
+
+static uint64_t HashStringCaseBlind(MapKeyType key) {
+  String* s = key.p;
+  return HashBytes(s->value, s->length, true);
+}
+
+static bool EqualStringsCaseBlind(MapKeyType a, MapKeyType b) {
+  String* s1 = a.p;
+  String* s2 = b.p;
+  return s1->length == s2->length &&
+         strncasecmp(s1->value, s2->value, s1->length) == 0;
+}
+
+static uint64_t HashCharPointer(MapKeyType key) {
+  return HashBytes(key.p, strlen(key.p), false);
+}
+
+static bool EqualCharPointers(MapKeyType a, MapKeyType b) {
+  return strcmp(a.p, b.p) == 0;
+}
+
+static uint64_t HashCharPointerCaseBlind(MapKeyType key) {
+  return HashBytes(key.p, strlen(key.p), true);
+}
+
+static bool EqualCharPointersCaseBlind(MapKeyType a, MapKeyType b) {
+  return strcasecmp(a.p, b.p) == 0;
+}
+
+void HashMapInit(HashMap* map, HashMapHashFunc hash_func,
+                 HashMapEqualFunc equal_func) {
+  map->ctrl = NULL;
+  map->slots = NULL;
+  map->capacity = 0;
+  map->length = 0;
+  map->growth_left = 0;
+  map->hash = hash_func;
+  map->equal = equal_func;
+}
+
+void HashMapInitForStringKeys(HashMap* map) {
+  HashMapInit(map, HashString, EqualStrings);
+}
+
+void HashMapInitForCaseBlindStringKeys(HashMap* map) {
+  HashMapInit(map, HashStringCaseBlind, EqualStringsCaseBlind);
+}
+
+void HashMapInitForPointerKeys(HashMap* map) {
+  HashMapInit(map, HashPointer, EqualPointers);
+}
+
+void HashMapInitForCharPointerKeys(HashMap* map) {
+  HashMapInit(map, HashCharPointer, EqualCharPointers);
+}
+
+void HashMapInitForCaseBlindCharPointerKeys(HashMap* map) {
+  HashMapInit(map, HashCharPointerCaseBlind, EqualCharPointersCaseBlind);
+}
+
+void HashMapInitForInt64Keys(HashMap* map) {
+  HashMapInit(map, HashInt64, EqualInt64s);
+}
+
+HashMap* NewHashMap(HashMapHashFunc hash_func, HashMapEqualFunc equal_func) {
+  HashMap* map = malloc(sizeof(HashMap));
+  HashMapInit(map, hash_func, equal_func);
+  return map;
+}
+
+HashMap* NewHashMapForStringKeys(void) {
+  return NewHashMap(HashString, EqualStrings);
+}
+
+HashMap* NewHashMapForCharPointerKeys(void) {
+  return NewHashMap(HashCharPointer, EqualCharPointers);
+}
+
+HashMap* NewHashMapForInt64Keys(void) {
+  return NewHashMap(HashInt64, EqualInt64s);
+}
+
+HashMap* NewHashMapForPointerKeys(void) {
+  return NewHashMap(HashPointer, EqualPointers);
+}
+
+HashMap* NewHashMapForCaseBlindStringKeys(void) {
+  return NewHashMap(HashStringCaseBlind, EqualStringsCaseBlind);
+}
+
+HashMap* NewHashMapForCaseBlindCharPointerKeys(void) {
+  return NewHashMap(HashCharPointerCaseBlind, EqualCharPointersCaseBlind);
+}
+
+void HashMapDestruct(HashMap* map) {
+  free(map->ctrl);
+  free(map->slots);
+  map->ctrl = NULL;
+  map->slots = NULL;
+  map->capacity = 0;
+  map->length = 0;
+  map->growth_left = 0;
+}
+
+void HashMapDelete(HashMap* map) {
+  HashMapDestruct(map);
+  free(map);
+}
+
+void HashMapTraverse(HashMap* map, void (*func)(MapKeyValue* kv, void* data),
+                     void* data) {
+  for (size_t i = 0; i < map->capacity; i++) {
+    if (map->ctrl[i] >= 0) {
+      func(&map->slots[i], data);
+    }
+  }
+}
+
+void HashMapDestructWithContents(HashMap* map, void (*func)(MapKeyValue* kv)) {
+  if (func != NULL) {
+    for (size_t i = 0; i < map->capacity; i++) {
+      if (map->ctrl[i] >= 0) {
+        func(&map->slots[i]);
+      }
+    }
+  }
+  HashMapDestruct(map);
+}
+
+void HashMapDeleteWithContents(HashMap* map, void (*func)(MapKeyValue* kv)) {
+  HashMapDestructWithContents(map, func);
+  free(map);
+}
+
+// The table is allowed to be 7/8 full.
+static size_t MaxLength(size_t capacity) { return capacity - capacity / 8; }
+
+static void ResetGrowthLeft(HashMap* map) {
+  map->growth_left = MaxLength(map->capacity) - map->length;
+}
+
+void HashMapClear(HashMap* map) {
+  if (map->capacity != 0) {
+    memset(map->ctrl, kCoHashMapEmpty, map->capacity);
+  }
+  map->length = 0;
+  ResetGrowthLeft(map);
+}
+
+// The first 7 bits of the hash go in the control byte and the rest choose
+// the group to start probing at.
+static int8_t HashControl(uint64_t hash) { return hash & 0x7f; }
+
+static size_t HashGroup(HashMap* map, uint64_t hash) {
+  return (hash >> 7) & (map->capacity / kCoHashMapGroupSize - 1);
+}
+
+// Triangular probing, which visits every group when there is a power of 2
+// of them.
+static size_t NextGroup(HashMap* map, size_t group, size_t probe) {
+  return (group + probe) & (map->capacity / kCoHashMapGroupSize - 1);
+}
+
+// Returns the index of the slot holding the key or -1 if it's not there.
+static ptrdiff_t FindSlot(HashMap* map, MapKeyType key, uint64_t hash) {
+  if (map->capacity == 0) {
+    return -1;
+  }
+  int8_t h2 = HashControl(hash);
+  size_t group = HashGroup(map, hash);
+  for (size_t probe = 1;; probe++) {
+    const int8_t* ctrl = &map->ctrl[group * kCoHashMapGroupSize];
+    for (GroupMask m = MatchByte(ctrl, h2); m != 0; m = MaskNext(m)) {
+      size_t slot = group * kCoHashMapGroupSize + MaskFirst(m);
+      if (map->equal(map->slots[slot].key, key)) {
+        return slot;
+      }
+    }
+    if (MatchEmpty(ctrl) != 0) {
+      // The key would have gone in the empty slot.
+      return -1;
+    }
+    group = NextGroup(map, group, probe);
+  }
+}
+
+// Returns the first empty or deleted slot for a hash.  There always is
+// one as the table is never full.
+static size_t FindFreeSlot(HashMap* map, uint64_t hash) {
+  size_t group = HashGroup(map, hash);
+  for (size_t probe = 1;; probe++) {
+    const int8_t* ctrl = &map->ctrl[group * kCoHashMapGroupSize];
+    GroupMask m = MatchEmptyOrDeleted(ctrl);
+    if (m != 0) {
+      return group * kCoHashMapGroupSize + MaskFirst(m);
+    }
+    group = NextGroup(map, group, probe);
+  }
+}
+
+// Moves all the keys into a table of the new capacity.  This also gets
+// rid of the deleted slots.
+static void Rehash(HashMap* map, size_t capacity) {
+  int8_t* old_ctrl = map->ctrl;
+  MapKeyValue* old_slots = map->slots;
+  size_t old_capacity = map->capacity;
+
+  // Control bytes are aligned so that groups can be loaded in one go.
+  map->ctrl = aligned_alloc(kCoHashMapGroupSize, capacity);
+  memset(map->ctrl, kCoHashMapEmpty, capacity);
+  map->slots = malloc(capacity * sizeof(MapKeyValue));
+  map->capacity = capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old_ctrl[i] >= 0) {
+      uint64_t hash = map->hash(old_slots[i].key);
+      size_t slot = FindFreeSlot(map, hash);
+      map->ctrl[slot] = HashControl(hash);
+      map->slots[slot] = old_slots[i];
+    }
+  }
+  ResetGrowthLeft(map);
+  free(old_ctrl);
+  free(old_slots);
+}
+
+// Makes room for one more key.  If the table is full of deleted slots
+// rather than keys it is rehashed at the same size to clear them.
+static void Grow(HashMap* map) {
+  size_t capacity = map->capacity;
+  if (capacity == 0) {
+    capacity = kCoHashMapMinCapacity;
+  } else if (map->length >= MaxLength(capacity) / 2) {
+    capacity *= 2;
+  }
+  Rehash(map, capacity);
+}
+
+void HashMapReserve(HashMap* map, size_t length) {
+  size_t capacity =
+      map->capacity == 0 ? kCoHashMapMinCapacity : map->capacity;
+  while (MaxLength(capacity) < length) {
+    capacity *= 2;
+  }
+  if (capacity != map->capacity) {
+    Rehash(map, capacity);
+  }
+}
+
+void* HashMapInsert(HashMap* map, MapKeyValue kv) {
+  uint64_t hash = map->hash(kv.key);
+  ptrdiff_t found = FindSlot(map, kv.key, hash);
+  if (found != -1) {
+    // Matches exising value, replace value.
+    void* old_value = map->slots[found].value.p;
+    map->slots[found].value = kv.value;
+    return old_value;
+  }
+  if (map->capacity == 0) {
+    Grow(map);
+  }
+  size_t slot = FindFreeSlot(map, hash);
+  if (map->ctrl[slot] == kCoHashMapEmpty) {
+    if (map->growth_left == 0) {
+      Grow(map);
+      slot = FindFreeSlot(map, hash);
+    }
+    map->growth_left--;
+  }
+  map->ctrl[slot] = HashControl(hash);
+  map->slots[slot] = kv;
+  map->length++;
+  return NULL;
+}
+
+MapValueType* HashMapSearch(HashMap* map, MapKeyType key) {
+  ptrdiff_t slot = FindSlot(map, key, map->hash(key));
+  if (slot == -1) {
+    return NULL;
+  }
+  return &map->slots[slot].value;
+}
+
+void* HashMapFind(HashMap* map, MapKeyType key) {
+  MapValueType* value = HashMapSearch(map, key);
+  if (value == NULL) {
+    return NULL;
+  }
+  return value->p;
+}
+
+void* HashMapFindPointerKey(HashMap* map, void* key) {
+  MapKeyType k;
+  k.p = key;
+  return HashMapFind(map, k);
+}
+
+void* HashMapFindInt64Key(HashMap* map, int64_t key) {
+  MapKeyType k;
+  k.w = key;
+  return HashMapFind(map, k);
+}
+
+void* HashMapRemove(HashMap* map, MapKeyType key) {
+  ptrdiff_t slot = FindSlot(map, key, map->hash(key));
+  if (slot == -1) {
+    return NULL;
+  }
+  void* value = map->slots[slot].value.p;
+  // If the group has an empty slot no probe has gone past it, so the slot
+  // can be made empty again.  Otherwise a probe might have passed through
+  // it to another group and it has to be marked as deleted.
+  const int8_t* group = &map->ctrl[slot & ~(size_t)(kCoHashMapGroupSize - 1)];
+  if (MatchEmpty(group) != 0) {
+    map->ctrl[slot] = kCoHashMapEmpty;
+    map->growth_left++;
+  } else {
+    map->ctrl[slot] = kCoHashMapDeleted;
+  }
+  map->length--;
+  return value;
+}
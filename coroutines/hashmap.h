@@ -0,0 +1,98 @@
+//
+//  hashmap.h
+//  coroutines
+//
+
+#ifndef hashmap_h
+#define hashmap_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "map.h"
+
+// Hash map between two values, using the same key and value types as Map.
+// Use this instead of a Map when there are a lot of keys and you don't need
+// them in order: inserts, lookups and removals take constant time instead
+// of the Map's O(n) inserts and removals.
+//
+// This is an open addressing table in the style of the Swiss table.  The
+// table is split into groups of 16 slots.  Each slot has a control byte
+// that says whether it is empty, deleted or full and, if full, holds 7 bits
+// of the key's hash.  A lookup compares all 16 control bytes in a group at
+// once (with SSE2 or NEON) and only compares the keys whose hash bits
+// match, so it rarely looks at more than one key.  Groups are probed in a
+// triangular sequence until one with an empty slot is found.
+//
+// The table grows when it is 7/8 full.  It never contracts.
+
+#define kCoHashMapGroupSize 16
+
+// Hash and equality functions for keys.
+typedef uint64_t (*HashMapHashFunc)(MapKeyType key);
+typedef bool (*HashMapEqualFunc)(MapKeyType a, MapKeyType b);
+
+typedef struct {
+  int8_t* ctrl;          // A control byte for each slot.
+  MapKeyValue* slots;    // Key/value pairs, valid where the slot is full.
+  size_t capacity;       // Number of slots, a power of 2 (or 0 if empty).
+  size_t length;         // Number of keys in map.
+  size_t growth_left;    // Number of empty slots we can fill before growing.
+  HashMapHashFunc hash;
+  HashMapEqualFunc equal;
+} HashMap;
+
+// Initializes the map with functions to hash and compare keys.
+void HashMapInit(HashMap* map, HashMapHashFunc hash_func,
+                 HashMapEqualFunc equal_func);
+HashMap* NewHashMap(HashMapHashFunc hash_func, HashMapEqualFunc equal_func);
+
+// Initializers for common map types.
+void HashMapInitForStringKeys(HashMap* map);
+void HashMapInitForCharPointerKeys(HashMap* map);
+void HashMapInitForInt64Keys(HashMap* map);
+void HashMapInitForPointerKeys(HashMap* map);
+void HashMapInitForCaseBlindStringKeys(HashMap* map);
+void HashMapInitForCaseBlindCharPointerKeys(HashMap* map);
+
+HashMap* NewHashMapForStringKeys(void);
+HashMap* NewHashMapForCharPointerKeys(void);
+HashMap* NewHashMapForInt64Keys(void);
+HashMap* NewHashMapForPointerKeys(void);
+HashMap* NewHashMapForCaseBlindStringKeys(void);
+HashMap* NewHashMapForCaseBlindCharPointerKeys(void);
+
+void HashMapDestruct(HashMap* map);
+void HashMapDelete(HashMap* map);
+void HashMapClear(HashMap* map);
+
+void HashMapDestructWithContents(HashMap* map, void (*func)(MapKeyValue* kv));
+void HashMapDeleteWithContents(HashMap* map, void (*func)(MapKeyValue* kv));
+
+// Makes room for at least 'length' keys so that the map doesn't grow while
+// they are inserted.
+void HashMapReserve(HashMap* map, size_t length);
+
+// Removes the key from the map, returning the value being removed if the
+// removal was successful. If the removal was unsuccessful (the key was not
+// present) NULL is returned.
+void* HashMapRemove(HashMap* map, MapKeyType key);
+
+// Inserts the key and value into the map.  Returns the old value if the
+// insertion replaced an old value, NULL otherwise.
+void* HashMapInsert(HashMap* map, MapKeyValue kv);
+
+// Finds a value given an key.  Returns NULL if it is not found.
+void* HashMapFind(HashMap* map, MapKeyType key);
+void* HashMapFindPointerKey(HashMap* map, void* key);
+void* HashMapFindInt64Key(HashMap* map, int64_t key);
+
+// Search the map and return NULL or pointer to the value found.
+MapValueType* HashMapSearch(HashMap* map, MapKeyType key);
+
+// Calls the function for each key/value pair, in no particular order.  The
+// map must not be changed by the function.
+void HashMapTraverse(HashMap* map, void (*func)(MapKeyValue* kv, void* data),
+                     void* data);
+
+#endif /* hashmap_h */
@@ -0,0 +1,203 @@
+//
+//  http.c
+//  coroutines
+//
+
+#include "http.h"
+#include <string.h>
+#include <strings.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+void HttpParserInit(HttpParser* p) {
+  memset(p->start, 0, sizeof(p->start));
+  p->num_headers = 0;
+  p->length = 0;
+  p->line = 0;
+  p->scan = 0;
+  p->have_start = false;
+}
+
+// Returns the index of the first byte in data[start..end) or end if it
+// isn't there.  Compares 16 bytes at a time, with SSE2 on x86_64 and NEON
+// on aarch64 (both are always there), and the rest one at a time.
+static size_t FindByte(const char* data, size_t start, size_t end, char byte) {
+  size_t i = start;
+#if defined(__SSE2__)
+  __m128i pattern = _mm_set1_epi8(byte);
+  for (; i + 16 <= end; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)&data[i]);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__ARM_NEON)
+  uint8x16_t pattern = vdupq_n_u8(byte);
+  for (; i + 16 <= end; i += 16) {
+    uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*)&data[i]), pattern);
+    // Narrow each byte of the comparison to 4 bits, giving a 64 bit mask.
+    uint64_t mask = vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+    if (mask != 0) {
+      return i + (__builtin_ctzll(mask) >> 2);
+    }
+  }
+#endif
+  for (; i < end; i++) {
+    if (data[i] == byte) {
+      return i;
+    }
+  }
+  return end;
+}
+
+static bool IsSpace(char ch) { return ch == ' ' || ch == '\t'; }
+
+static HttpSlice MakeSlice(size_t start, size_t end) {
+  HttpSlice s = {.offset = (uint32_t)start, .length = (uint32_t)(end - start)};
+  return s;
+}
+
+// The first line is split at the first two spaces.  The reason in a status
+// line can contain more.
+static bool ParseStartLine(HttpParser* p, const char* data, size_t start,
+                           size_t end) {
+  size_t sp1 = FindByte(data, start, end, ' ');
+  if (sp1 == start || sp1 == end) {
+    return false;
+  }
+  size_t sp2 = FindByte(data, sp1 + 1, end, ' ');
+  if (sp2 == sp1 + 1) {
+    return false;
+  }
+  p->start[0] = MakeSlice(start, sp1);
+  p->start[1] = MakeSlice(sp1 + 1, sp2);
+  p->start[2] = MakeSlice(sp2 == end ? end : sp2 + 1, end);
+  p->have_start = true;
+  return true;
+}
+
+static bool ParseHeaderLine(HttpParser* p, const char* data, size_t start,
+                            size_t end) {
+  if (IsSpace(data[start])) {
+    // A continuation of the previous value (obsolete, but allowed).  The
+    // value then includes the line break.
+    if (p->num_headers == 0) {
+      return false;
+    }
+    size_t value_end = end;
+    while (value_end > start && IsSpace(data[value_end - 1])) {
+      value_end--;
+    }
+    HttpSlice* value = &p->headers[p->num_headers - 1].value;
+    if (value_end > start) {
+      value->length = (uint32_t)(value_end - value->offset);
+    }
+    return true;
+  }
+  if (p->num_headers == kCoHttpMaxHeaders) {
+    return false;
+  }
+  size_t colon = FindByte(data, start, end, ':');
+  if (colon == end || colon == start) {
+    return false;
+  }
+  for (size_t i = start; i < colon; i++) {
+    // Whitespace in the name isn't allowed.
+    if (IsSpace(data[i])) {
+      return false;
+    }
+  }
+  size_t value_start = colon + 1;
+  while (value_start < end && IsSpace(data[value_start])) {
+    value_start++;
+  }
+  size_t value_end = end;
+  while (value_end > value_start && IsSpace(data[value_end - 1])) {
+    value_end--;
+  }
+  HttpHeader* h = &p->headers[p->num_headers++];
+  h->name = MakeSlice(start, colon);
+  h->value = MakeSlice(value_start, value_end);
+  return true;
+}
+
+HttpParseStatus HttpParserParse(HttpParser* p, const char* data,
+                                size_t length) {
+  if (p->length != 0) {
+    return kCoHttpComplete;
+  }
+  for (;;) {
+    size_t eol = FindByte(data, p->scan, length, '\n');
+    if (eol == length) {
+      p->scan = length;
+      return length > kCoHttpMaxHeaderSize ? kCoHttpInvalid
+                                           : kCoHttpIncomplete;
+    }
+    if (eol >= kCoHttpMaxHeaderSize) {
+      return kCoHttpInvalid;
+    }
+    size_t start = p->line;
+    size_t end = eol;
+    if (end > start && data[end - 1] == '\r') {
+      end--;
+    }
+    p->line = p->scan = eol + 1;
+
+    if (start == end) {
+      if (p->have_start) {
+        // The blank line at the end of the header.
+        p->length = eol + 1;
+        return kCoHttpComplete;
+      }
+      // Blank lines before a request are ignored.
+      continue;
+    }
+    bool ok = p->have_start ? ParseHeaderLine(p, data, start, end)
+                            : ParseStartLine(p, data, start, end);
+    if (!ok) {
+      return kCoHttpInvalid;
+    }
+  }
+}
+
+bool HttpParserFindHeader(HttpParser* p, const char* data, const char* name,
+                          HttpSlice* value) {
+  for (size_t i = 0; i < p->num_headers; i++) {
+    if (HttpSliceCaseEqual(data, p->headers[i].name, name)) {
+      *value = p->headers[i].value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HttpSliceEqual(const char* data, HttpSlice s, const char* str) {
+  return strlen(str) == s.length &&
+         memcmp(&data[s.offset], str, s.length) == 0;
+}
+
+bool HttpSliceCaseEqual(const char* data, HttpSlice s, const char* str) {
+  return strlen(str) == s.length &&
+         strncasecmp(&data[s.offset], str, s.length) == 0;
+}
+
+int64_t HttpSliceToInt(const char* data, HttpSlice s) {
+  if (s.length == 0 || s.length > 18) {
+    return -1;
+  }
+  int64_t v = 0;
+  for (uint32_t i = 0; i < s.length; i++) {
+    char ch = data[s.offset + i];
+    if (ch < '0' || ch > '9') {
+      return -1;
+    }
+    v = v * 10 + (ch - '0');
+  }
+  return v;
+}
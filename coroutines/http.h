@@ -0,0 +1,87 @@
+//
+//  http.h
+//  coroutines
+//
+
+#ifndef http_h
+#define http_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// An incremental parser for HTTP/1.x request and response headers, shared
+// by the HTTP server and client.
+//
+// The parser is given all the data received so far each time more arrives
+// and carries on from where it stopped, so each byte is only looked at
+// once however the header is split over reads.  Nothing is allocated.  The
+// first line and the header fields are returned as slices of the data.
+// Slices hold offsets rather than pointers so that they remain valid if the
+// buffer holding the data is reallocated to read more.
+//
+// HttpParser parser;
+// HttpParserInit(&parser);
+// while (HttpParserParse(&parser, buf.value, buf.length) ==
+//        kCoHttpIncomplete) {
+//   ... read more into buf ...
+// }
+
+#define kCoHttpMaxHeaders 32
+
+// Longer headers are rejected.
+#define kCoHttpMaxHeaderSize (64 * 1024)
+
+typedef struct {
+  uint32_t offset;
+  uint32_t length;
+} HttpSlice;
+
+typedef struct {
+  HttpSlice name;
+  HttpSlice value;  // Without surrounding whitespace.
+} HttpHeader;
+
+typedef enum {
+  kCoHttpIncomplete,  // Need more data.
+  kCoHttpComplete,
+  kCoHttpInvalid,
+} HttpParseStatus;
+
+typedef struct {
+  // The three parts of the first line.  For a request these are the method,
+  // target and protocol.  For a response they are the protocol, status code
+  // and reason.  The last one can be empty.
+  HttpSlice start[3];
+  HttpHeader headers[kCoHttpMaxHeaders];
+  size_t num_headers;
+  size_t length;  // Of the whole header, including the blank line.
+
+  // Where the parser has got to.
+  size_t line;  // Start of the current line.
+  size_t scan;  // The end of the current line is not before here.
+  bool have_start;
+} HttpParser;
+
+void HttpParserInit(HttpParser* p);
+
+// Carries on parsing the header at the start of data.  Once the parser
+// returns kCoHttpComplete, the header is p->length bytes long and anything
+// after it is the body or the next message.
+HttpParseStatus HttpParserParse(HttpParser* p, const char* data,
+                                size_t length);
+
+// Finds the value of a header field, ignoring the case of the name.
+// Returns false if there's no such field.
+bool HttpParserFindHeader(HttpParser* p, const char* data, const char* name,
+                          HttpSlice* value);
+
+// Compare a slice with a string, exactly or ignoring case.
+bool HttpSliceEqual(const char* data, HttpSlice s, const char* str);
+bool HttpSliceCaseEqual(const char* data, HttpSlice s, const char* str);
+
+// Parses a slice as a non-negative decimal number.  Returns -1 if it isn't
+// one.
+int64_t HttpSliceToInt(const char* data, HttpSlice s);
+
+#endif /* http_h */
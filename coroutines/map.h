@@ -21,6 +21,9 @@
 // field says how many key/value pairs are present in the map.  The 'capacity'
 // field is the number of key/value pairs for which we have space in the array.
 // The array is expanded as needed, but never contracts.
+//
+// Inserts and removals move the rest of the array, so for a lot of keys that
+// don't need to be kept in order use a HashMap (hashmap.h) instead.
 
 // Key type.
 typedef union {
@@ -0,0 +1,124 @@
+//
+//  pool.c
+//  coroutines
+//
+
+#include "pool.h"
+#include <errno.h>
+#include <stdlib.h>
+
+static void* PoolThread(void* arg) {
+  CoroutineThreadPool* p = arg;
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    CoroutineBlockingJob* job = p->first;
+    if (job == NULL) {
+      if (p->stopping) {
+        break;
+      }
+      p->idle_threads++;
+      pthread_cond_wait(&p->work, &p->lock);
+      p->idle_threads--;
+      continue;
+    }
+    p->first = job->next;
+    if (p->first == NULL) {
+      p->last = NULL;
+    }
+    p->num_queued--;
+    pthread_mutex_unlock(&p->lock);
+
+    errno = 0;
+    job->result = job->fn(job->arg);
+    job->error = errno;
+    CoroutinePostCompletion(&job->completion);
+
+    pthread_mutex_lock(&p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+void CoroutineThreadPoolInit(CoroutineThreadPool* p, size_t max_threads) {
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  p->first = NULL;
+  p->last = NULL;
+  p->num_queued = 0;
+  p->max_threads = max_threads == 0 ? 1 : max_threads;
+  p->threads = malloc(p->max_threads * sizeof(pthread_t));
+  p->num_threads = 0;
+  p->idle_threads = 0;
+  p->stopping = false;
+}
+
+void CoroutineThreadPoolDestruct(CoroutineThreadPool* p) {
+  pthread_mutex_lock(&p->lock);
+  p->stopping = true;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+  for (size_t i = 0; i < p->num_threads; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  free(p->threads);
+  pthread_cond_destroy(&p->work);
+  pthread_mutex_destroy(&p->lock);
+}
+
+// Queues the job, starting another thread for it unless an idle one is
+// free to take it.  If no thread can be started the job waits for one that
+// has been.  Returns false if the pool has no threads at all.
+static bool Submit(CoroutineThreadPool* p, CoroutineBlockingJob* job) {
+  job->next = NULL;
+  pthread_mutex_lock(&p->lock);
+  if (p->num_queued >= p->idle_threads && p->num_threads < p->max_threads &&
+      pthread_create(&p->threads[p->num_threads], NULL, PoolThread, p) == 0) {
+    p->num_threads++;
+  }
+  bool ok = p->num_threads > 0;
+  if (ok) {
+    if (p->last == NULL) {
+      p->first = job;
+    } else {
+      p->last->next = job;
+    }
+    p->last = job;
+    p->num_queued++;
+    pthread_cond_signal(&p->work);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return ok;
+}
+
+void CoroutineMachineSetThreadPool(CoroutineMachine* m,
+                                   CoroutineThreadPool* p) {
+  m->thread_pool = p;
+}
+
+static CoroutineThreadPool default_pool;
+static pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
+
+static void InitDefaultPool(void) {
+  CoroutineThreadPoolInit(&default_pool, kCoDefaultPoolThreads);
+}
+
+void* CoroutineRunBlocking(Coroutine* c, CoroutineBlockingFunction fn,
+                           void* arg) {
+  CoroutineThreadPool* p = c->machine->thread_pool;
+  if (p == NULL) {
+    pthread_once(&default_pool_once, InitDefaultPool);
+    p = &default_pool;
+  }
+  CoroutineBlockingJob job = {.completion = {.c = c, .done = false},
+                              .fn = fn,
+                              .arg = arg};
+  if (!Submit(p, &job)) {
+    // No threads, so all we can do is block the machine.
+    return fn(arg);
+  }
+  while (!job.completion.done) {
+    CoroutinePark(c);
+  }
+  errno = job.error;
+  return job.result;
+}
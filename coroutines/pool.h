@@ -0,0 +1,72 @@
+//
+//  pool.h
+//  coroutines
+//
+
+#ifndef pool_h
+#define pool_h
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "coroutine.h"
+
+// A pool of threads for work that would block a machine, like opening or
+// stat'ing files on a slow disk or calling a library that does its own
+// I/O.  CoroutineRunBlocking hands a function to the pool and parks the
+// coroutine; the machine runs its other coroutines until the pool thread
+// posts the result back through the machine's completion queue, which wakes
+// it with its interrupt fd.  Only the coroutine that made the call waits.
+//
+// Threads are started as work arrives, up to the pool's limit, and then
+// stay until the pool is destructed.  Work waits in a FIFO when they are all
+// busy.
+
+// Threads in the pool used by machines that haven't been given one.
+#define kCoDefaultPoolThreads 8
+
+typedef void* (*CoroutineBlockingFunction)(void* arg);
+
+typedef struct CoroutineBlockingJob {
+  CoroutineCompletion completion;
+  CoroutineBlockingFunction fn;
+  void* arg;
+  void* result;
+  int error;  // errno after the call.
+  struct CoroutineBlockingJob* next;  // Link in the pool's queue.
+} CoroutineBlockingJob;
+
+typedef struct CoroutineThreadPool {
+  pthread_mutex_t lock;  // Protects everything below.
+  pthread_cond_t work;   // Signalled when a job is queued or on stopping.
+  CoroutineBlockingJob* first;  // Queued jobs, oldest first.
+  CoroutineBlockingJob* last;
+  size_t num_queued;
+  pthread_t* threads;
+  size_t num_threads;
+  size_t max_threads;
+  size_t idle_threads;  // Threads waiting for a job, or woken for one.
+  bool stopping;
+} CoroutineThreadPool;
+
+void CoroutineThreadPoolInit(CoroutineThreadPool* p, size_t max_threads);
+
+// Runs the jobs still queued and then stops the threads.  No coroutine may
+// be waiting for the pool when this returns, so don't call it until they
+// have all finished.
+void CoroutineThreadPoolDestruct(CoroutineThreadPool* p);
+
+// Runs the machine's CoroutineRunBlocking calls on the pool, which can be
+// shared by any number of machines.  Without one they use a default pool of
+// kCoDefaultPoolThreads that is started the first time it is needed and
+// lasts as long as the process.
+void CoroutineMachineSetThreadPool(CoroutineMachine* m,
+                                   CoroutineThreadPool* p);
+
+// Calls fn(arg) on a pool thread and returns its result, with errno set as
+// the call left it.  The coroutine is parked meanwhile, so 'arg' can point
+// at its stack.
+void* CoroutineRunBlocking(Coroutine* c, CoroutineBlockingFunction fn,
+                           void* arg);
+
+#endif /* pool_h */
@@ -0,0 +1,584 @@
+//
+//  resolver.c
+//  coroutines
+//
+
+#include "resolver.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vector.h"
+
+#define kCoDnsMaxName 255
+#define kCoDnsMaxMessage 1232  // Largest UDP answer we ask for with EDNS.
+#define kCoDnsMaxTtl 86400
+
+// Expired entries are removed when the cache gets to this size.
+#define kCoResolverPruneSize 4096
+
+#define kCoDnsTypeA 1
+#define kCoDnsTypeAAAA 28
+#define kCoDnsTypeOpt 41
+#define kCoDnsClassIn 1
+
+// An address in the cache, without a port.
+typedef struct {
+  uint8_t family;  // AF_INET or AF_INET6.
+  uint8_t bytes[16];
+} ResolverIp;
+
+typedef struct {
+  char* name;       // The key in the cache.
+  uint64_t expiry;  // Monotonic nanoseconds, UINT64_MAX for /etc/hosts.
+  size_t num_ips;
+  ResolverIp ips[kCoResolverMaxAddresses];
+} ResolverEntry;
+
+static uint64_t NowNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static ResolverEntry* NewEntry(const char* name) {
+  ResolverEntry* e = calloc(1, sizeof(ResolverEntry));
+  e->name = strdup(name);
+  return e;
+}
+
+static void DeleteEntry(ResolverEntry* e) {
+  free(e->name);
+  free(e);
+}
+
+static void DeleteEntryKeyValue(MapKeyValue* kv) { DeleteEntry(kv->value.p); }
+
+static void AddIp(ResolverEntry* e, int family, const void* bytes) {
+  if (e->num_ips == kCoResolverMaxAddresses) {
+    return;
+  }
+  ResolverIp* ip = &e->ips[e->num_ips++];
+  ip->family = family;
+  memcpy(ip->bytes, bytes, family == AF_INET ? 4 : 16);
+}
+
+// Parses a numeric address and port into a ResolvedAddress.
+static bool ParseAddress(const char* s, uint16_t port, ResolvedAddress* a) {
+  memset(a, 0, sizeof(*a));
+  if (inet_pton(AF_INET, s, &a->addr.v4.sin_addr) == 1) {
+    a->addr.v4.sin_family = AF_INET;
+    a->addr.v4.sin_port = htons(port);
+    a->length = sizeof(a->addr.v4);
+    return true;
+  }
+  if (inet_pton(AF_INET6, s, &a->addr.v6.sin6_addr) == 1) {
+    a->addr.v6.sin6_family = AF_INET6;
+    a->addr.v6.sin6_port = htons(port);
+    a->length = sizeof(a->addr.v6);
+    return true;
+  }
+  return false;
+}
+
+// Copies the name in lower case without any trailing dot.  Returns false
+// if it is too long to look up.
+static bool NormalizeName(const char* name, char* out) {
+  size_t len = strlen(name);
+  if (len > 0 && name[len - 1] == '.') {
+    len--;
+  }
+  if (len == 0 || len > kCoDnsMaxName - 2) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    out[i] = tolower((unsigned char)name[i]);
+  }
+  out[len] = '\0';
+  return true;
+}
+
+static void ReadResolvConf(Resolver* r) {
+  FILE* f = fopen("/etc/resolv.conf", "r");
+  if (f == NULL) {
+    return;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL &&
+         r->num_servers < kCoResolverMaxServers) {
+    char address[64];
+    ResolvedAddress* server = &r->servers[r->num_servers];
+    if (sscanf(line, " nameserver %63s", address) == 1 &&
+        ParseAddress(address, kCoResolverPort, server)) {
+      r->num_servers++;
+    }
+  }
+  fclose(f);
+}
+
+static void AddHost(Resolver* r, const char* name, const ResolvedAddress* a) {
+  char key[kCoDnsMaxName];
+  if (!NormalizeName(name, key)) {
+    return;
+  }
+  ResolverEntry* e = HashMapFind(&r->cache, (MapKeyType){.p = key});
+  if (e == NULL) {
+    e = NewEntry(key);
+    e->expiry = UINT64_MAX;
+    HashMapInsert(&r->cache, (MapKeyValue){.key.p = e->name, .value.p = e});
+  }
+  if (a->addr.sa.sa_family == AF_INET) {
+    AddIp(e, AF_INET, &a->addr.v4.sin_addr);
+  } else {
+    AddIp(e, AF_INET6, &a->addr.v6.sin6_addr);
+  }
+}
+
+static void ReadHosts(Resolver* r) {
+  FILE* f = fopen("/etc/hosts", "r");
+  if (f == NULL) {
+    return;
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char* save;
+    char* address = strtok_r(line, " \t\r\n", &save);
+    ResolvedAddress a;
+    if (address == NULL || !ParseAddress(address, 0, &a)) {
+      continue;
+    }
+    char* name;
+    while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      AddHost(r, name, &a);
+    }
+  }
+  fclose(f);
+}
+
+void ResolverInit(Resolver* r) {
+  r->num_servers = 0;
+  r->timeout = kCoResolverDefaultTimeout;
+  r->attempts = kCoResolverDefaultAttempts;
+  CoMutexInit(&r->lock);
+  HashMapInitForCharPointerKeys(&r->cache);
+
+  // Query ids are hard to guess so that answers can't easily be forged.
+  uint64_t seed = NowNanos() ^ ((uint64_t)getpid() << 32);
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd != -1) {
+    uint64_t random;
+    if (read(fd, &random, sizeof(random)) == sizeof(random)) {
+      seed ^= random;
+    }
+    close(fd);
+  }
+  atomic_init(&r->random, seed);
+
+  ReadResolvConf(r);
+  if (r->num_servers == 0) {
+    ResolverSetServer(r, "127.0.0.1", kCoResolverPort);
+  }
+  ReadHosts(r);
+}
+
+void ResolverDestruct(Resolver* r) {
+  HashMapDestructWithContents(&r->cache, DeleteEntryKeyValue);
+}
+
+bool ResolverSetServer(Resolver* r, const char* address, uint16_t port) {
+  if (!ParseAddress(address, port, &r->servers[0])) {
+    return false;
+  }
+  r->num_servers = 1;
+  return true;
+}
+
+// A random 16 bit query id (SplitMix64).
+static uint16_t NewId(Resolver* r) {
+  uint64_t z = atomic_fetch_add(&r->random, 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return (uint16_t)(z ^ (z >> 31));
+}
+
+static void Put16(uint8_t* p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static uint16_t Get16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+
+static uint32_t Get32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Builds a recursive query for the name, with an EDNS record to allow
+// answers bigger than 512 bytes.  Returns its length or 0 if the name
+// isn't valid.
+static size_t BuildQuery(uint8_t* msg, uint16_t id, const char* name,
+                         uint16_t type) {
+  memset(msg, 0, 12);
+  Put16(&msg[0], id);
+  msg[2] = 0x01;  // Recursion desired.
+  Put16(&msg[4], 1);   // Questions.
+  Put16(&msg[10], 1);  // Additional records.
+  size_t n = 12;
+  const char* label = name;
+  for (;;) {
+    const char* dot = strchr(label, '.');
+    size_t len = dot == NULL ? strlen(label) : (size_t)(dot - label);
+    if (len == 0 || len > 63) {
+      return 0;
+    }
+    msg[n++] = len;
+    memcpy(&msg[n], label, len);
+    n += len;
+    if (dot == NULL) {
+      break;
+    }
+    label = dot + 1;
+  }
+  msg[n++] = 0;
+  Put16(&msg[n], type);
+  Put16(&msg[n + 2], kCoDnsClassIn);
+  n += 4;
+  // OPT pseudo record: root name, type, UDP size, no flags or data.
+  msg[n++] = 0;
+  Put16(&msg[n], kCoDnsTypeOpt);
+  Put16(&msg[n + 2], kCoDnsMaxMessage);
+  memset(&msg[n + 4], 0, 6);
+  return n + 10;
+}
+
+// Compares the possibly compressed name at 'offset' with 'name' and moves
+// the offset past it.  Returns -1 if the name is malformed, otherwise
+// whether it matched.
+static int MatchName(const uint8_t* msg, size_t len, size_t* offset,
+                     const char* name) {
+  size_t p = *offset;
+  bool jumped = false;
+  bool match = true;
+  const char* n = name;
+  // Labels and pointers, with a limit in case the pointers loop.
+  for (int hops = 0; hops < 256; hops++) {
+    if (p >= len) {
+      return -1;
+    }
+    uint8_t l = msg[p];
+    if ((l & 0xc0) == 0xc0) {
+      if (p + 1 >= len) {
+        return -1;
+      }
+      if (!jumped) {
+        *offset = p + 2;
+      }
+      jumped = true;
+      p = ((l & 0x3f) << 8) | msg[p + 1];
+      continue;
+    }
+    if (l == 0) {
+      if (!jumped) {
+        *offset = p + 1;
+      }
+      return match && *n == '\0';
+    }
+    if ((l & 0xc0) != 0 || p + 1 + l > len) {
+      return -1;
+    }
+    if (n != name) {
+      if (*n != '.') {
+        match = false;
+      } else {
+        n++;
+      }
+    }
+    for (int i = 0; i < l && match; i++) {
+      if (tolower(msg[p + 1 + i]) != *n) {
+        match = false;
+      } else {
+        n++;
+      }
+    }
+    p += 1 + l;
+  }
+  return -1;
+}
+
+typedef enum {
+  kCoDnsIgnore,  // Not an answer to our query.
+  kCoDnsAnswer,  // Addresses (possibly none) for the name.
+  kCoDnsNoName,  // The name doesn't exist.
+  kCoDnsFailed,  // The server couldn't answer, try another.
+} DnsResult;
+
+// Parses an answer, adding the addresses it has to the entry and lowering
+// the TTL to the smallest of theirs.  CNAME records are skipped; the server
+// includes the records for the name they point to.
+static DnsResult ParseAnswer(const uint8_t* msg, size_t len, uint16_t id,
+                             const char* name, uint16_t type,
+                             ResolverEntry* e, uint32_t* ttl) {
+  if (len < 12 || Get16(&msg[0]) != id || (msg[2] & 0x80) == 0 ||
+      Get16(&msg[4]) != 1) {
+    return kCoDnsIgnore;
+  }
+  size_t p = 12;
+  if (MatchName(msg, len, &p, name) != 1 || p + 4 > len ||
+      Get16(&msg[p]) != type) {
+    return kCoDnsIgnore;
+  }
+  p += 4;
+  int rcode = msg[3] & 0x0f;
+  if (rcode == 3) {
+    return kCoDnsNoName;
+  }
+  if (rcode != 0) {
+    return kCoDnsFailed;
+  }
+  int num_answers = Get16(&msg[6]);
+  for (int i = 0; i < num_answers; i++) {
+    if (MatchName(msg, len, &p, name) == -1 || p + 10 > len) {
+      break;
+    }
+    uint16_t rtype = Get16(&msg[p]);
+    uint32_t rttl = Get32(&msg[p + 4]);
+    uint16_t length = Get16(&msg[p + 8]);
+    p += 10;
+    if (p + length > len) {
+      break;
+    }
+    if (rtype == kCoDnsTypeA && length == 4) {
+      AddIp(e, AF_INET, &msg[p]);
+    } else if (rtype == kCoDnsTypeAAAA && length == 16) {
+      AddIp(e, AF_INET6, &msg[p]);
+    } else {
+      p += length;
+      continue;
+    }
+    if (rttl < *ttl) {
+      *ttl = rttl;
+    }
+    p += length;
+  }
+  return kCoDnsAnswer;
+}
+
+// Working space for a lookup, kept off the coroutine's stack.
+typedef struct {
+  uint8_t message[kCoDnsMaxMessage];
+  uint8_t query[kCoDnsMaxName + 32];
+  ResolverEntry* a;     // Answers to the A query.
+  ResolverEntry* aaaa;  // Answers to the AAAA query.
+  uint32_t ttl;
+} Lookup;
+
+// Sends both queries to one server and waits for the answers.  Returns
+// true if the server answered both.
+static bool AskServer(Coroutine* c, Resolver* r, const ResolvedAddress* server,
+                      const char* name, Lookup* lookup) {
+  int fd = socket(server->addr.sa.sa_family, SOCK_DGRAM, 0);
+  if (fd == -1) {
+    return false;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  // Connected, so only the server's datagrams are received.
+  if (connect(fd, &server->addr.sa, server->length) == -1) {
+    CoroutineClose(c, fd);
+    return false;
+  }
+  uint16_t ids[2] = {NewId(r), NewId(r)};
+  uint16_t types[2] = {kCoDnsTypeA, kCoDnsTypeAAAA};
+  ResolverEntry* entries[2] = {lookup->a, lookup->aaaa};
+  bool answered[2] = {false, false};
+  for (int i = 0; i < 2; i++) {
+    size_t n = BuildQuery(lookup->query, ids[i], name, types[i]);
+    if (n == 0 || send(fd, lookup->query, n, 0) == -1) {
+      CoroutineClose(c, fd);
+      return false;
+    }
+  }
+  uint64_t deadline = NowNanos() + r->timeout;
+  int num_answered = 0;
+  bool failed = false;
+  while (num_answered < 2 && !failed) {
+    ssize_t n = recv(fd, lookup->message, sizeof(lookup->message), 0);
+    if (n == -1) {
+      uint64_t now = NowNanos();
+      if ((errno != EAGAIN && errno != EWOULDBLOCK) || now >= deadline ||
+          CoroutineWaitWithTimeout(c, fd, POLLIN, deadline - now) !=
+              kCoWaitReady) {
+        // Refused (no server there), timed out or cancelled.
+        break;
+      }
+      continue;
+    }
+    for (int i = 0; i < 2; i++) {
+      if (answered[i]) {
+        continue;
+      }
+      switch (ParseAnswer(lookup->message, n, ids[i], name, types[i],
+                          entries[i], &lookup->ttl)) {
+        case kCoDnsIgnore:
+          continue;
+        case kCoDnsFailed:
+          failed = true;
+          break;
+        case kCoDnsAnswer:
+        case kCoDnsNoName:
+          // A name that doesn't exist is cached with no addresses.
+          break;
+      }
+      answered[i] = true;
+      num_answered++;
+      break;
+    }
+  }
+  CoroutineClose(c, fd);
+  if (num_answered == 2 && !failed) {
+    return true;
+  }
+  // Throw away a half answer, we'll ask again.
+  lookup->a->num_ips = 0;
+  lookup->aaaa->num_ips = 0;
+  lookup->ttl = kCoDnsMaxTtl;
+  return false;
+}
+
+static size_t CopyAddresses(const ResolverEntry* e, uint16_t port, int family,
+                            ResolvedAddress* addresses, size_t max) {
+  size_t n = 0;
+  for (size_t i = 0; i < e->num_ips && n < max; i++) {
+    const ResolverIp* ip = &e->ips[i];
+    if (family != AF_UNSPEC && ip->family != family) {
+      continue;
+    }
+    ResolvedAddress* a = &addresses[n++];
+    memset(a, 0, sizeof(*a));
+    if (ip->family == AF_INET) {
+      a->addr.v4.sin_family = AF_INET;
+      a->addr.v4.sin_port = htons(port);
+      memcpy(&a->addr.v4.sin_addr, ip->bytes, 4);
+      a->length = sizeof(a->addr.v4);
+    } else {
+      a->addr.v6.sin6_family = AF_INET6;
+      a->addr.v6.sin6_port = htons(port);
+      memcpy(&a->addr.v6.sin6_addr, ip->bytes, 16);
+      a->length = sizeof(a->addr.v6);
+    }
+  }
+  return n;
+}
+
+static void FindExpired(MapKeyValue* kv, void* data) {
+  ResolverEntry* e = kv->value.p;
+  Vector* expired = data;
+  if (e->expiry <= NowNanos()) {
+    VectorAppend(expired, e);
+  }
+}
+
+// Removes the expired entries.  Called with the lock held.
+static void Prune(Resolver* r) {
+  Vector expired;
+  VectorInit(&expired);
+  HashMapTraverse(&r->cache, FindExpired, &expired);
+  for (size_t i = 0; i < expired.length; i++) {
+    ResolverEntry* e = expired.value.p[i];
+    HashMapRemove(&r->cache, (MapKeyType){.p = e->name});
+    DeleteEntry(e);
+  }
+  VectorDestruct(&expired);
+}
+
+// Puts the addresses found by the lookup in the cache, the IPv4 ones
+// before the IPv6 ones, and copies them out.
+static size_t CacheLookup(Coroutine* c, Resolver* r, Lookup* lookup,
+                          uint16_t port, int family,
+                          ResolvedAddress* addresses, size_t max) {
+  ResolverEntry* e = lookup->a;
+  for (size_t i = 0; i < lookup->aaaa->num_ips; i++) {
+    AddIp(e, AF_INET6, lookup->aaaa->ips[i].bytes);
+  }
+  uint32_t ttl = e->num_ips == 0 ? kCoResolverNegativeTtl : lookup->ttl;
+  e->expiry = NowNanos() + (uint64_t)ttl * 1000000000;
+  DeleteEntry(lookup->aaaa);
+
+  CoMutexLock(&r->lock, c);
+  if (r->cache.length >= kCoResolverPruneSize) {
+    Prune(r);
+  }
+  ResolverEntry* old = HashMapRemove(&r->cache, (MapKeyType){.p = e->name});
+  if (old != NULL) {
+    // Someone else looked it up at the same time.
+    DeleteEntry(old);
+  }
+  HashMapInsert(&r->cache, (MapKeyValue){.key.p = e->name, .value.p = e});
+  size_t n = CopyAddresses(e, port, family, addresses, max);
+  CoMutexUnlock(&r->lock);
+  return n;
+}
+
+// Copies the addresses from a cache entry if there is one that is still
+// good.  Returns -1 if there isn't.
+static ssize_t FindInCache(Coroutine* c, Resolver* r, const char* name,
+                           uint16_t port, int family,
+                           ResolvedAddress* addresses, size_t max) {
+  ssize_t n = -1;
+  CoMutexLock(&r->lock, c);
+  ResolverEntry* e = HashMapFind(&r->cache, (MapKeyType){.p = (void*)name});
+  if (e != NULL && e->expiry > NowNanos()) {
+    n = CopyAddresses(e, port, family, addresses, max);
+  }
+  CoMutexUnlock(&r->lock);
+  return n;
+}
+
+ssize_t CoroutineResolve(Coroutine* c, Resolver* r, const char* host,
+                         uint16_t port, int family, ResolvedAddress* addresses,
+                         size_t max) {
+  if (max == 0) {
+    return 0;
+  }
+  // Numeric addresses don't need a lookup.
+  if (ParseAddress(host, port, &addresses[0])) {
+    return family == AF_UNSPEC || addresses[0].addr.sa.sa_family == family;
+  }
+  char name[kCoDnsMaxName];
+  if (!NormalizeName(host, name)) {
+    errno = EINVAL;
+    return -1;
+  }
+  ssize_t n = FindInCache(c, r, name, port, family, addresses, max);
+  if (n != -1) {
+    return n;
+  }
+
+  Lookup* lookup = malloc(sizeof(Lookup));
+  lookup->a = NewEntry(name);
+  lookup->aaaa = NewEntry(name);
+  lookup->ttl = kCoDnsMaxTtl;
+  bool answered = false;
+  for (int attempt = 0; attempt < r->attempts && !answered; attempt++) {
+    for (size_t i = 0; i < r->num_servers && !answered; i++) {
+      answered = AskServer(c, r, &r->servers[i], name, lookup);
+    }
+  }
+  if (!answered) {
+    DeleteEntry(lookup->a);
+    DeleteEntry(lookup->aaaa);
+    free(lookup);
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  n = CacheLookup(c, r, lookup, port, family, addresses, max);
+  free(lookup);
+  return n;
+}
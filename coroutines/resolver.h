@@ -0,0 +1,77 @@
+//
+//  resolver.h
+//  coroutines
+//
+
+#ifndef resolver_h
+#define resolver_h
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "coroutine.h"
+#include "hashmap.h"
+#include "sync.h"
+
+// A DNS resolver for coroutines.  Looking up a name sends A and AAAA
+// queries over UDP to the name servers in /etc/resolv.conf and the
+// coroutine waits for the answers like it would for any other fd, so other
+// coroutines keep running.  The answers are cached for as long as their TTL
+// says (names that don't exist for kCoResolverNegativeTtl seconds).  Names
+// in /etc/hosts are always found there first.
+//
+// Names are looked up as given: the search list in resolv.conf isn't
+// applied.  A Resolver can be shared by coroutines on all the machines of a
+// scheduler.
+
+#define kCoResolverPort 53
+#define kCoResolverMaxServers 3
+#define kCoResolverMaxAddresses 16
+#define kCoResolverNegativeTtl 30
+#define kCoResolverDefaultTimeout (2ULL * 1000000000)  // Nanoseconds.
+#define kCoResolverDefaultAttempts 2
+
+// An address found by CoroutineResolve, ready to pass to connect.
+typedef struct {
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+  } addr;
+  socklen_t length;
+} ResolvedAddress;
+
+typedef struct {
+  ResolvedAddress servers[kCoResolverMaxServers];
+  size_t num_servers;
+  uint64_t timeout;  // Time to wait for a server to answer, in nanoseconds.
+  int attempts;      // Times round all the servers before giving up.
+  CoMutex lock;      // Protects the cache.
+  HashMap cache;     // Lower case name to ResolverEntry.
+  _Atomic(uint64_t) random;  // For query ids.
+} Resolver;
+
+// Initializes the resolver with the name servers in /etc/resolv.conf (or
+// 127.0.0.1 if there are none) and the names in /etc/hosts.
+void ResolverInit(Resolver* r);
+void ResolverDestruct(Resolver* r);
+
+// Replaces the name servers with the one at the given numeric address.
+// Returns false if the address isn't valid.
+bool ResolverSetServer(Resolver* r, const char* address, uint16_t port);
+
+// Finds the addresses of the host, which may be a name or a numeric IPv4 or
+// IPv6 address, like getaddrinfo does.  'family' is AF_INET, AF_INET6 or
+// AF_UNSPEC for both, in which case the IPv4 addresses come first.  Up to
+// 'max' addresses are stored with the given port.  Returns the number of
+// addresses, 0 if the host doesn't exist or has no addresses in the family
+// and -1 if no name server answered, with errno set.
+ssize_t CoroutineResolve(Coroutine* c, Resolver* r, const char* host,
+                         uint16_t port, int family, ResolvedAddress* addresses,
+                         size_t max);
+
+#endif /* resolver_h */
@@ -0,0 +1,274 @@
+//
+//  scheduler.c
+//  coroutines
+//
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include "scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The worker whose machine is running on this thread.
+static _Thread_local CoroutineSchedulerWorker* current_worker;
+
+static CoroutineSchedulerWorker* MachineWorker(CoroutineMachine* m) {
+  return m->hooks_arg;
+}
+
+// Wakes up one idle worker so that it can steal the work we just pushed.
+// The fence orders the push before the read of num_idle.  A worker going
+// idle increments num_idle and then checks for work, so either it sees the
+// work or we see it idle.
+static void WakeIdleWorker(CoroutineScheduler* s) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&s->num_idle) == 0) {
+    return;
+  }
+  for (size_t i = 0; i < s->num_workers; i++) {
+    CoroutineSchedulerWorker* w = &s->workers[i];
+    bool expected = true;
+    if (atomic_compare_exchange_strong(&w->idle, &expected, false)) {
+      atomic_fetch_sub(&s->num_idle, 1);
+      CoroutineMachineInterrupt(&w->machine);
+      return;
+    }
+  }
+}
+
+static bool AnyWork(CoroutineScheduler* s) {
+  for (size_t i = 0; i < s->num_workers; i++) {
+    if (!WorkDequeIsEmpty(&s->workers[i].deque)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint32_t NextRandom(CoroutineSchedulerWorker* w) {
+  // xorshift32.
+  uint32_t x = w->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  w->random = x;
+  return x;
+}
+
+// Tries to steal a coroutine from the other workers, starting at a random
+// one so that thieves don't all pick on the same victim.
+static bool StealWork(CoroutineSchedulerWorker* w) {
+  CoroutineScheduler* s = w->scheduler;
+  size_t start = NextRandom(w) % s->num_workers;
+  for (size_t i = 0; i < s->num_workers; i++) {
+    CoroutineSchedulerWorker* victim =
+        &s->workers[(start + i) % s->num_workers];
+    if (victim == w) {
+      continue;
+    }
+    Coroutine* c = WorkDequeSteal(&victim->deque);
+    if (c != NULL) {
+      CoroutineMachineAdopt(&w->machine, c);
+      return true;
+    }
+  }
+  return false;
+}
+
+// A busy machine takes one of its own coroutines a round, leaving the rest
+// for thieves.  An idle one steals if it has none of its own.
+static void FindWork(CoroutineMachine* m, bool idle) {
+  CoroutineSchedulerWorker* w = MachineWorker(m);
+  Coroutine* c = WorkDequeTake(&w->deque);
+  if (c != NULL) {
+    CoroutineMachineAdopt(m, c);
+    return;
+  }
+  if (idle) {
+    StealWork(w);
+  }
+}
+
+static void Wake(CoroutineMachine* m) {
+  CoroutineSchedulerWorker* w = MachineWorker(m);
+  if (atomic_exchange(&w->idle, false)) {
+    atomic_fetch_sub(&w->scheduler->num_idle, 1);
+  }
+}
+
+static bool Sleep(CoroutineMachine* m) {
+  CoroutineSchedulerWorker* w = MachineWorker(m);
+  CoroutineScheduler* s = w->scheduler;
+  if (atomic_load(&s->stopped)) {
+    // The machine might have started running after it was stopped.
+    CoroutineMachineStop(m);
+    return false;
+  }
+  atomic_store(&w->idle, true);
+  atomic_fetch_add(&s->num_idle, 1);
+  if (atomic_load(&s->stopped) || AnyWork(s)) {
+    Wake(m);
+    return false;
+  }
+  return true;
+}
+
+static void Added(CoroutineMachine* m) {
+  atomic_fetch_add(&MachineWorker(m)->scheduler->num_coroutines, 1);
+}
+
+static void Removed(CoroutineMachine* m) {
+  CoroutineScheduler* s = MachineWorker(m)->scheduler;
+  if (atomic_fetch_sub(&s->num_coroutines, 1) == 1) {
+    // That was the last one anywhere.
+    CoroutineSchedulerStop(s);
+  }
+}
+
+static const CoroutineMachineHooks scheduler_hooks = {
+    .find_work = FindWork,
+    .sleep = Sleep,
+    .wake = Wake,
+    .added = Added,
+    .removed = Removed,
+};
+
+void CoroutineSchedulerInit(CoroutineScheduler* s, size_t num_machines) {
+  CoroutineMachineOptions options;
+  CoroutineMachineOptionsInit(&options);
+  CoroutineSchedulerInitWithOptions(s, num_machines, &options);
+}
+
+void CoroutineSchedulerInitWithOptions(CoroutineScheduler* s,
+                                       size_t num_machines,
+                                       const CoroutineMachineOptions* options) {
+  if (num_machines == 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_machines = num_cpus > 0 ? num_cpus : 1;
+  }
+  s->workers = malloc(num_machines * sizeof(CoroutineSchedulerWorker));
+  s->num_workers = num_machines;
+  atomic_init(&s->num_coroutines, 0);
+  atomic_init(&s->num_idle, 0);
+  atomic_init(&s->next_worker, 0);
+  atomic_init(&s->stopped, false);
+  s->pin_threads = true;
+  for (size_t i = 0; i < num_machines; i++) {
+    CoroutineSchedulerWorker* w = &s->workers[i];
+    CoroutineMachineInitWithOptions(&w->machine, options);
+    CoroutineMachineSetHooks(&w->machine, &scheduler_hooks, w);
+    WorkDequeInit(&w->deque);
+    atomic_init(&w->idle, false);
+    w->random = (uint32_t)(i + 1) * 2654435761u;
+    w->index = i;
+    w->scheduler = s;
+  }
+}
+
+void CoroutineSchedulerDestruct(CoroutineScheduler* s) {
+  for (size_t i = 0; i < s->num_workers; i++) {
+    CoroutineSchedulerWorker* w = &s->workers[i];
+    Coroutine* c;
+    while ((c = WorkDequeTake(&w->deque)) != NULL) {
+      CoroutineDelete(c);
+    }
+    CoroutineMachineDestruct(&w->machine);
+  }
+  free(s->workers);
+  s->workers = NULL;
+  s->num_workers = 0;
+}
+
+static void PinThread(size_t index) {
+#if defined(__linux__)
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus <= 0) {
+    return;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(index % num_cpus, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+}
+
+static void* WorkerThread(void* arg) {
+  CoroutineSchedulerWorker* w = arg;
+  current_worker = w;
+  if (w->scheduler->pin_threads) {
+    PinThread(w->index);
+  }
+  CoroutineMachineRun(&w->machine);
+  current_worker = NULL;
+  return NULL;
+}
+
+void CoroutineSchedulerRun(CoroutineScheduler* s) {
+  if (atomic_load(&s->num_coroutines) == 0) {
+    return;
+  }
+  for (size_t i = 0; i < s->num_workers; i++) {
+    pthread_create(&s->workers[i].thread, NULL, WorkerThread, &s->workers[i]);
+  }
+  for (size_t i = 0; i < s->num_workers; i++) {
+    pthread_join(s->workers[i].thread, NULL);
+  }
+}
+
+void CoroutineSchedulerStop(CoroutineScheduler* s) {
+  atomic_store(&s->stopped, true);
+  for (size_t i = 0; i < s->num_workers; i++) {
+    CoroutineMachineStop(&s->workers[i].machine);
+  }
+}
+
+void CoroutineSchedulerSpawn(CoroutineScheduler* s, CoroutineFunctor functor,
+                             void* user_data) {
+  CoroutineSchedulerSpawnWithStackSize(s, functor, kCoDefaultStackSize,
+                                       user_data);
+}
+
+// Gives a detached coroutine to a machine.
+static void Spawn(CoroutineScheduler* s, Coroutine* c) {
+  CoroutineSchedulerWorker* w = current_worker;
+  if (w != NULL && w->scheduler == s) {
+    // Coroutines in the deque are counted here as they don't go through
+    // CoroutineStartOnMachine.
+    atomic_fetch_add(&s->num_coroutines, 1);
+    if (WorkDequePush(&w->deque, c)) {
+      WakeIdleWorker(s);
+      return;
+    }
+    // The deque is full, start it on our own machine.
+    CoroutineStartOnMachine(&w->machine, c);
+    atomic_fetch_sub(&s->num_coroutines, 1);
+    return;
+  }
+  size_t index = atomic_fetch_add(&s->next_worker, 1) % s->num_workers;
+  CoroutineStartOnMachine(&s->workers[index].machine, c);
+}
+
+void CoroutineSchedulerSpawnWithStackSize(CoroutineScheduler* s,
+                                          CoroutineFunctor functor,
+                                          size_t stack_size, void* user_data) {
+  Spawn(s, NewDetachedCoroutine(functor, stack_size, user_data));
+}
+
+void CoroutineSchedulerSpawnWithInlineUserData(CoroutineScheduler* s,
+                                               CoroutineFunctor functor,
+                                               const void* user_data,
+                                               size_t size) {
+  Coroutine* c = NewDetachedCoroutineWithInlineUserData(
+      functor, kCoDefaultStackSize, size);
+  memcpy(CoroutineGetUserData(c), user_data, size);
+  Spawn(s, c);
+}
+
+CoroutineMachine* CoroutineSchedulerGetMachine(CoroutineScheduler* s,
+                                               size_t index) {
+  return &s->workers[index].machine;
+}
@@ -0,0 +1,84 @@
+//
+//  scheduler.h
+//  coroutines
+//
+
+#ifndef scheduler_h
+#define scheduler_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "coroutine.h"
+#include "deque.h"
+
+// A CoroutineScheduler runs a CoroutineMachine on each of a number of
+// threads.  Each machine has its own ready queue and poller and runs its
+// coroutines exactly as a single machine does, so a coroutine never moves
+// between threads once it has started.
+//
+// Coroutines spawned through the scheduler are pushed onto a work stealing
+// deque belonging to the spawning thread's machine.  Machines that run out
+// of work steal coroutines that haven't started yet from the others.  Idle
+// machines block in their pollers and are woken through their interrupt fds
+// when there is work to steal.
+//
+// The scheduler stops when there are no coroutines left on any machine.
+
+struct CoroutineScheduler;
+
+typedef struct {
+  CoroutineMachine machine;
+  WorkDeque deque;  // Detached coroutines that can be stolen.
+  pthread_t thread;
+  atomic_bool idle;  // Blocked in the poller.
+  uint32_t random;   // State for choosing victims.
+  size_t index;
+  struct CoroutineScheduler* scheduler;
+} CoroutineSchedulerWorker;
+
+typedef struct CoroutineScheduler {
+  CoroutineSchedulerWorker* workers;
+  size_t num_workers;
+  atomic_size_t num_coroutines;  // Alive or waiting to start.
+  atomic_size_t num_idle;
+  atomic_size_t next_worker;  // For coroutines spawned by other threads.
+  atomic_bool stopped;
+  bool pin_threads;  // Pin each thread to a CPU (Linux only).
+} CoroutineScheduler;
+
+// Initialize a scheduler with the given number of machines, or one for each
+// CPU if num_machines is 0.  Threads are pinned to CPUs by default.
+void CoroutineSchedulerInit(CoroutineScheduler* s, size_t num_machines);
+void CoroutineSchedulerInitWithOptions(CoroutineScheduler* s,
+                                       size_t num_machines,
+                                       const CoroutineMachineOptions* options);
+void CoroutineSchedulerDestruct(CoroutineScheduler* s);
+
+// Run all the machines, each on its own thread, until there are no
+// coroutines left or the scheduler is stopped.
+void CoroutineSchedulerRun(CoroutineScheduler* s);
+void CoroutineSchedulerStop(CoroutineScheduler* s);
+
+// Spawn a new coroutine.  When called from one of the scheduler's threads
+// the coroutine will be run by that thread's machine unless another machine
+// steals it first.  From any other thread it is started on the machines in
+// turn.
+void CoroutineSchedulerSpawn(CoroutineScheduler* s, CoroutineFunctor functor,
+                             void* user_data);
+void CoroutineSchedulerSpawnWithStackSize(CoroutineScheduler* s,
+                                          CoroutineFunctor functor,
+                                          size_t stack_size, void* user_data);
+
+// Spawn a coroutine with a copy of 'size' bytes of user data, which is
+// allocated with the coroutine and freed when it exits.
+void CoroutineSchedulerSpawnWithInlineUserData(CoroutineScheduler* s,
+                                               CoroutineFunctor functor,
+                                               const void* user_data,
+                                               size_t size);
+
+CoroutineMachine* CoroutineSchedulerGetMachine(CoroutineScheduler* s,
+                                               size_t index);
+
+#endif /* scheduler_h */
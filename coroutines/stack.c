@@ -0,0 +1,127 @@
+//
+//  stack.c
+//  coroutines
+//
+
+#include "stack.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Free stacks are held in a singly linked list.  The link is stored at
+// the top of the stack since that page is always committed.
+typedef struct FreeStack {
+  struct FreeStack* next;
+} FreeStack;
+
+static FreeStack* StackLink(void* stack, size_t size) {
+  return (FreeStack*)((char*)stack + size - sizeof(FreeStack));
+}
+
+static void* LinkStack(FreeStack* link, size_t size) {
+  return (char*)link + sizeof(FreeStack) - size;
+}
+
+void StackPoolInit(StackPool* pool, size_t max_free) {
+  for (int i = 0; i < kCoNumStackClasses; i++) {
+    pool->free_lists[i] = NULL;
+    pool->num_free[i] = 0;
+  }
+  pool->max_free = max_free;
+  pool->page_size = (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Works out the size class for a stack and rounds the size up to it.
+// Returns -1 if the stack is too big to be pooled (and rounds the size up
+// to a page).
+static int SizeClass(StackPool* pool, size_t* size) {
+  int shift = kCoMinStackShift;
+  while (shift <= kCoMaxStackShift && ((size_t)1 << shift) < *size) {
+    shift++;
+  }
+  if (shift > kCoMaxStackShift) {
+    *size = (*size + pool->page_size - 1) & ~(pool->page_size - 1);
+    return -1;
+  }
+  *size = (size_t)1 << shift;
+  if (*size < pool->page_size) {
+    *size = pool->page_size;
+  }
+  return shift - kCoMinStackShift;
+}
+
+static void UnmapStack(StackPool* pool, void* stack, size_t size) {
+  munmap((char*)stack - pool->page_size, size + pool->page_size);
+}
+
+void StackPoolDestruct(StackPool* pool) {
+  for (int i = 0; i < kCoNumStackClasses; i++) {
+    size_t size = (size_t)1 << (i + kCoMinStackShift);
+    if (size < pool->page_size) {
+      size = pool->page_size;
+    }
+    FreeStack* link = pool->free_lists[i];
+    while (link != NULL) {
+      FreeStack* next = link->next;
+      UnmapStack(pool, LinkStack(link, size), size);
+      link = next;
+    }
+    pool->free_lists[i] = NULL;
+    pool->num_free[i] = 0;
+  }
+}
+
+void* StackPoolAllocate(StackPool* pool, size_t* size) {
+  int size_class = SizeClass(pool, size);
+  if (size_class >= 0 && pool->free_lists[size_class] != NULL) {
+    FreeStack* link = pool->free_lists[size_class];
+    pool->free_lists[size_class] = link->next;
+    pool->num_free[size_class]--;
+    return LinkStack(link, *size);
+  }
+
+  // Map the stack and its guard page.  MAP_NORESERVE means that we only
+  // use memory for what's touched.
+  size_t total = *size + pool->page_size;
+  char* mem = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+  if (mprotect(mem, pool->page_size, PROT_NONE) != 0) {
+    munmap(mem, total);
+    return NULL;
+  }
+  return mem + pool->page_size;
+}
+
+void StackPoolFree(StackPool* pool, void* stack, size_t size) {
+  if (stack == NULL) {
+    return;
+  }
+  int size_class = SizeClass(pool, &size);
+  if (size_class < 0 || pool->num_free[size_class] >= pool->max_free) {
+    UnmapStack(pool, stack, size);
+    return;
+  }
+  if (size >= kCoStackReleaseSize) {
+    // Give back all but the top page, which holds the free list link.
+#if defined(__APPLE__)
+    madvise(stack, size - pool->page_size, MADV_FREE);
+#else
+    madvise(stack, size - pool->page_size, MADV_DONTNEED);
+#endif
+  }
+  FreeStack* link = StackLink(stack, size);
+  link->next = pool->free_lists[size_class];
+  pool->free_lists[size_class] = link;
+  pool->num_free[size_class]++;
+}
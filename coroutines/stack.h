@@ -0,0 +1,63 @@
+//
+//  stack.h
+//  coroutines
+//
+
+#ifndef stack_h
+#define stack_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A pool of coroutine stacks allocated using mmap.  Each stack has a
+// PROT_NONE guard page below it so that a stack overflow causes a fault
+// rather than silently corrupting other memory.
+//
+// Stack sizes are rounded up to a power of two and freed stacks are kept on
+// a free list for their size, ready to be reused.  Memory for a stack is
+// only committed when it is touched.  When a large stack is returned to the
+// pool its pages, other than the top one, are given back to the operating
+// system so that a pooled stack doesn't hold on to memory it used once.
+//
+// The guard page and the stack are two separate mappings, so every stack,
+// pooled or in use, costs the process two memory map entries.  Linux limits
+// these to vm.max_map_count (65530 by default) which caps a process at
+// around 32,000 stacks.  Beyond that StackPoolAllocate returns NULL and a
+// machine falls back to stacks from malloc, which have no guard page.
+
+// Smallest stack is 2^kCoMinStackShift bytes, largest pooled stack is
+// 2^kCoMaxStackShift bytes.  Larger stacks are unmapped when freed.
+#define kCoMinStackShift 12
+#define kCoMaxStackShift 30
+#define kCoNumStackClasses (kCoMaxStackShift - kCoMinStackShift + 1)
+
+// Stacks of this size or more have their pages released when freed.
+#define kCoStackReleaseSize (64 * 1024)
+
+// Default number of free stacks kept for each size.  Enough for bursts of
+// coroutines to be started from the pool rather than mapped.
+#define kCoDefaultMaxFreeStacks 1024
+
+typedef struct {
+  void* free_lists[kCoNumStackClasses];  // Free stacks for each size.
+  size_t num_free[kCoNumStackClasses];   // Number of stacks in free list.
+  size_t max_free;                       // Max free stacks for each size.
+  size_t page_size;
+} StackPool;
+
+void StackPoolInit(StackPool* pool, size_t max_free);
+
+// Unmaps all the free stacks.  Stacks in use are not touched.
+void StackPoolDestruct(StackPool* pool);
+
+// Allocates a stack of at least *size bytes, setting *size to the amount
+// of stack actually available.  The stack occupies the memory from the
+// address returned to that address plus *size.  Returns NULL if the memory
+// can't be mapped.
+void* StackPoolAllocate(StackPool* pool, size_t* size);
+
+// Returns a stack to the pool.  The size must be the one set by
+// StackPoolAllocate.
+void StackPoolFree(StackPool* pool, void* stack, size_t size);
+
+#endif /* stack_h */
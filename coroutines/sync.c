@@ -0,0 +1,240 @@
+//
+//  sync.c
+//  coroutines
+//
+
+#include "sync.h"
+#include <assert.h>
+#include <sched.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// A parked coroutine, on its own stack.  The element must be at offset 0.
+typedef struct {
+  ListElement element;
+  Coroutine* coroutine;
+  atomic_bool woken;
+} CoWaiter;
+
+// The spin locks are only held for a few instructions so a waiter spins for
+// a while before giving up the CPU.
+static void Lock(atomic_flag* lock) {
+  int spins = 0;
+  while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+    if (++spins < 100) {
+#if defined(__SSE2__)
+      _mm_pause();
+#endif
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+static void Unlock(atomic_flag* lock) {
+  atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+static void AddWaiter(List* waiters, CoWaiter* w, Coroutine* c) {
+  ListElementInit(&w->element);
+  w->coroutine = c;
+  atomic_init(&w->woken, false);
+  ListAppend(waiters, &w->element);
+}
+
+// Wakes a waiter that has been taken off the list.  This is called with the
+// primitive's lock held.
+static void Wake(CoWaiter* w) {
+  Coroutine* c = w->coroutine;
+  atomic_store_explicit(&w->woken, true, memory_order_release);
+  CoroutineUnpark(c);
+}
+
+static bool WakeFirst(List* waiters) {
+  CoWaiter* w = (CoWaiter*)waiters->first;
+  if (w == NULL) {
+    return false;
+  }
+  ListDeleteElement(waiters, &w->element);
+  Wake(w);
+  return true;
+}
+
+static void WakeAll(List* waiters) {
+  while (WakeFirst(waiters)) {
+  }
+}
+
+// Parks until woken.  The waker unparks us while it holds the lock, so we
+// take the lock once more before going on.  Until then the waker may still
+// be using both us and the primitive, either of which could go away as soon
+// as we return.
+static void Park(atomic_flag* lock, CoWaiter* w) {
+  while (!atomic_load_explicit(&w->woken, memory_order_acquire)) {
+    CoroutinePark(w->coroutine);
+  }
+  Lock(lock);
+  Unlock(lock);
+}
+
+void CoMutexInit(CoMutex* m) { CoMutexInitWithMode(m, kCoSyncBarging); }
+
+void CoMutexInitWithMode(CoMutex* m, CoSyncMode mode) {
+  atomic_flag_clear(&m->lock);
+  m->locked = false;
+  m->mode = mode;
+  ListInit(&m->waiters);
+}
+
+void CoMutexLock(CoMutex* m, Coroutine* c) {
+  for (;;) {
+    Lock(&m->lock);
+    if (!m->locked) {
+      m->locked = true;
+      Unlock(&m->lock);
+      return;
+    }
+    CoWaiter w;
+    AddWaiter(&m->waiters, &w, c);
+    Unlock(&m->lock);
+    Park(&m->lock, &w);
+    if (m->mode == kCoSyncHandoff) {
+      // The unlocker gave it to us.
+      return;
+    }
+  }
+}
+
+bool CoMutexTryLock(CoMutex* m) {
+  Lock(&m->lock);
+  bool acquired = !m->locked;
+  m->locked = true;
+  Unlock(&m->lock);
+  return acquired;
+}
+
+void CoMutexUnlock(CoMutex* m) {
+  Lock(&m->lock);
+  assert(m->locked);
+  if (m->mode == kCoSyncHandoff) {
+    // Stays locked if there is a waiter to take it.
+    m->locked = WakeFirst(&m->waiters);
+  } else {
+    m->locked = false;
+    WakeFirst(&m->waiters);
+  }
+  Unlock(&m->lock);
+}
+
+void CoCondVarInit(CoCondVar* cv) {
+  atomic_flag_clear(&cv->lock);
+  ListInit(&cv->waiters);
+}
+
+void CoCondVarWait(CoCondVar* cv, CoMutex* m, Coroutine* c) {
+  // We are waiting before the mutex is unlocked, so a signal sent by
+  // whoever gets the mutex next can't be missed.
+  CoWaiter w;
+  Lock(&cv->lock);
+  AddWaiter(&cv->waiters, &w, c);
+  Unlock(&cv->lock);
+  CoMutexUnlock(m);
+  Park(&cv->lock, &w);
+  CoMutexLock(m, c);
+}
+
+void CoCondVarSignal(CoCondVar* cv) {
+  Lock(&cv->lock);
+  WakeFirst(&cv->waiters);
+  Unlock(&cv->lock);
+}
+
+void CoCondVarBroadcast(CoCondVar* cv) {
+  Lock(&cv->lock);
+  WakeAll(&cv->waiters);
+  Unlock(&cv->lock);
+}
+
+void CoSemaphoreInit(CoSemaphore* s, int64_t count) {
+  CoSemaphoreInitWithMode(s, count, kCoSyncBarging);
+}
+
+void CoSemaphoreInitWithMode(CoSemaphore* s, int64_t count, CoSyncMode mode) {
+  atomic_flag_clear(&s->lock);
+  s->count = count;
+  s->mode = mode;
+  ListInit(&s->waiters);
+}
+
+void CoSemaphoreWait(CoSemaphore* s, Coroutine* c) {
+  for (;;) {
+    Lock(&s->lock);
+    if (s->count > 0) {
+      s->count--;
+      Unlock(&s->lock);
+      return;
+    }
+    CoWaiter w;
+    AddWaiter(&s->waiters, &w, c);
+    Unlock(&s->lock);
+    Park(&s->lock, &w);
+    if (s->mode == kCoSyncHandoff) {
+      // The poster gave us its count.
+      return;
+    }
+  }
+}
+
+bool CoSemaphoreTryWait(CoSemaphore* s) {
+  Lock(&s->lock);
+  bool acquired = s->count > 0;
+  if (acquired) {
+    s->count--;
+  }
+  Unlock(&s->lock);
+  return acquired;
+}
+
+void CoSemaphorePost(CoSemaphore* s) {
+  Lock(&s->lock);
+  if (s->mode == kCoSyncHandoff) {
+    if (!WakeFirst(&s->waiters)) {
+      s->count++;
+    }
+  } else {
+    s->count++;
+    WakeFirst(&s->waiters);
+  }
+  Unlock(&s->lock);
+}
+
+void CoWaitGroupInit(CoWaitGroup* wg) {
+  atomic_flag_clear(&wg->lock);
+  wg->count = 0;
+  ListInit(&wg->waiters);
+}
+
+void CoWaitGroupAdd(CoWaitGroup* wg, int64_t delta) {
+  Lock(&wg->lock);
+  wg->count += delta;
+  assert(wg->count >= 0);
+  if (wg->count == 0) {
+    WakeAll(&wg->waiters);
+  }
+  Unlock(&wg->lock);
+}
+
+void CoWaitGroupDone(CoWaitGroup* wg) { CoWaitGroupAdd(wg, -1); }
+
+void CoWaitGroupWait(CoWaitGroup* wg, Coroutine* c) {
+  Lock(&wg->lock);
+  if (wg->count == 0) {
+    Unlock(&wg->lock);
+    return;
+  }
+  CoWaiter w;
+  AddWaiter(&wg->waiters, &w, c);
+  Unlock(&wg->lock);
+  Park(&wg->lock, &w);
+}
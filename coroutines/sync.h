@@ -0,0 +1,110 @@
+//
+//  sync.h
+//  coroutines
+//
+
+#ifndef sync_h
+#define sync_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "coroutine.h"
+#include "list.h"
+
+// Synchronization primitives for coroutines.  A coroutine that has to wait
+// is parked (see CoroutinePark) on an intrusive list of waiters inside the
+// primitive, so waiting costs nothing until it is woken and waking it just
+// puts it back on its machine's ready queue.  No file descriptors are
+// involved.
+//
+// The primitives can be shared by coroutines on different machines of a
+// CoroutineScheduler.  Each has a spin lock that is held only while its
+// list of waiters is changed, never while a coroutine is parked.
+
+// How a waiter gets a mutex or a semaphore.  When it is released in
+// kCoSyncBarging mode, the first waiter is woken and competes for it with
+// any coroutine that comes along before the waiter runs.  This gives the
+// most throughput.  In kCoSyncHandoff mode it is given straight to the
+// first waiter, so waiters are served in FIFO order and the time a waiter
+// can wait is bounded.
+typedef enum {
+  kCoSyncBarging,
+  kCoSyncHandoff,
+} CoSyncMode;
+
+typedef struct {
+  atomic_flag lock;  // Protects the rest.
+  bool locked;
+  CoSyncMode mode;
+  List waiters;
+} CoMutex;
+
+void CoMutexInit(CoMutex* m);
+void CoMutexInitWithMode(CoMutex* m, CoSyncMode mode);
+
+void CoMutexLock(CoMutex* m, Coroutine* c);
+bool CoMutexTryLock(CoMutex* m);
+void CoMutexUnlock(CoMutex* m);
+
+typedef struct {
+  atomic_flag lock;
+  List waiters;
+} CoCondVar;
+
+void CoCondVarInit(CoCondVar* cv);
+
+// Unlocks the mutex, waits to be signalled and locks the mutex again.  As
+// with pthreads, check the condition again when this returns.
+void CoCondVarWait(CoCondVar* cv, CoMutex* m, Coroutine* c);
+
+// Wake the first waiter, or all of them.
+void CoCondVarSignal(CoCondVar* cv);
+void CoCondVarBroadcast(CoCondVar* cv);
+
+typedef struct {
+  atomic_flag lock;
+  int64_t count;
+  CoSyncMode mode;
+  List waiters;
+} CoSemaphore;
+
+void CoSemaphoreInit(CoSemaphore* s, int64_t count);
+void CoSemaphoreInitWithMode(CoSemaphore* s, int64_t count, CoSyncMode mode);
+
+// Waits until the count is positive and decrements it.
+void CoSemaphoreWait(CoSemaphore* s, Coroutine* c);
+bool CoSemaphoreTryWait(CoSemaphore* s);
+
+// Increments the count, waking a waiter if there is one.
+void CoSemaphorePost(CoSemaphore* s);
+
+// A wait group waits for a number of things to finish, such as child
+// coroutines.  Add to the count before starting each one and have each call
+// CoWaitGroupDone when it finishes:
+//
+// CoWaitGroup wg;
+// CoWaitGroupInit(&wg);
+// for (int i = 0; i < n; i++) {
+//   CoWaitGroupAdd(&wg, 1);
+//   CoroutineStart(NewCoroutineWithUserData(c->machine, Child, &wg));
+// }
+// CoWaitGroupWait(&wg, c);
+typedef struct {
+  atomic_flag lock;
+  int64_t count;
+  List waiters;
+} CoWaitGroup;
+
+void CoWaitGroupInit(CoWaitGroup* wg);
+
+// Adds delta (which can be negative) to the count.  When it gets to zero all
+// the waiters are woken.
+void CoWaitGroupAdd(CoWaitGroup* wg, int64_t delta);
+void CoWaitGroupDone(CoWaitGroup* wg);
+
+// Waits until the count is zero.
+void CoWaitGroupWait(CoWaitGroup* wg, Coroutine* c);
+
+#endif /* sync_h */
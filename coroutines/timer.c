@@ -0,0 +1,176 @@
+//
+//  timer.c
+//  coroutines
+//
+
+#include "timer.h"
+
+void TimerWheelInit(TimerWheel* w, uint64_t now) {
+  for (int level = 0; level < kCoTimerLevels; level++) {
+    for (int slot = 0; slot < kCoTimerSlots; slot++) {
+      w->slots[level][slot] = NULL;
+    }
+    w->occupied[level] = 0;
+  }
+  w->now = now;
+  w->num_timers = 0;
+}
+
+void TimerInit(Timer* t) {
+  t->next = NULL;
+  t->prev = NULL;
+  t->expiry = 0;
+  t->level = 0;
+  t->slot = 0;
+  t->active = false;
+}
+
+// Puts a timer in the slot for its expiry, relative to the current tick.
+// Timers too far in the future to fit in the wheel go in the top level and
+// are moved down again when that slot comes around.
+static void InsertTimer(TimerWheel* w, Timer* t) {
+  uint64_t expiry = t->expiry < w->now ? w->now : t->expiry;
+  uint64_t delta = expiry - w->now;
+  int level = 0;
+  while (level < kCoTimerLevels - 1 &&
+         delta >= (uint64_t)1 << ((level + 1) * kCoTimerSlotBits)) {
+    level++;
+  }
+  if (level == kCoTimerLevels - 1) {
+    uint64_t range = (uint64_t)1 << (kCoTimerLevels * kCoTimerSlotBits);
+    if (delta >= range) {
+      expiry = w->now + range - 1;
+    }
+  }
+  int slot = (expiry >> (level * kCoTimerSlotBits)) & kCoTimerSlotMask;
+  Timer** head = &w->slots[level][slot];
+  t->next = *head;
+  if (t->next != NULL) {
+    t->next->prev = &t->next;
+  }
+  t->prev = head;
+  *head = t;
+  t->level = level;
+  t->slot = slot;
+  w->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void RemoveTimer(TimerWheel* w, Timer* t) {
+  *t->prev = t->next;
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+  if (w->slots[t->level][t->slot] == NULL) {
+    w->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+  }
+  t->next = NULL;
+  t->prev = NULL;
+}
+
+void TimerWheelAdd(TimerWheel* w, Timer* t, uint64_t expiry) {
+  t->expiry = expiry;
+  t->active = true;
+  InsertTimer(w, t);
+  w->num_timers++;
+}
+
+void TimerWheelCancel(TimerWheel* w, Timer* t) {
+  if (!t->active) {
+    return;
+  }
+  RemoveTimer(w, t);
+  t->active = false;
+  w->num_timers--;
+}
+
+// Called when level 0 wraps.  Moves the timers from the current slot of
+// level 1 down into level 0.  If that slot is 0 too, level 1 has also
+// wrapped and level 2 is moved down, and so on.
+static void Cascade(TimerWheel* w) {
+  for (int level = 1; level < kCoTimerLevels; level++) {
+    int slot = (w->now >> (level * kCoTimerSlotBits)) & kCoTimerSlotMask;
+    Timer* t = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~((uint64_t)1 << slot);
+    while (t != NULL) {
+      Timer* next = t->next;
+      InsertTimer(w, t);
+      t = next;
+    }
+    if (slot != 0) {
+      break;
+    }
+  }
+}
+
+void TimerWheelAdvance(TimerWheel* w, uint64_t now, TimerCallback callback,
+                       void* arg) {
+  while (w->now <= now) {
+    if (w->num_timers == 0) {
+      w->now = now + 1;
+      break;
+    }
+    int slot = w->now & kCoTimerSlotMask;
+    if (slot == 0) {
+      Cascade(w);
+    }
+    // Skip the empty slots in level 0, up to the next time it wraps.
+    uint64_t pending = w->occupied[0] >> slot;
+    uint64_t skip =
+        pending == 0 ? kCoTimerSlots - slot : __builtin_ctzll(pending);
+    if (skip > 0) {
+      w->now += skip;
+      if (w->now > now + 1) {
+        w->now = now + 1;
+      }
+      continue;
+    }
+    // All the timers in the slot expire on this tick.
+    Timer** head = &w->slots[0][slot];
+    while (*head != NULL) {
+      Timer* t = *head;
+      RemoveTimer(w, t);
+      t->active = false;
+      w->num_timers--;
+      callback(t, arg);
+    }
+    w->now++;
+  }
+}
+
+// Works out the next tick on which a slot in the given level is processed.
+// Level 0 slots are processed on every tick.  Higher level slots are
+// processed when all the lower levels wrap.
+static uint64_t NextLevelTick(TimerWheel* w, int level) {
+  int shift = level * kCoTimerSlotBits;
+  uint64_t base = (w->now >> shift) << shift;
+  int current = (w->now >> shift) & kCoTimerSlotMask;
+  uint64_t bits = w->occupied[level];
+  uint64_t rotated = bits;
+  if (current != 0) {
+    rotated = (bits >> current) | (bits << (kCoTimerSlots - current));
+  }
+  if (base != w->now) {
+    // The current slot has already been processed in this rotation.
+    rotated &= ~(uint64_t)1;
+  }
+  uint64_t distance = rotated == 0 ? kCoTimerSlots : __builtin_ctzll(rotated);
+  return base + (distance << shift);
+}
+
+uint64_t TimerWheelNextTick(TimerWheel* w) {
+  if (w->num_timers == 0) {
+    return kCoTimerNever;
+  }
+  uint64_t next = kCoTimerNever;
+  for (int level = 0; level < kCoTimerLevels; level++) {
+    if (w->occupied[level] == 0) {
+      continue;
+    }
+    uint64_t tick = NextLevelTick(w, level);
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next;
+}
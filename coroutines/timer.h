@@ -0,0 +1,73 @@
+//
+//  timer.h
+//  coroutines
+//
+
+#ifndef timer_h
+#define timer_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A hierarchical timer wheel.  Time is measured in ticks and each level of
+// the wheel has kCoTimerSlots slots.  A slot in level 0 holds the timers
+// that expire on one tick, a slot in level 1 holds timers for kCoTimerSlots
+// ticks and so on.  When level 0 wraps around, the timers in the next slot of
+// level 1 are moved down into level 0 (and similarly for the higher levels).
+//
+// Adding and cancelling a timer are O(1) and advancing the wheel costs
+// nothing for empty slots, which are skipped using a bitmap of occupied
+// slots in each level.
+
+#define kCoTimerSlotBits 6
+#define kCoTimerSlots (1 << kCoTimerSlotBits)
+#define kCoTimerSlotMask (kCoTimerSlots - 1)
+#define kCoTimerLevels 6
+
+// Timers with no expiry.
+#define kCoTimerNever UINT64_MAX
+
+// A timer is embedded in the object that owns it.
+typedef struct Timer {
+  struct Timer* next;
+  struct Timer** prev;  // Pointer to pointer to this timer.
+  uint64_t expiry;      // Tick on which the timer expires.
+  uint8_t level;
+  uint8_t slot;
+  bool active;
+} Timer;
+
+typedef struct {
+  Timer* slots[kCoTimerLevels][kCoTimerSlots];
+  uint64_t occupied[kCoTimerLevels];  // Bitmap of non-empty slots.
+  uint64_t now;                       // Next tick to be processed.
+  size_t num_timers;
+} TimerWheel;
+
+typedef void (*TimerCallback)(Timer* timer, void* arg);
+
+void TimerWheelInit(TimerWheel* w, uint64_t now);
+
+void TimerInit(Timer* t);
+
+// Adds a timer that expires on the given tick.  A timer for a tick that
+// has already been processed expires on the next call to
+// TimerWheelAdvance.  The timer must not be active.
+void TimerWheelAdd(TimerWheel* w, Timer* t, uint64_t expiry);
+
+// Removes a timer from the wheel.  Does nothing if the timer isn't active.
+void TimerWheelCancel(TimerWheel* w, Timer* t);
+
+// Processes all the ticks up to and including 'now', calling 'callback' for
+// every timer that expires.  The timer is no longer active when the
+// callback is called.
+void TimerWheelAdvance(TimerWheel* w, uint64_t now, TimerCallback callback,
+                       void* arg);
+
+// Returns the first tick on which TimerWheelAdvance needs to be called, or
+// kCoTimerNever if there are no timers.  This can be earlier than the first
+// expiry when timers need to be moved down to a lower level.
+uint64_t TimerWheelNextTick(TimerWheel* w);
+
+#endif /* timer_h */
@@ -0,0 +1,309 @@
+//
+//  trace.c
+//  coroutines
+//
+
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(COROUTINE_TRACE)
+
+// All machines share a time origin so that their traces line up.
+static _Atomic(uint64_t) trace_epoch;
+static atomic_int next_pid = 1;
+
+static size_t RoundUpToPowerOf2(size_t n) {
+  size_t size = 1;
+  while (size < n) {
+    size <<= 1;
+  }
+  return size;
+}
+
+bool CoroutineMachineStartTrace(CoroutineMachine* m, size_t num_events) {
+  if (m->trace != NULL) {
+    return true;
+  }
+  uint64_t expected = 0;
+  atomic_compare_exchange_strong(&trace_epoch, &expected, CoroutineCycles());
+  CoroutineTrace* t = calloc(1, sizeof(CoroutineTrace));
+  size_t capacity = RoundUpToPowerOf2(num_events < 2 ? 2 : num_events);
+  t->events = malloc(capacity * sizeof(CoroutineTraceEvent));
+  t->mask = capacity - 1;
+  t->pid = atomic_fetch_add(&next_pid, 1);
+  HashMapInitForInt64Keys(&t->named);
+  m->trace = t;
+  return true;
+}
+
+void CoroutineMachineStopTrace(CoroutineMachine* m) {
+  CoroutineTrace* t = m->trace;
+  if (t == NULL) {
+    return;
+  }
+  m->trace = NULL;
+  HashMapDestruct(&t->named);
+  free(t->events);
+  free(t);
+}
+
+uint64_t CoroutineMachineTraceDropped(CoroutineMachine* m) {
+  return m->trace == NULL ? 0 : atomic_load(&m->trace->dropped);
+}
+
+void CoroutineTraceRecord(CoroutineTrace* t, CoroutineTraceEventType type,
+                          Coroutine* c, int fd, int mask) {
+  uint64_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&t->head, memory_order_acquire) > t->mask) {
+    atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  CoroutineTraceEvent* e = &t->events[tail & t->mask];
+  e->time = CoroutineCycles();
+  e->serial = c == NULL ? 0 : c->serial + 1;
+  e->type = type;
+  if (type == kCoTraceName) {
+    strncpy(e->name, c->name.value, kCoTraceNameLength);
+  } else {
+    e->mask = mask;
+    e->fd = fd;
+    e->id = c == NULL ? 0 : (uint32_t)c->id;
+  }
+  atomic_store_explicit(&t->tail, tail + 1, memory_order_release);
+}
+
+// Writing JSON.  The writer keeps track of whether a comma is needed.
+
+typedef struct {
+  FILE* fp;
+  bool* first;
+  int pid;
+  double micros_per_cycle;
+  uint64_t epoch;
+} TraceWriter;
+
+static void BeginEvent(TraceWriter* w, const char* name, const char* phase,
+                       uint64_t tid) {
+  fprintf(w->fp, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%d,\"tid\":%llu",
+          *w->first ? "" : ",\n", name, phase, w->pid,
+          (unsigned long long)tid);
+  *w->first = false;
+}
+
+static void BeginTimedEvent(TraceWriter* w, const char* name,
+                            const char* phase, const CoroutineTraceEvent* e) {
+  BeginEvent(w, name, phase, e->serial);
+  uint64_t cycles = e->time > w->epoch ? e->time - w->epoch : 0;
+  fprintf(w->fp, ",\"ts\":%.3f", cycles * w->micros_per_cycle);
+}
+
+static void WriteThreadName(TraceWriter* w, uint64_t tid, const char* name,
+                            int length) {
+  BeginEvent(w, "thread_name", "M", tid);
+  fputs(",\"args\":{\"name\":\"", w->fp);
+  for (int i = 0; i < length && name[i] != '\0'; i++) {
+    char ch = name[i];
+    if (ch == '"' || ch == '\\') {
+      fputc('\\', w->fp);
+    }
+    fputc(ch < ' ' ? '?' : ch, w->fp);
+  }
+  fputs("\"}}", w->fp);
+}
+
+static void WriteProcessName(TraceWriter* w) {
+  BeginEvent(w, "process_name", "M", 0);
+  fprintf(w->fp, ",\"args\":{\"name\":\"machine %d\"}}", w->pid);
+  WriteThreadName(w, 0, "scheduler", 16);
+}
+
+// Coroutines are named the first time they appear, with their default name
+// unless a name event comes first.
+static void NameCoroutine(TraceWriter* w, CoroutineTrace* t,
+                          const CoroutineTraceEvent* e) {
+  if (e->serial == 0 || e->type == kCoTraceName ||
+      HashMapSearch(&t->named, (MapKeyType){.w = e->serial}) != NULL) {
+    return;
+  }
+  HashMapInsert(&t->named, (MapKeyValue){.key.w = e->serial, .value.w = 1});
+  char name[32];
+  snprintf(name, sizeof(name), "co-%u", e->id);
+  WriteThreadName(w, e->serial, name, sizeof(name));
+}
+
+static const char* WaitEvents(int mask) {
+  if ((mask & POLLIN) && (mask & POLLOUT)) {
+    return "in|out";
+  }
+  return mask & POLLOUT ? "out" : "in";
+}
+
+static void WriteEvent(TraceWriter* w, CoroutineTrace* t,
+                       const CoroutineTraceEvent* e) {
+  NameCoroutine(w, t, e);
+  switch (e->type) {
+    case kCoTraceResume:
+      BeginTimedEvent(w, "run", "B", e);
+      break;
+    case kCoTraceYield:
+      BeginTimedEvent(w, "run", "E", e);
+      fputs(",\"args\":{\"end\":\"yield\"}", w->fp);
+      break;
+    case kCoTracePark:
+      BeginTimedEvent(w, "run", "E", e);
+      fputs(",\"args\":{\"end\":\"park\"}", w->fp);
+      break;
+    case kCoTraceWait:
+      BeginTimedEvent(w, "run", "E", e);
+      if (e->fd == -1) {
+        fputs(",\"args\":{\"end\":\"sleep\"}", w->fp);
+      } else {
+        fprintf(w->fp,
+                ",\"args\":{\"end\":\"wait\",\"fd\":%d,\"events\":\"%s\"}",
+                e->fd, WaitEvents(e->mask));
+      }
+      break;
+    case kCoTraceExit:
+      BeginTimedEvent(w, "run", "E", e);
+      fputs(",\"args\":{\"end\":\"exit\"}", w->fp);
+      HashMapRemove(&t->named, (MapKeyType){.w = e->serial});
+      break;
+    case kCoTraceWake:
+      BeginTimedEvent(w, "wake", "i", e);
+      fputs(",\"s\":\"t\"", w->fp);
+      break;
+    case kCoTraceSpawn:
+      BeginTimedEvent(w, "spawn", "i", e);
+      fputs(",\"s\":\"t\"", w->fp);
+      break;
+    case kCoTraceName:
+      WriteThreadName(w, e->serial, e->name, kCoTraceNameLength);
+      HashMapInsert(&t->named,
+                    (MapKeyValue){.key.w = e->serial, .value.w = 1});
+      return;
+    case kCoTracePollEnter:
+      BeginTimedEvent(w, "poll", "B", e);
+      fprintf(w->fp, ",\"args\":{\"timeout_ms\":%d}", e->fd);
+      break;
+    case kCoTracePollExit:
+      BeginTimedEvent(w, "poll", "E", e);
+      fprintf(w->fp, ",\"args\":{\"ready\":%d}", e->fd);
+      break;
+  }
+  fputc('}', w->fp);
+}
+
+// Writes out the events in the ring and frees their space.  The machine is
+// named at the start of each trace.
+static void Drain(CoroutineTrace* t, FILE* fp, bool* first,
+                  bool name_machine) {
+  TraceWriter w = {.fp = fp,
+                   .first = first,
+                   .pid = t->pid,
+                   .micros_per_cycle = 1e6 / CoroutineCycleFrequency(),
+                   .epoch = atomic_load(&trace_epoch)};
+  uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+  if (name_machine) {
+    WriteProcessName(&w);
+  }
+  for (; head != tail; head++) {
+    WriteEvent(&w, t, &t->events[head & t->mask]);
+  }
+  atomic_store_explicit(&t->head, head, memory_order_release);
+}
+
+bool CoroutineMachineDumpTrace(CoroutineMachine* m, FILE* fp) {
+  if (m->trace == NULL) {
+    return false;
+  }
+  // The trace stands alone, so its coroutines are named again.
+  HashMapClear(&m->trace->named);
+  bool first = true;
+  fputs("{\"traceEvents\":[\n", fp);
+  Drain(m->trace, fp, &first, true);
+  fputs("\n]}\n", fp);
+  fflush(fp);
+  return true;
+}
+
+// Writes the events of all the machines.
+static void Flush(CoroutineTraceFlusher* f) {
+  for (size_t i = 0; i < f->num_machines; i++) {
+    CoroutineTrace* t = f->machines[i]->trace;
+    if (t != NULL) {
+      Drain(t, f->fp, &f->first, !f->named_machines);
+    }
+  }
+  f->named_machines = true;
+  fflush(f->fp);
+}
+
+static void* FlusherThread(void* arg) {
+  CoroutineTraceFlusher* f = arg;
+  struct timespec interval = {.tv_sec = f->interval / 1000000000,
+                              .tv_nsec = f->interval % 1000000000};
+  while (atomic_load(&f->running)) {
+    nanosleep(&interval, NULL);
+    Flush(f);
+  }
+  return NULL;
+}
+
+bool CoroutineTraceFlusherStart(CoroutineTraceFlusher* f, FILE* fp,
+                                CoroutineMachine** machines,
+                                size_t num_machines, uint64_t interval) {
+  f->fp = fp;
+  f->machines = machines;
+  f->num_machines = num_machines;
+  f->interval = interval;
+  f->first = true;
+  f->named_machines = false;
+  atomic_init(&f->running, true);
+  fputs("[\n", fp);
+  if (pthread_create(&f->thread, NULL, FlusherThread, f) != 0) {
+    atomic_store(&f->running, false);
+    return false;
+  }
+  return true;
+}
+
+void CoroutineTraceFlusherStop(CoroutineTraceFlusher* f) {
+  if (!atomic_load(&f->running)) {
+    return;
+  }
+  atomic_store(&f->running, false);
+  pthread_join(f->thread, NULL);
+  Flush(f);
+  fputs("\n]\n", f->fp);
+  fflush(f->fp);
+}
+
+#else
+
+bool CoroutineMachineStartTrace(CoroutineMachine* m, size_t num_events) {
+  return false;
+}
+
+void CoroutineMachineStopTrace(CoroutineMachine* m) {}
+
+bool CoroutineMachineDumpTrace(CoroutineMachine* m, FILE* fp) {
+  return false;
+}
+
+uint64_t CoroutineMachineTraceDropped(CoroutineMachine* m) { return 0; }
+
+bool CoroutineTraceFlusherStart(CoroutineTraceFlusher* f, FILE* fp,
+                                CoroutineMachine** machines,
+                                size_t num_machines, uint64_t interval) {
+  return false;
+}
+
+void CoroutineTraceFlusherStop(CoroutineTraceFlusher* f) {}
+
+void CoroutineTraceRecord(CoroutineTrace* t, CoroutineTraceEventType type,
+                          Coroutine* c, int fd, int mask) {}
+
+#endif  // COROUTINE_TRACE
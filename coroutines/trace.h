@@ -0,0 +1,116 @@
+//
+//  trace.h
+//  coroutines
+//
+
+#ifndef trace_h
+#define trace_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "coroutine.h"
+#include "hashmap.h"
+
+// Tracing of the scheduler.  When the library is built with COROUTINE_TRACE
+// defined, a machine that has had CoroutineMachineStartTrace called records
+// an event each time it switches to or from a coroutine, a coroutine is
+// woken, spawned or named, and around each call to its poller.  Events go
+// into a fixed-size ring buffer without locks or allocation and are written
+// out as Chrome trace JSON, which chrome://tracing and ui.perfetto.dev can
+// show.  Each machine is a process in the trace and each coroutine a thread,
+// with a slice for every time it runs; the machine itself is thread 0.
+//
+// The ring has a single reader: either CoroutineMachineDumpTrace or a
+// CoroutineTraceFlusher.  If it fills up, new events are dropped (and
+// counted) until the reader catches up.
+
+typedef enum {
+  kCoTraceResume,     // Switched to the coroutine.
+  kCoTraceYield,      // Switched away, still ready to run.
+  kCoTracePark,       // Switched away until woken.
+  kCoTraceWait,       // Switched away to wait for 'fd' (-1 to sleep).
+  kCoTraceExit,       // Switched away for the last time.
+  kCoTraceWake,       // Became ready to run.
+  kCoTraceSpawn,      // Given to the machine.
+  kCoTraceName,       // Named (the start of the name is in 'name').
+  kCoTracePollEnter,  // Calling the poller, with the timeout in 'fd'.
+  kCoTracePollExit,   // Back from the poller, with its result in 'fd'.
+} CoroutineTraceEventType;
+
+#define kCoTraceNameLength 12
+
+typedef struct {
+  uint64_t time;    // CoroutineCycles.
+  uint64_t serial;  // Coroutine's serial number plus one, 0 for the machine.
+  uint8_t type;     // CoroutineTraceEventType.
+  union {
+    struct {
+      uint16_t mask;  // Events waited for.
+      int32_t fd;
+      uint32_t id;    // Coroutine's id.
+    };
+    char name[kCoTraceNameLength];  // Not terminated if full.
+  };
+} CoroutineTraceEvent;
+
+typedef struct CoroutineTrace {
+  CoroutineTraceEvent* events;
+  size_t mask;                // Capacity - 1, capacity is a power of 2.
+  _Atomic(uint64_t) head;     // Next event to read.
+  _Atomic(uint64_t) tail;     // Next event to write.
+  _Atomic(uint64_t) dropped;  // Events lost because the ring was full.
+  int pid;                    // Process number in the trace.
+  HashMap named;              // Serials whose names have been written.
+} CoroutineTrace;
+
+// Starts recording events on the machine, in a ring of at least
+// 'num_events'.  Call this before the machine runs.  Returns false if the
+// library was built without COROUTINE_TRACE.
+bool CoroutineMachineStartTrace(CoroutineMachine* m, size_t num_events);
+
+// Stops recording and frees the ring, losing any events not written.  Call
+// this when the machine is no longer running.
+void CoroutineMachineStopTrace(CoroutineMachine* m);
+
+// Writes the events recorded since the last write as a complete JSON trace
+// and removes them from the ring.  This can be called from any thread.
+// Returns false if the machine isn't being traced.
+bool CoroutineMachineDumpTrace(CoroutineMachine* m, FILE* fp);
+
+// Number of events that have been dropped because the ring was full.
+uint64_t CoroutineMachineTraceDropped(CoroutineMachine* m);
+
+// A thread that writes the events of some traced machines to a file as
+// they are recorded, so the ring doesn't have to hold the whole trace.  It
+// writes the JSON array form of the trace, whose closing bracket is
+// optional, so the file can be loaded even if the program never stops it.
+typedef struct {
+  FILE* fp;
+  CoroutineMachine** machines;
+  size_t num_machines;
+  uint64_t interval;  // Nanoseconds between writes.
+  pthread_t thread;
+  atomic_bool running;
+  bool first;           // No event has been written yet.
+  bool named_machines;  // The machines' names have been written.
+} CoroutineTraceFlusher;
+
+// Starts a flusher writing to 'fp' every 'interval' nanoseconds.  The
+// machines must have had CoroutineMachineStartTrace called.  Returns false
+// if the thread can't be started.
+bool CoroutineTraceFlusherStart(CoroutineTraceFlusher* f, FILE* fp,
+                                CoroutineMachine** machines,
+                                size_t num_machines, uint64_t interval);
+
+// Writes the remaining events, finishes the JSON and stops the thread.
+void CoroutineTraceFlusherStop(CoroutineTraceFlusher* f);
+
+// Records an event.  Called by the machine on its own thread.
+void CoroutineTraceRecord(CoroutineTrace* t, CoroutineTraceEventType type,
+                          Coroutine* c, int fd, int mask);
+
+#endif /* trace_h */
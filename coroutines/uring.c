@@ -0,0 +1,190 @@
+//
+//  uring.c
+//  coroutines
+//
+
+#include "uring.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int Setup(unsigned entries, struct io_uring_params* p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int Enter(int fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags, void* arg, size_t arg_size) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, arg_size);
+}
+
+bool UringInit(Uring* u, unsigned entries) {
+  memset(u, 0, sizeof(*u));
+  u->fd = -1;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = Setup(entries, &p);
+  if (fd == -1) {
+    return false;
+  }
+  // We need a single mapping for both rings, no dropped completions and
+  // timeouts on io_uring_enter (5.11 or later).
+  unsigned needed =
+      IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if ((p.features & needed) != needed) {
+    close(fd);
+    return false;
+  }
+  u->fd = fd;
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (u->cq_ring_size > u->sq_ring_size) {
+    u->sq_ring_size = u->cq_ring_size;
+  }
+  u->cq_ring_size = u->sq_ring_size;
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED) {
+    u->sq_ring = NULL;
+    UringDestruct(u);
+    return false;
+  }
+  u->cq_ring = u->sq_ring;
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    u->sqes = NULL;
+    UringDestruct(u);
+    return false;
+  }
+  char* sq = u->sq_ring;
+  u->sq_head = (unsigned*)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  u->sq_array = (unsigned*)(sq + p.sq_off.array);
+  u->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+  u->sq_local_tail = *u->sq_tail;
+  char* cq = u->cq_ring;
+  u->cq_head = (unsigned*)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return true;
+}
+
+void UringDestruct(Uring* u) {
+  if (u->sqes != NULL) {
+    munmap(u->sqes, u->sqes_size);
+    u->sqes = NULL;
+  }
+  if (u->sq_ring != NULL) {
+    munmap(u->sq_ring, u->sq_ring_size);
+    u->sq_ring = NULL;
+    u->cq_ring = NULL;
+  }
+  if (u->fd != -1) {
+    close(u->fd);
+    u->fd = -1;
+  }
+}
+
+// The kernel reads the submission tail and writes the completion tail, so
+// they are accessed with acquire and release.
+static unsigned LoadAcquire(unsigned* p) {
+  return atomic_load_explicit((_Atomic unsigned*)p, memory_order_acquire);
+}
+
+static void StoreRelease(unsigned* p, unsigned v) {
+  atomic_store_explicit((_Atomic unsigned*)p, v, memory_order_release);
+}
+
+// Entries are filled in after UringGetSqe returns them, so they are only
+// made visible to the kernel when we submit.
+static void Publish(Uring* u) {
+  StoreRelease(u->sq_tail, u->sq_local_tail);
+}
+
+// Submits without waiting.
+static bool Submit(Uring* u) {
+  Publish(u);
+  while (u->sq_pending > 0) {
+    int n = Enter(u->fd, u->sq_pending, 0, 0, NULL, 0);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    u->sq_pending -= n;
+  }
+  return true;
+}
+
+bool UringReserve(Uring* u, unsigned n) {
+  if (u->sq_local_tail - LoadAcquire(u->sq_head) + n > u->sq_entries) {
+    return Submit(u);
+  }
+  return true;
+}
+
+struct io_uring_sqe* UringGetSqe(Uring* u) {
+  if (!UringReserve(u, 1)) {
+    return NULL;
+  }
+  unsigned index = u->sq_local_tail & u->sq_mask;
+  struct io_uring_sqe* sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[index] = index;
+  u->sq_local_tail++;
+  u->sq_pending++;
+  return sqe;
+}
+
+int UringSubmitAndWait(Uring* u, int timeout) {
+  if (timeout == 0 || *u->cq_head != LoadAcquire(u->cq_tail)) {
+    // Don't block if there's nothing to wait for.
+    return Submit(u) ? 0 : -1;
+  }
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg = {0};
+  if (timeout > 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  }
+  Publish(u);
+  int n = Enter(u->fd, u->sq_pending, 1,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                sizeof(arg));
+  if (n == -1) {
+    // A timeout or a signal is not an error.
+    return errno == ETIME || errno == EINTR ? 0 : -1;
+  }
+  u->sq_pending -= n;
+  return 0;
+}
+
+struct io_uring_cqe* UringPeekCqe(Uring* u) {
+  unsigned head = *u->cq_head;
+  if (head == LoadAcquire(u->cq_tail)) {
+    return NULL;
+  }
+  return &u->cqes[head & u->cq_mask];
+}
+
+void UringSeenCqe(Uring* u) { StoreRelease(u->cq_head, *u->cq_head + 1); }
+
+bool UringRegisterBuffers(Uring* u, const struct iovec* iov, unsigned n) {
+  return syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov,
+                 n) == 0;
+}
+
+#endif  // __linux__
@@ -0,0 +1,77 @@
+//
+//  uring.h
+//  coroutines
+//
+
+#ifndef uring_h
+#define uring_h
+
+#if defined(__linux__)
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// A minimal io_uring, driven directly through the system calls so that we
+// don't need liburing.  Submission queue entries are filled in by the
+// caller and submitted together, with a wait for completions, by
+// UringSubmitAndWait.  So any number of operations cost one system call.
+//
+// This is only used by a single thread.
+
+typedef struct Uring {
+  int fd;
+  // Submission queue.
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe* sqes;
+  unsigned sq_local_tail;  // Tail including entries not yet published.
+  unsigned sq_pending;     // Filled in but not yet submitted.
+  // Completion queue.
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  // Mappings.
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} Uring;
+
+// Sets up a ring with room for 'entries' submissions.  Returns false if
+// io_uring isn't available or doesn't have the features we need.
+bool UringInit(Uring* u, unsigned entries);
+void UringDestruct(Uring* u);
+
+// Returns a cleared submission queue entry to fill in.  If the queue is
+// full the pending entries are submitted first.  Returns NULL if that
+// fails.
+struct io_uring_sqe* UringGetSqe(Uring* u);
+
+// Makes sure that the next 'n' calls to UringGetSqe won't submit, so that
+// linked entries go in together.  Returns false if that fails.
+bool UringReserve(Uring* u, unsigned n);
+
+// Submits the pending entries and waits for at least one completion for up
+// to 'timeout' milliseconds (-1 is forever, 0 doesn't wait).  Returns -1 on
+// error.
+int UringSubmitAndWait(Uring* u, int timeout);
+
+// Returns the next completion or NULL if there are none.  Call
+// UringSeenCqe when finished with it.
+struct io_uring_cqe* UringPeekCqe(Uring* u);
+void UringSeenCqe(Uring* u);
+
+// Registers buffers for IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED.
+bool UringRegisterBuffers(Uring* u, const struct iovec* iov, unsigned n);
+
+#endif  // __linux__
+
+#endif /* uring_h */
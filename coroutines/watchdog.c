@@ -0,0 +1,81 @@
+//
+//  watchdog.c
+//  coroutines
+//
+
+#include "watchdog.h"
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t NowNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Asks any machine that has been running the same slice for too long to end
+// it.  The machine may have moved on by the time it reads the request, but
+// then the slice won't match and it is ignored.
+static void Check(CoroutineWatchdog* w) {
+  uint64_t now = NowNanos();
+  for (size_t i = 0; i < w->num_machines; i++) {
+    CoroutineMachine* m = w->machines[i];
+    uint64_t slice = atomic_load_explicit(&m->slice, memory_order_relaxed);
+    if (slice != w->slices[i]) {
+      w->slices[i] = slice;
+      w->seen[i] = now;
+      continue;
+    }
+    if ((slice & 1) == 0 || now - w->seen[i] < w->slice_nanos ||
+        atomic_load_explicit(&m->preempt_slice, memory_order_relaxed) ==
+            slice) {
+      continue;
+    }
+    atomic_store_explicit(&m->preempt_since, w->seen[i],
+                          memory_order_relaxed);
+    atomic_store_explicit(&m->preempt_slice, slice, memory_order_release);
+  }
+}
+
+static void* WatchdogThread(void* arg) {
+  CoroutineWatchdog* w = arg;
+  uint64_t nanos = w->slice_nanos / kCoWatchdogChecksPerSlice;
+  struct timespec interval = {.tv_sec = nanos / 1000000000,
+                              .tv_nsec = nanos % 1000000000};
+  while (atomic_load(&w->running)) {
+    nanosleep(&interval, NULL);
+    Check(w);
+  }
+  return NULL;
+}
+
+bool CoroutineWatchdogStart(CoroutineWatchdog* w, CoroutineMachine** machines,
+                            size_t num_machines, uint64_t slice_nanos,
+                            bool report) {
+  w->machines = machines;
+  w->num_machines = num_machines;
+  w->slice_nanos = slice_nanos;
+  w->slices = calloc(num_machines, sizeof(uint64_t));
+  w->seen = calloc(num_machines, sizeof(uint64_t));
+  for (size_t i = 0; i < num_machines; i++) {
+    machines[i]->report_overruns = report;
+  }
+  atomic_init(&w->running, true);
+  if (pthread_create(&w->thread, NULL, WatchdogThread, w) != 0) {
+    atomic_store(&w->running, false);
+    free(w->slices);
+    free(w->seen);
+    return false;
+  }
+  return true;
+}
+
+void CoroutineWatchdogStop(CoroutineWatchdog* w) {
+  if (!atomic_load(&w->running)) {
+    return;
+  }
+  atomic_store(&w->running, false);
+  pthread_join(w->thread, NULL);
+  free(w->slices);
+  free(w->seen);
+}
@@ -0,0 +1,55 @@
+//
+//  watchdog.h
+//  coroutines
+//
+
+#ifndef watchdog_h
+#define watchdog_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "coroutine.h"
+
+// Cooperative preemption.  Nothing stops a coroutine that runs for a long
+// time without yielding, like one parsing a large file, and every other
+// coroutine on its machine waits for it.  A watchdog is a thread that looks
+// at some machines every quarter of a slice.  When one has been running the
+// same coroutine for longer than the slice, the watchdog asks it to yield,
+// which it does at its next call to CoroutineMaybeYield.  Loops that may run
+// for a long time can call that on every iteration for the cost of a couple
+// of loads, instead of calling CoroutineYield unconditionally.
+//
+// When a coroutine gives its slice back after being asked to, the machine
+// counts it in m->overruns and, if the watchdog reports overruns, prints the
+// coroutine's name, how long it ran for and the address it yielded from.
+// For a loop without a CoroutineMaybeYield that is where it finally stopped.
+
+// Slices are measured from when the watchdog first sees them, so one can
+// run for up to a quarter longer than the limit before being asked to yield.
+#define kCoWatchdogChecksPerSlice 4
+
+typedef struct {
+  CoroutineMachine** machines;
+  size_t num_machines;
+  uint64_t slice_nanos;  // Longest a coroutine should run for.
+  uint64_t* slices;      // The slice last seen on each machine.
+  uint64_t* seen;        // When it was first seen.
+  pthread_t thread;
+  atomic_bool running;
+} CoroutineWatchdog;
+
+// Starts watching the machines for coroutines that run for more than
+// 'slice_nanos' without yielding.  If 'report' is set, the machines print
+// each one to stderr.  Call this before the machines run.  Returns false if
+// the thread can't be started.
+bool CoroutineWatchdogStart(CoroutineWatchdog* w, CoroutineMachine** machines,
+                            size_t num_machines, uint64_t slice_nanos,
+                            bool report);
+
+// Stops the thread.  The machines keep running, but won't be asked to yield.
+void CoroutineWatchdogStop(CoroutineWatchdog* w);
+
+#endif /* watchdog_h */
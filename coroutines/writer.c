@@ -0,0 +1,110 @@
+//
+//  writer.c
+//  coroutines
+//
+
+#include "writer.h"
+
+void CoroutineWriterInit(CoroutineWriter* w, Coroutine* c, int fd) {
+  w->c = c;
+  w->fd = fd;
+  BufferInit(&w->buffer);
+  w->num_pieces = 0;
+}
+
+void CoroutineWriterDestruct(CoroutineWriter* w) {
+  BufferDestruct(&w->buffer);
+  w->num_pieces = 0;
+}
+
+// Makes room for another piece, flushing if they are all used.
+static bool MakeRoomForPiece(CoroutineWriter* w) {
+  return w->num_pieces < kCoWriterMaxPieces || CoroutineWriterFlush(w);
+}
+
+bool CoroutineWriterAppend(CoroutineWriter* w, const void* data,
+                           size_t length) {
+  if (length == 0) {
+    return true;
+  }
+  if (length > kCoWriterBufferSize) {
+    // Too big to copy.  It's only valid for this call so write it now.
+    return CoroutineWriterAppendSlice(w, data, length) &&
+           CoroutineWriterFlush(w);
+  }
+  if (w->buffer.length + length > kCoWriterBufferSize &&
+      !CoroutineWriterFlush(w)) {
+    return false;
+  }
+  // Bytes copied after other copied bytes extend the same piece.
+  if (w->num_pieces == 0 || w->pieces[w->num_pieces - 1].iov_base != NULL) {
+    if (!MakeRoomForPiece(w)) {
+      return false;
+    }
+    w->pieces[w->num_pieces++] = (struct iovec){.iov_base = NULL,
+                                                .iov_len = 0};
+  }
+  BufferAppend(&w->buffer, (char*)data, length);
+  w->pieces[w->num_pieces - 1].iov_len += length;
+  return true;
+}
+
+bool CoroutineWriterAppendString(CoroutineWriter* w, String* s) {
+  return CoroutineWriterAppend(w, s->value, s->length);
+}
+
+bool CoroutineWriterAppendSlice(CoroutineWriter* w, const void* data,
+                                size_t length) {
+  if (length == 0) {
+    return true;
+  }
+  if (!MakeRoomForPiece(w)) {
+    return false;
+  }
+  w->pieces[w->num_pieces++] =
+      (struct iovec){.iov_base = (void*)data, .iov_len = length};
+  return true;
+}
+
+bool CoroutineWriterFlush(CoroutineWriter* w) {
+  // Point the copied pieces at the buffer, which won't move now.
+  size_t offset = 0;
+  for (int i = 0; i < w->num_pieces; i++) {
+    if (w->pieces[i].iov_base == NULL) {
+      w->pieces[i].iov_base = w->buffer.value + offset;
+      offset += w->pieces[i].iov_len;
+    }
+  }
+
+  struct iovec* iov = w->pieces;
+  int count = w->num_pieces;
+  bool ok = true;
+  while (count > 0) {
+    ssize_t n = CoroutineWritev(w->c, w->fd, iov, count);
+    if (n == -1) {
+      ok = false;
+      break;
+    }
+    // Skip what has been written, which may end part way through a piece.
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  w->num_pieces = 0;
+  BufferClear(&w->buffer);
+  return ok;
+}
+
+size_t CoroutineWriterPending(CoroutineWriter* w) {
+  size_t length = 0;
+  for (int i = 0; i < w->num_pieces; i++) {
+    length += w->pieces[i].iov_len;
+  }
+  return length;
+}
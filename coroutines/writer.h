@@ -0,0 +1,64 @@
+//
+//  writer.h
+//  coroutines
+//
+
+#ifndef writer_h
+#define writer_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "buffer.h"
+#include "coroutine.h"
+#include "dstring.h"
+
+// A buffered writer for a coroutine's socket.  Small pieces of output, like
+// the lines of a header, are copied into a buffer, and large ones, like the
+// body of a response, are referred to where they are.  They are all sent
+// with one writev when the writer is flushed or fills up, so a response
+// that fits goes out in one system call and one packet.  Each write is
+// tried first and the coroutine only waits for the socket if it is full.
+
+// Copied bytes the buffer holds before the writer is flushed.  Larger
+// pieces that are copied are written straight away.
+#define kCoWriterBufferSize 16384
+
+// Pieces of output held before the writer is flushed.
+#define kCoWriterMaxPieces 16
+
+typedef struct {
+  Coroutine* c;
+  int fd;
+  Buffer buffer;  // Copied bytes.
+  // Pieces in the order they are written.  A piece with a NULL base is the
+  // next iov_len bytes of the buffer; the buffer can move as it grows, so
+  // these are only turned into pointers when the writer is flushed.
+  struct iovec pieces[kCoWriterMaxPieces];
+  int num_pieces;
+} CoroutineWriter;
+
+void CoroutineWriterInit(CoroutineWriter* w, Coroutine* c, int fd);
+
+// Frees the buffer without writing anything that is left.
+void CoroutineWriterDestruct(CoroutineWriter* w);
+
+// Copies bytes to the writer.  Returns false if a write has failed on the
+// way, with errno set.
+bool CoroutineWriterAppend(CoroutineWriter* w, const void* data,
+                           size_t length);
+bool CoroutineWriterAppendString(CoroutineWriter* w, String* s);
+
+// Adds bytes to be written from where they are.  They must stay unchanged
+// until the writer has been flushed.
+bool CoroutineWriterAppendSlice(CoroutineWriter* w, const void* data,
+                                size_t length);
+
+// Writes everything in the writer, waiting for the socket as needed.
+// Returns false on error, with errno set, and the output is discarded.
+bool CoroutineWriterFlush(CoroutineWriter* w);
+
+// Returns the number of bytes waiting to be written.
+size_t CoroutineWriterPending(CoroutineWriter* w);
+
+#endif /* writer_h */
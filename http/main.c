@@ -9,8 +9,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -18,277 +21,513 @@
 #include "buffer.h"
 #include "coroutine.h"
 #include "dstring.h"
-#include "map.h"
+#include "http.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "writer.h"
 
-// Data about a client, passed to server coroutines as user data.
+// A client that sends nothing for this long while we are reading a request,
+// or between requests on a kept-alive connection, is disconnected.
+#define kIdleTimeoutNanos (30ULL * 1000000000)
+
+// How long a listener waits before accepting again after an error that
+// won't clear straight away, such as running out of file descriptors.
+#define kAcceptBackoffNanos (50ULL * 1000000)
+
+// With -T, each machine records into a ring this big, which is written out
+// this often.
+#define kTraceEvents (1 << 16)
+#define kTraceFlushNanos (10ULL * 1000000)
+
+// Files up to this size are sent from a memory mapping, larger ones with
+// sendfile.
+#define kMmapMaxSize (64 * 1024)
+
+// Size of each read from a client or from a file being copied.
+#define kReadSize 16384
+
+// Data about a client, allocated with the server coroutine as its user data.
 typedef struct {
   int fd;                     // Fd for socket to read/write.
   struct sockaddr_in sender;  // Client's address.
   socklen_t sender_len;       // Length of client's address.
+  HttpParser parser;          // Here to keep it off the coroutine's stack.
+  CoroutineWriter writer;     // Output not yet sent.
+  bool offload_open;          // Open files on the thread pool (-B).
 } ClientData;
 
-// Send a buffer full of data to the coroutines file descriptor.
+// Adds data to what is going to the client.  It is copied into the
+// writer, which sends it when it fills up or is flushed.
 static void SendToClient(Coroutine* c, const char* response, size_t length) {
   ClientData* data = CoroutineGetUserData(c);
-  int offset = 0;
-  const size_t kMaxLength = 1024;
-  while (length > 0) {
-    // Wait until we can send to the network.  This will yield to other
-    // coroutines and we will be resumed when we can write.
-    CoroutineWait(c, data->fd, POLLOUT);
-    size_t nbytes = length;
-    if (nbytes > kMaxLength) {
-      nbytes = kMaxLength;
-    }
-    ssize_t n = write(data->fd, response + offset, nbytes);
-    if (n == -1) {
-      perror("write");
-      return;
-    }
-    if (n == 0) {
-      return;
-    }
-    length -= n;
-    offset += n;
+  if (!CoroutineWriterAppend(&data->writer, response, length)) {
+    perror("write");
   }
 }
 
-static void ReadHeaders(Buffer* buffer, Vector* header, Map* http_headers) {
-  // Parse the header.
-  size_t i = 0;
-  // Find the \r\n at the end of the first line.
-  while (i < buffer->length && buffer->value[i] != '\r') {
-    i++;
+// Sends everything the writer holds, in one writev if the socket has room.
+static void FlushToClient(Coroutine* c) {
+  ClientData* data = CoroutineGetUserData(c);
+  if (!CoroutineWriterFlush(&data->writer)) {
+    perror("write");
   }
-  if (i == buffer->length) {
-    // No header line.
+}
+
+// A file to look up and open for a request.
+typedef struct {
+  const char* path;
+  struct stat* st;
+} OpenRequest;
+
+// Returns the fd of the file, or -1 if it can't be opened.  This blocks, so
+// with -B it's run on a pool thread with CoroutineRunBlocking.
+static void* OpenFile(void* arg) {
+  OpenRequest* request = arg;
+  int fd = -1;
+  if (stat(request->path, request->st) != -1) {
+    fd = open(request->path, O_RDONLY);
+  }
+  return (void*)(intptr_t)fd;
+}
+
+// Copy a file to the client through a buffer, starting at the given
+// offset.  Used if the file can't be sent with sendfile.
+static void CopyFileToClient(Coroutine* c, int file_fd, off_t offset) {
+  if (lseek(file_fd, offset, SEEK_SET) == -1) {
+    perror("lseek");
     return;
   }
-  String header_line;
-  StringInitFromSegment(&header_line, buffer->value, i);
-  i += 2;  // Skip \r\n.
-
-  // Parse the header line.  By splitting it at space into String objects
-  // allocated from the heap.
-  StringSplit(&header_line, ' ', header);
-
-  // Don't need this now.
-  StringDestruct(&header_line);
-
-  // Extract MIME headers.  Holds pointers to the data in the buffer.  Does
-  // not own the pointers.
-  while (i < buffer->length) {
-    if (buffer->value[i] == '\r') {
-      // End of headers is a blank line.
-      i += 2;
+  // Not on the stack, which is too small.
+  char* buf = malloc(kReadSize);
+  for (;;) {
+    ssize_t n = CoroutineRead(c, file_fd, buf, kReadSize);
+    if (n == -1) {
+      perror("file read");
       break;
     }
-    char* name = &buffer->value[i];
-    while (i < buffer->length && buffer->value[i] != ':') {
-      // Convert name to upper case as they are case insensitive.
-      buffer->value[i] = toupper(buffer->value[i]);
-      i++;
-    }
-    // No header value, end of headers.
-    if (i == buffer->length) {
+    if (n == 0) {
       break;
     }
-    buffer->value[i] = '\0';  // Replace : by EOL
-    i++;
-    // Skip to non-space.
-    while (i < buffer->length && isspace(buffer->value[i])) {
-      i++;
-    }
-    char* value = &buffer->value[i];
-    while (i < buffer->length) {
-      if (i < buffer->length + 3 && buffer->value[i] == '\r') {
-        // Check for continuation with a space as the first character on the
-        // next line.  TAB too.
-        if (buffer->value[i + 2] != ' ' && buffer->value[i + 2] != '\t') {
-          break;
-        }
-      } else if (buffer->value[i] == '\r') {
-        // No continuation, check for end of value.
-        break;
+    SendToClient(c, buf, n);
+    // Reads of a file don't wait, so let others run during a long copy.
+    CoroutineMaybeYield(c);
+  }
+  free(buf);
+}
+
+// Send the contents of a file to the client.  Small files are mapped and
+// written in one go, together with the header.  Larger ones are sent with
+// sendfile, which copies the file from the page cache to the socket in the
+// kernel, after the header has been flushed.  We only wait for the socket
+// when it is full.  Regular files are always ready to read so we never
+// wait for them.
+static void SendFileToClient(Coroutine* c, int file_fd, off_t size) {
+  ClientData* data = CoroutineGetUserData(c);
+  if (size == 0) {
+    return;
+  }
+  if (size <= kMmapMaxSize) {
+    void* contents = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+    if (contents != MAP_FAILED) {
+      // The mapping is written from where it is, so it has to be flushed
+      // before it is unmapped.
+      if (!CoroutineWriterAppendSlice(&data->writer, contents, size)) {
+        perror("write");
       }
-      i++;
+      FlushToClient(c);
+      munmap(contents, size);
+      return;
+    }
+  }
+  FlushToClient(c);
+  off_t offset = 0;
+  if (CoroutineSendfile(c, data->fd, file_fd, &offset, size) == -1) {
+    if (errno == EINVAL || errno == ENOSYS || errno == ENOTSUP) {
+      CopyFileToClient(c, file_fd, offset);
+      return;
     }
-    buffer->value[i] = '\0';  // Replace \r by EOL
-    i += 2;
-    MapKeyValue kv = {.key.p = name, .value.p = value};
-    MapInsert(http_headers, kv);
+    perror("sendfile");
   }
 }
 
-void Server(Coroutine* c) {
+// Reads from the client until there is a complete request header in the
+// buffer.  Pipelined requests may already be there.  The parser carries on
+// from where it stopped after each read.  The responses to the requests
+// before it are flushed before we wait for more from the client, so the
+// responses to a pipelined batch go out together.  Returns false if the
+// client has closed the connection, stalled or sent something that isn't
+// HTTP.
+static bool ReadRequest(Coroutine* c, Buffer* buffer, HttpParser* parser) {
   ClientData* data = CoroutineGetUserData(c);
-  Buffer buffer = {0};
-
-  // Read incoming HTTP request and parse it.
   for (;;) {
-    char buf[64];
-
-    // Wait for data to arrive.  This will yield to other coroutines and
-    // we will resume when data is available to read.
-    
-    CoroutineWait(c, data->fd, POLLIN);
-    ssize_t n = read(data->fd, buf, sizeof(buf));
-    
+    switch (HttpParserParse(parser, buffer->value, buffer->length)) {
+      case kCoHttpComplete:
+        return true;
+      case kCoHttpInvalid:
+        return false;
+      case kCoHttpIncomplete:
+        break;
+    }
+    if (CoroutineWriterPending(&data->writer) > 0) {
+      FlushToClient(c);
+    }
+    // Read straight into the end of the buffer.  Coroutine stacks are too
+    // small for a big read buffer of our own.  This will yield to other
+    // coroutines until data arrives.
+    size_t old_length = buffer->length;
+    BufferAddSpace(buffer, kReadSize);
+    ssize_t n = CoroutineReadWithTimeout(c, data->fd, &buffer->value[old_length],
+                                         kReadSize, kIdleTimeoutNanos);
+    buffer->length = n > 0 ? old_length + n : old_length;
+    if (n == -1 && errno == ETIMEDOUT) {
+      // Client has stalled or left an idle connection open.
+      return false;
+    }
     if (n == -1) {
       perror("read");
-      close(data->fd);
-      return;
+      return false;
     }
     if (n == 0) {
-      // EOF while reading header, nothing we can do.
-      close(data->fd);
-      BufferDestruct(&buffer);
-      return;
-    }
-    // Append to data buffer.
-    BufferAppend(&buffer, buf, n);
-
-    // A blank line terminates the read
-    if (strstr(buffer.value, "\r\n\r\n") != NULL) {
-      break;
+      // EOF, the client has finished with the connection.
+      return false;
     }
   }
+}
 
-  Vector header = {0};
-  Map http_headers;
-  MapInitForCharPointerKeys(&http_headers);
+// Works out whether the connection is kept open after a request.  This is
+// the default for HTTP/1.1 but HTTP/1.0 clients have to ask for it.
+static bool KeepAlive(HttpParser* parser, const char* buf, HttpSlice protocol) {
+  HttpSlice connection;
+  bool has_connection =
+      HttpParserFindHeader(parser, buf, "Connection", &connection);
+  if (HttpSliceEqual(buf, protocol, "HTTP/1.1")) {
+    return !has_connection || !HttpSliceCaseEqual(buf, connection, "close");
+  }
+  return has_connection && HttpSliceCaseEqual(buf, connection, "keep-alive");
+}
 
-  ReadHeaders(&buffer, &header, &http_headers);
+// Handles the request whose header is at the start of the buffer.  Returns
+// true if the connection is to be kept open for another request.
+static bool HandleRequest(Coroutine* c, Buffer* buffer, HttpParser* parser) {
+  char* buf = buffer->value;
 
-  // These are the indexes into the http_header for the fields.
-  const size_t kMethod = 0;
-  const size_t kFilename = 1;
-  const size_t kProtocol = 2;
+  // Make alises for the request line fields.
+  HttpSlice method = parser->start[0];
+  HttpSlice filename = parser->start[1];
+  HttpSlice protocol = parser->start[2];
 
-  // Make alises for the http header fields.
-  String* method = header.value.p[kMethod];
-  String* filename = header.value.p[kFilename];
-  String* protocol = header.value.p[kProtocol];
+  if (protocol.length == 0) {
+    // Not a valid request line.  We can't reply to it.
+    return false;
+  }
   String response = {0};
 
-  MapKeyType k = {.p = "HOST"};
-  const char* hostname = MapFind(&http_headers, k);
-  if (hostname == NULL) {
-    hostname = "unknown";
-  }
-  printf("%s: %s for %s from %s\n", c->name.value, method->value,
-         filename->value, hostname);
+  HttpSlice hostname = {0};
+  HttpParserFindHeader(parser, buf, "Host", &hostname);
+  printf("%s: %.*s for %.*s from %.*s\n", CoroutineGetName(c),
+         (int)method.length, &buf[method.offset], (int)filename.length,
+         &buf[filename.offset],
+         hostname.length == 0 ? 7 : (int)hostname.length,
+         hostname.length == 0 ? "unknown" : &buf[hostname.offset]);
+
+  // Only support the GET method for now.  We don't read request bodies so
+  // the connection is closed after any other method.
+  bool is_get = HttpSliceEqual(buf, method, "GET");
+  bool keep_alive = is_get && KeepAlive(parser, buf, protocol);
+  const char* connection = keep_alive ? "keep-alive" : "close";
 
-  // Only support the GET method for now.
-  if (StringEqual(method, "GET")) {
+  if (is_get) {
+    // The filename is followed by a space, which is replaced to terminate
+    // it in place.
+    buf[filename.offset + filename.length] = '\0';
+    const char* path = &buf[filename.offset];
     struct stat st;
-    int e = stat(filename->value, &st);
-    if (e == -1) {
-      StringPrintf(&response, "%s 404 Not Found\r\n\r\n", protocol->value);
+    OpenRequest open_request = {.path = path, .st = &st};
+    ClientData* data = CoroutineGetUserData(c);
+    void* result = data->offload_open
+                       ? CoroutineRunBlocking(c, OpenFile, &open_request)
+                       : OpenFile(&open_request);
+    int file_fd = (int)(intptr_t)result;
+    if (file_fd == -1) {
+      StringPrintf(&response,
+                   "%.*s 404 Not Found\r\nContent-length: 0\r\n"
+                   "Connection: %s\r\n\r\n",
+                   (int)protocol.length, &buf[protocol.offset], connection);
       SendToClient(c, response.value, response.length);
     } else {
-      int file_fd = open(filename->value, O_RDONLY);
-      if (file_fd == -1) {
-        StringPrintf(&response, "%s 404 Not Found\r\n\r\n", protocol->value);
-        SendToClient(c, response.value, response.length);
-      } else {
-        // Send the file back.
-        StringPrintf(&response,
-                     "%s 200 OK\r\nContent-type: text/html\r\nContent-length: "
-                     "%zd\r\n\r\n",
-                     protocol->value, st.st_size);
-        SendToClient(c, response.value, response.length);
-
-        for (;;) {
-          char buf[1024];
-          CoroutineWait(c, file_fd, POLLIN);
-          ssize_t n = read(file_fd, buf, sizeof(buf));
-          if (n == -1) {
-            perror("file read");
-            break;
-          }
-          if (n == 0) {
-            break;
-          }
-          SendToClient(c, buf, n);
-        }
-        close(file_fd);
-      }
+      // Send the file back.
+      StringPrintf(&response,
+                   "%.*s 200 OK\r\nContent-type: text/html\r\n"
+                   "Content-length: %zd\r\nConnection: %s\r\n\r\n",
+                   (int)protocol.length, &buf[protocol.offset], st.st_size,
+                   connection);
+      SendToClient(c, response.value, response.length);
+      SendFileToClient(c, file_fd, st.st_size);
+      close(file_fd);
     }
   } else {
     // Invalid request method.
-    StringPrintf(&response, "%s 400 Invalid request method\r\n\r\n",
-                 protocol->value);
+    StringPrintf(&response,
+                 "%.*s 400 Invalid request method\r\nContent-length: 0\r\n"
+                 "Connection: close\r\n\r\n",
+                 (int)protocol.length, &buf[protocol.offset]);
     SendToClient(c, response.value, response.length);
   }
 
-  close(data->fd);
-  free(data);
+  StringDestruct(&response);
+  return keep_alive;
+}
+
+// Serves the requests on a connection.  With keep-alive the connection
+// stays open for further requests until the client closes it or leaves it
+// idle.  Pipelined requests are handled in the order they arrive.
+void Server(Coroutine* c) {
+  ClientData* data = CoroutineGetUserData(c);
+  Buffer buffer = {0};
+  CoroutineWriterInit(&data->writer, c, data->fd);
+
+  for (;;) {
+    HttpParserInit(&data->parser);
+    if (!ReadRequest(c, &buffer, &data->parser)) {
+      break;
+    }
+    bool keep_alive = HandleRequest(c, &buffer, &data->parser);
+
+    // Anything after the header is the next request.
+    BufferRemoveFront(&buffer, data->parser.length);
+    if (!keep_alive) {
+      break;
+    }
+  }
+
+  FlushToClient(c);
+  CoroutineClose(c, data->fd);
+  CoroutineWriterDestruct(&data->writer);
   BufferDestruct(&buffer);
-  MapDestruct(&http_headers);
-  VectorDestructWithContents(&header, (VectorElementDestructor)StringDestruct,
-                             true);
 }
 
-void Listener(Coroutine* c) {
+// Listener configuration, shared by all the listeners.
+typedef struct {
+  CoroutineScheduler* scheduler;
+  int port;
+  int backlog;
+  bool sharded;  // A listener on each machine using SO_REUSEPORT.
+  bool offload_open;
+} ListenerConfig;
+
+static int OpenListenSocket(const ListenerConfig* config) {
   int s = socket(PF_INET, SOCK_STREAM, 0);
   if (s == -1) {
     perror("socket");
-    return;
+    return -1;
   }
   int val = 1;
   setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+#if defined(SO_REUSEPORT)
+  if (config->sharded &&
+      setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) == -1) {
+    perror("SO_REUSEPORT");
+    close(s);
+    return -1;
+  }
+#endif
   struct sockaddr_in addr = {.sin_family = AF_INET,
-                             .sin_port = htons(80),
+                             .sin_port = htons(config->port),
                              .sin_len = sizeof(int),
                              .sin_addr.s_addr = INADDR_ANY};
   int e = bind(s, (struct sockaddr*)&addr, sizeof(addr));
   if (e == -1) {
     perror("bind");
     close(s);
+    return -1;
+  }
+  // Non-blocking so that accepting never blocks the machine's thread.
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+  listen(s, config->backlog);
+  return s;
+}
+
+void Listener(Coroutine* c) {
+  const ListenerConfig* config = CoroutineGetUserData(c);
+  // Accepting goes ahead of the servers' transfers so that new connections
+  // aren't kept waiting when the machine is busy.
+  CoroutineSetPriority(c, kCoPriorityHigh);
+  int s = OpenListenSocket(config);
+  if (s == -1) {
     return;
   }
-  listen(s, 10);
 
   // Enter a loop accepting incoming connections and spawning coroutines
   // to handle each one.  All coroutines run "in parallel", cooperating with
-  // each other.  No threading here.
+  // each other.
   for (;;) {
-    // Wait for incoming connection.  This allows other coroutines to run
-    // while we are waiting.
-    CoroutineWait(c, s, POLLIN);
-
-    // Allocate client data from the heap.  This will be passed to the
-    // server coroutine, which will take ownership of it.
-    ClientData* data = malloc(sizeof(ClientData));
-    data->sender_len = sizeof(struct sockaddr_in);
-
-    data->fd = accept(s, (struct sockaddr*)&data->sender, &data->sender_len);
-    if (data->fd == -1) {
+    // Wait for an incoming connection.  This allows other coroutines to
+    // run while we are waiting.  The client socket is non-blocking.
+    struct sockaddr_in sender;
+    socklen_t sender_len = sizeof(sender);
+    int fd = CoroutineAccept(c, s, (struct sockaddr*)&sender, &sender_len);
+    if (fd == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+          errno == ECONNABORTED) {
+        continue;
+      }
+      // Other errors, like EMFILE or ENOMEM, will just happen again until
+      // some connections close, so give them time instead of spinning.
       perror("accept");
-      free(data);
+      CoroutineSleep(c, kAcceptBackoffNanos);
       continue;
     }
 
-    // Make a coroutine to handle the connection. The coroutine
-    // now owns the data.
-    Coroutine* server = NewCoroutineWithUserData(c->machine, Server, data);
-
-    // Start the coroutine.  It will be added to the list of coroutines that
-    // are ready to run and will be run on the next yield or wait.
-    CoroutineStart(server);
+    // The client data is allocated with the server coroutine and goes away
+    // with it, so a connection costs no heap allocation.
+    if (config->sharded) {
+      // The kernel has spread the connections over the listeners, so
+      // keep this one on our machine.
+      Coroutine* server = NewCoroutineWithInlineUserData(c->machine, Server,
+                                                         sizeof(ClientData));
+      if (server == NULL) {
+        // Out of memory.  Drop the connection and, as for accept errors,
+        // give the others time to finish.
+        close(fd);
+        CoroutineSleep(c, kAcceptBackoffNanos);
+        continue;
+      }
+      ClientData* data = CoroutineGetUserData(server);
+      data->fd = fd;
+      data->sender = sender;
+      data->sender_len = sender_len;
+      data->offload_open = config->offload_open;
+      CoroutineStart(server);
+    } else {
+      // Spawn a coroutine to handle the connection.  It will be run by
+      // this thread's machine unless an idle machine steals it first.
+      ClientData data = {.fd = fd,
+                         .sender = sender,
+                         .sender_len = sender_len,
+                         .offload_open = config->offload_open};
+      CoroutineSchedulerSpawnWithInlineUserData(config->scheduler, Server,
+                                                &data, sizeof(data));
+    }
   }
 }
 
+static void Usage(void) {
+  fprintf(stderr,
+          "usage: http_server [-p port] [-b backlog] [-n machines] [-1] "
+          "[-u] [-s] [-B] [-w slice_ms] [-T trace.json]\n");
+  exit(1);
+}
+
 int main(int argc, const char* argv[]) {
-  CoroutineMachine m;
-  CoroutineMachineInit(&m);
+  // Unbuffered streams format onto the stack through a BUFSIZ buffer, which
+  // would overflow a coroutine's stack.
+  setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+  CoroutineScheduler scheduler;
+  ListenerConfig config = {.scheduler = &scheduler,
+                           .port = 80,
+                           .backlog = SOMAXCONN,
+#if defined(__linux__)
+                           // Only Linux spreads connections over the
+                           // sockets sharing a port.
+                           .sharded = true
+#else
+                           .sharded = false
+#endif
+  };
+  int num_machines = 0;  // One for each CPU.
+  const char* trace_file = NULL;
+  int slice_ms = 0;  // No watchdog.
+  CoroutineMachineOptions options;
+  CoroutineMachineOptionsInit(&options);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-1") == 0) {
+      // Single listener.
+      config.sharded = false;
+    } else if (strcmp(argv[i], "-u") == 0) {
+      // Do the I/O through io_uring where the kernel has it.
+      options.poller = kCoPollerUring;
+    } else if (strcmp(argv[i], "-B") == 0) {
+      // Stat and open files on a thread pool, for slow file systems.
+      config.offload_open = true;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      // Size the server coroutines' stacks from what they have used.
+      options.stack_sizing = kCoStackSizeAdaptive;
+    } else if (i + 1 < argc && isdigit(argv[i + 1][0]) &&
+               strcmp(argv[i], "-w") == 0) {
+      // Report coroutines that run for longer than this without yielding.
+      slice_ms = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-T") == 0) {
+      trace_file = argv[++i];
+    } else if (i + 1 < argc && isdigit(argv[i + 1][0]) &&
+               strcmp(argv[i], "-p") == 0) {
+      config.port = atoi(argv[++i]);
+    } else if (i + 1 < argc && isdigit(argv[i + 1][0]) &&
+               strcmp(argv[i], "-b") == 0) {
+      config.backlog = atoi(argv[++i]);
+    } else if (i + 1 < argc && isdigit(argv[i + 1][0]) &&
+               strcmp(argv[i], "-n") == 0) {
+      num_machines = atoi(argv[++i]);
+    } else {
+      Usage();
+    }
+  }
+
+  CoroutineSchedulerInitWithOptions(&scheduler, num_machines, &options);
+  CoroutineMachine** machines =
+      malloc(scheduler.num_workers * sizeof(CoroutineMachine*));
+  for (size_t i = 0; i < scheduler.num_workers; i++) {
+    machines[i] = CoroutineSchedulerGetMachine(&scheduler, i);
+  }
 
-  Coroutine listener;
-  CoroutineInit(&listener, &m, Listener);
-  CoroutineStart(&listener);
+  // Trace the scheduler on all the machines into a file, which is written
+  // until the server is killed.
+  CoroutineTraceFlusher flusher;
+  if (trace_file != NULL) {
+    FILE* fp = fopen(trace_file, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "Can't open %s: %s\n", trace_file, strerror(errno));
+      exit(1);
+    }
+    for (size_t i = 0; i < scheduler.num_workers; i++) {
+      if (!CoroutineMachineStartTrace(machines[i], kTraceEvents)) {
+        fprintf(stderr, "Tracing needs a build with COROUTINE_TRACE\n");
+        exit(1);
+      }
+    }
+    CoroutineTraceFlusherStart(&flusher, fp, machines, scheduler.num_workers,
+                               kTraceFlushNanos);
+  }
+
+  CoroutineWatchdog watchdog;
+  if (slice_ms > 0 &&
+      !CoroutineWatchdogStart(&watchdog, machines, scheduler.num_workers,
+                              slice_ms * 1000000ULL, true)) {
+    fprintf(stderr, "Can't start the watchdog\n");
+    exit(1);
+  }
 
-  // Run the main loop
-  CoroutineMachineRun(&m);
-  CoroutineMachineDestruct(&m);
+  if (config.sharded) {
+    // A listener on each machine, all bound to the same port.
+    for (size_t i = 0; i < scheduler.num_workers; i++) {
+      Coroutine* listener = NewCoroutineWithUserData(
+          CoroutineSchedulerGetMachine(&scheduler, i), Listener, &config);
+      CoroutineStart(listener);
+    }
+  } else {
+    CoroutineSchedulerSpawn(&scheduler, Listener, &config);
+  }
+
+  // Run the main loops.
+  CoroutineSchedulerRun(&scheduler);
+  if (slice_ms > 0) {
+    CoroutineWatchdogStop(&watchdog);
+  }
+  if (trace_file != NULL) {
+    CoroutineTraceFlusherStop(&flusher);
+    fclose(flusher.fp);
+  }
+  free(machines);
+  CoroutineSchedulerDestruct(&scheduler);
 }
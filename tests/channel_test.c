@@ -0,0 +1,224 @@
+//
+//  channel_test.c
+//  coroutines
+//
+
+#include <pthread.h>
+#include <stdint.h>
+#include "channel.h"
+#include "check.h"
+#include "scheduler.h"
+
+// Shared by the coroutines of a test, passed as their user data.
+typedef struct {
+  Channel ch;
+  int num_values;
+  _Atomic(int) next_sender;
+  _Atomic(int) senders_left;
+  _Atomic(int64_t) sent;
+  int64_t received;
+  int64_t sum;
+  bool in_order;
+  bool send_result;
+  bool receive_result;
+} ChannelTest;
+
+static void BatchSender(Coroutine* c) {
+  ChannelTest* t = CoroutineGetUserData(c);
+  int values[10];
+  for (int i = 0; i < t->num_values; i += 10) {
+    for (int j = 0; j < 10; j++) {
+      values[j] = i + j;
+    }
+    CHECK(ChannelSendBatch(&t->ch, c, values, 10) == 10);
+  }
+  ChannelClose(&t->ch);
+}
+
+static void BatchReceiver(Coroutine* c) {
+  ChannelTest* t = CoroutineGetUserData(c);
+  int values[7];
+  size_t n;
+  while ((n = ChannelReceiveBatch(&t->ch, c, values, 7)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      if (values[i] != t->received) {
+        t->in_order = false;
+      }
+      t->received++;
+    }
+  }
+  t->receive_result = ChannelReceive(&t->ch, c, values);
+}
+
+// Batches bigger than the channel, received in batches of a different
+// size, arrive in order and the receiver sees the close once it has them.
+static void TestBatch(void) {
+  ChannelTest t = {.num_values = 1000, .in_order = true,
+                   .receive_result = true};
+  ChannelInit(&t.ch, sizeof(int), 16);
+  CHECK(t.ch.capacity == 16);
+  CoroutineMachine m;
+  CoroutineMachineInit(&m);
+  CoroutineStart(NewCoroutineWithUserData(&m, BatchReceiver, &t));
+  CoroutineStart(NewCoroutineWithUserData(&m, BatchSender, &t));
+  CoroutineMachineRun(&m);
+  CHECK(t.received == 1000);
+  CHECK(t.in_order);
+  CHECK(!t.receive_result);
+  CHECK(!ChannelTrySend(&t.ch, &t.received));
+  CoroutineMachineDestruct(&m);
+  ChannelDestruct(&t.ch);
+}
+
+static void ParkedReceiver(Coroutine* c) {
+  ChannelTest* t = CoroutineGetUserData(c);
+  int value;
+  t->receive_result = ChannelReceive(&t->ch, c, &value);
+}
+
+static void ParkedSender(Coroutine* c) {
+  ChannelTest* t = CoroutineGetUserData(c);
+  int value = 1;
+  // Fills the channel, then parks.
+  while ((t->send_result = ChannelSend(&t->ch, c, &value))) {
+  }
+}
+
+static void Closer(Coroutine* c) {
+  ChannelTest* t = CoroutineGetUserData(c);
+  // Everything else is parked by the time we run again.
+  CoroutineSleep(c, 10000000);
+  ChannelClose(&t->ch);
+}
+
+// Closing wakes a receiver parked on an empty channel and a sender parked
+// on a full one.
+static void TestWakeOnClose(void) {
+  ChannelTest empty = {.receive_result = true};
+  ChannelTest full = {.send_result = true};
+  ChannelInit(&empty.ch, sizeof(int), 4);
+  ChannelInit(&full.ch, sizeof(int), 4);
+  CoroutineMachine m;
+  CoroutineMachineInit(&m);
+  CoroutineStart(NewCoroutineWithUserData(&m, ParkedReceiver, &empty));
+  CoroutineStart(NewCoroutineWithUserData(&m, Closer, &empty));
+  CoroutineStart(NewCoroutineWithUserData(&m, ParkedSender, &full));
+  CoroutineStart(NewCoroutineWithUserData(&m, Closer, &full));
+  CoroutineMachineRun(&m);
+  CHECK(!empty.receive_result);
+  CHECK(!full.send_result);
+
+  // The elements sent before the close can still be received.
+  int value = 0;
+  int n = 0;
+  while (ChannelTryReceive(&full.ch, &value)) {
+    CHECK(value == 1);
+    n++;
+  }
+  CHECK(n == 4);
+  CoroutineMachineDestruct(&m);
+  ChannelDestruct(&empty.ch);
+  ChannelDestruct(&full.ch);
+}
+
+#define kNumSenders 4
+
+static void Sender(Coroutine* c) {
+  ChannelTest* t = CoroutineGetUserData(c);
+  int base = atomic_fetch_add(&t->next_sender, 1);
+  for (int i = 0; i < t->num_values; i++) {
+    int value = base * t->num_values + i;
+    CHECK(ChannelSend(&t->ch, c, &value));
+  }
+  // The last one to finish closes the channel.
+  if (atomic_fetch_sub(&t->senders_left, 1) == 1) {
+    ChannelClose(&t->ch);
+  }
+}
+
+static void Receiver(Coroutine* c) {
+  ChannelTest* t = CoroutineGetUserData(c);
+  int values[5];
+  size_t n;
+  while ((n = ChannelReceiveBatch(&t->ch, c, values, 5)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      t->sum += values[i];
+    }
+    t->received += n;
+  }
+}
+
+// Senders spread over the machines of a scheduler, with the receiver on
+// one of them.  Every element arrives once.
+static void TestMachines(void) {
+  ChannelTest t = {.num_values = 20000};
+  atomic_init(&t.next_sender, 0);
+  atomic_init(&t.senders_left, kNumSenders);
+  ChannelInit(&t.ch, sizeof(int), 16);
+  CoroutineScheduler s;
+  CoroutineSchedulerInit(&s, 4);
+  CoroutineSchedulerSpawn(&s, Receiver, &t);
+  for (int i = 0; i < kNumSenders; i++) {
+    CoroutineSchedulerSpawn(&s, Sender, &t);
+  }
+  CoroutineSchedulerRun(&s);
+  int64_t total = (int64_t)kNumSenders * t.num_values;
+  CHECK(t.received == total);
+  CHECK(t.sum == total * (total - 1) / 2);
+  CoroutineSchedulerDestruct(&s);
+  ChannelDestruct(&t.ch);
+}
+
+static void* TrySender(void* arg) {
+  ChannelTest* t = arg;
+  int value = 1;
+  for (;;) {
+    if (ChannelTrySend(&t->ch, &value)) {
+      atomic_fetch_add(&t->sent, 1);
+    } else if (ChannelIsClosed(&t->ch)) {
+      return NULL;
+    }
+  }
+}
+
+static void ClosingReceiver(Coroutine* c) {
+  ChannelTest* t = CoroutineGetUserData(c);
+  int value;
+  while (ChannelReceive(&t->ch, c, &value)) {
+    if (++t->received == 100) {
+      ChannelClose(&t->ch);
+    }
+  }
+}
+
+// Threads sending while the receiver closes the channel.  Every send that
+// succeeded, including those racing with the close, is received.
+static void TestCloseRace(void) {
+  for (int i = 0; i < 100; i++) {
+    ChannelTest t = {0};
+    atomic_init(&t.sent, 0);
+    ChannelInit(&t.ch, sizeof(int), 1024);
+    CoroutineMachine m;
+    CoroutineMachineInit(&m);
+    CoroutineStart(NewCoroutineWithUserData(&m, ClosingReceiver, &t));
+    pthread_t threads[3];
+    for (int j = 0; j < 3; j++) {
+      pthread_create(&threads[j], NULL, TrySender, &t);
+    }
+    CoroutineMachineRun(&m);
+    for (int j = 0; j < 3; j++) {
+      pthread_join(threads[j], NULL);
+    }
+    CHECK(t.received == atomic_load(&t.sent));
+    CoroutineMachineDestruct(&m);
+    ChannelDestruct(&t.ch);
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  TestBatch();
+  TestWakeOnClose();
+  TestMachines();
+  TestCloseRace();
+  return CheckResult("channel_test");
+}
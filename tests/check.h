@@ -0,0 +1,31 @@
+//
+//  check.h
+//  coroutines
+//
+
+#ifndef check_h
+#define check_h
+
+#include <stdio.h>
+
+// The test drivers count failed checks and carry on, so one run shows all
+// of them.  Each driver exits with a failure status if any check failed.
+
+static int check_failures;
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      check_failures++;                                                \
+    }                                                                  \
+  } while (0)
+
+// Prints the result for the driver and returns its exit status.
+static int CheckResult(const char* name) {
+  fprintf(stderr, "%s: %s\n", name, check_failures == 0 ? "ok" : "FAILED");
+  return check_failures == 0 ? 0 : 1;
+}
+
+#endif /* check_h */
@@ -0,0 +1,185 @@
+//
+//  hashmap_test.c
+//  coroutines
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "check.h"
+#include "hashmap.h"
+
+static MapKeyValue KeyValue(int64_t key, int64_t value) {
+  MapKeyValue kv;
+  kv.key.w = key;
+  kv.value.w = value;
+  return kv;
+}
+
+static MapKeyType Key(int64_t key) {
+  MapKeyType k;
+  k.w = key;
+  return k;
+}
+
+// The key is its own hash, so a test can choose the group a key starts
+// probing at (bits 7 up) and its control byte (the low 7 bits).
+static uint64_t IdentityHash(MapKeyType key) { return key.w; }
+
+static bool EqualKeys(MapKeyType a, MapKeyType b) { return a.w == b.w; }
+
+// Inserts, removes and reinserts against an array of what should be there.
+static void TestAgainstArray(void) {
+  enum { kNumKeys = 5000 };
+  static int64_t expected[kNumKeys];  // 0 where the key isn't there.
+  HashMap map;
+  HashMapInitForInt64Keys(&map);
+  size_t length = 0;
+  srand(1);
+  for (int i = 0; i < 200000; i++) {
+    int64_t key = rand() % kNumKeys;
+    int64_t value = i + 1;
+    if (rand() % 3 == 0) {
+      void* old = HashMapRemove(&map, Key(key));
+      CHECK((int64_t)(intptr_t)old == expected[key]);
+      if (expected[key] != 0) {
+        length--;
+      }
+      expected[key] = 0;
+    } else {
+      void* old = HashMapInsert(&map, KeyValue(key, value));
+      CHECK((int64_t)(intptr_t)old == expected[key]);
+      if (expected[key] == 0) {
+        length++;
+      }
+      expected[key] = value;
+    }
+  }
+  CHECK(map.length == length);
+  for (int64_t key = 0; key < kNumKeys; key++) {
+    CHECK((int64_t)(intptr_t)HashMapFindInt64Key(&map, key) ==
+          expected[key]);
+  }
+  HashMapClear(&map);
+  CHECK(map.length == 0);
+  CHECK(HashMapFindInt64Key(&map, 1) == NULL);
+  HashMapDestruct(&map);
+}
+
+// When a group is full a removed key leaves a deleted slot, which lookups
+// have to probe past and inserts can reuse.
+static void TestDeletedSlots(void) {
+  HashMap map;
+  HashMapInit(&map, IdentityHash, EqualKeys);
+  HashMapReserve(&map, 20);
+  CHECK(map.capacity == 2 * kCoHashMapGroupSize);
+
+  // All of these start in group 0, so the last four overflow into group 1.
+  for (int64_t i = 0; i < 20; i++) {
+    HashMapInsert(&map, KeyValue(i, i + 100));
+  }
+  size_t growth_left = map.growth_left;
+  for (int64_t i = 0; i < 16; i++) {
+    CHECK((int64_t)(intptr_t)HashMapRemove(&map, Key(i)) == i + 100);
+  }
+  // Group 0 had no empty slot so nothing was given back.
+  CHECK(map.growth_left == growth_left);
+  CHECK(map.length == 4);
+  for (int64_t i = 0; i < 20; i++) {
+    CHECK((int64_t)(intptr_t)HashMapFindInt64Key(&map, i) ==
+          (i < 16 ? 0 : i + 100));
+  }
+
+  // Reinserting goes into the deleted slots without using up empty ones,
+  // and a key past them is replaced rather than duplicated.
+  for (int64_t i = 0; i < 16; i++) {
+    CHECK(HashMapInsert(&map, KeyValue(i, i + 200)) == NULL);
+  }
+  CHECK(map.growth_left == growth_left);
+  CHECK((int64_t)(intptr_t)HashMapInsert(&map, KeyValue(19, 300)) == 119);
+  CHECK(map.length == 20);
+  for (int64_t i = 0; i < 20; i++) {
+    CHECK((int64_t)(intptr_t)HashMapFindInt64Key(&map, i) ==
+          (i < 16 ? i + 200 : (i == 19 ? 300 : i + 100)));
+  }
+  HashMapDestruct(&map);
+}
+
+// A table whose empty slots have been used up by keys that were removed
+// again is rehashed at the same size rather than grown.
+static void TestSameSizeRehash(void) {
+  HashMap map;
+  HashMapInit(&map, IdentityHash, EqualKeys);
+  HashMapReserve(&map, 20);
+  size_t capacity = map.capacity;
+  CHECK(capacity == 2 * kCoHashMapGroupSize);
+
+  // Fill group 0 and empty it again, leaving it all deleted slots.
+  for (int64_t i = 0; i < kCoHashMapGroupSize; i++) {
+    HashMapInsert(&map, KeyValue(i, i + 1));
+  }
+  for (int64_t i = 0; i < kCoHashMapGroupSize; i++) {
+    HashMapRemove(&map, Key(i));
+  }
+  CHECK(map.length == 0);
+
+  // Keys starting in group 1 use up the rest of the empty slots.
+  int64_t group1 = 1 << 7;
+  int64_t n = 0;
+  while (map.growth_left > 0) {
+    HashMapInsert(&map, KeyValue(group1 + n, n + 1));
+    n++;
+  }
+  CHECK(map.length < capacity / 2);
+
+  // One more clears out the deleted slots without growing.
+  HashMapInsert(&map, KeyValue(group1 + n, n + 1));
+  n++;
+  CHECK(map.capacity == capacity);
+  CHECK(map.length == (size_t)n);
+  CHECK(map.growth_left > 0);
+  for (int64_t i = 0; i < n; i++) {
+    CHECK((int64_t)(intptr_t)HashMapFindInt64Key(&map, group1 + i) == i + 1);
+  }
+  for (int64_t i = 0; i < kCoHashMapGroupSize; i++) {
+    CHECK(HashMapFindInt64Key(&map, i) == NULL);
+  }
+  HashMapDestruct(&map);
+}
+
+static void CountValue(MapKeyValue* kv, void* data) {
+  *(int64_t*)data += kv->value.w;
+}
+
+static void TestStringKeys(void) {
+  HashMap map;
+  HashMapInitForCaseBlindCharPointerKeys(&map);
+  MapKeyValue kv;
+  kv.key.p = "Content-Length";
+  kv.value.w = 1;
+  CHECK(HashMapInsert(&map, kv) == NULL);
+  kv.key.p = "Host";
+  kv.value.w = 2;
+  CHECK(HashMapInsert(&map, kv) == NULL);
+  kv.key.p = "HOST";
+  kv.value.w = 4;
+  CHECK((intptr_t)HashMapInsert(&map, kv) == 2);
+  CHECK(map.length == 2);
+  MapKeyType key;
+  key.p = "content-length";
+  CHECK((intptr_t)HashMapFind(&map, key) == 1);
+  int64_t sum = 0;
+  HashMapTraverse(&map, CountValue, &sum);
+  CHECK(sum == 5);
+  CHECK((intptr_t)HashMapRemove(&map, key) == 1);
+  CHECK(HashMapFind(&map, key) == NULL);
+  CHECK(HashMapRemove(&map, key) == NULL);
+  HashMapDestruct(&map);
+}
+
+int main(int argc, const char* argv[]) {
+  TestAgainstArray();
+  TestDeletedSlots();
+  TestSameSizeRehash();
+  TestStringKeys();
+  return CheckResult("hashmap_test");
+}
@@ -0,0 +1,154 @@
+//
+//  http_test.c
+//  coroutines
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "check.h"
+#include "http.h"
+
+static HttpParseStatus Parse(HttpParser* p, const char* data) {
+  HttpParserInit(p);
+  return HttpParserParse(p, data, strlen(data));
+}
+
+static bool HeaderIs(HttpParser* p, const char* data, const char* name,
+                     const char* value) {
+  HttpSlice s;
+  return HttpParserFindHeader(p, data, name, &s) &&
+         HttpSliceEqual(data, s, value);
+}
+
+static void TestRequest(void) {
+  const char* data =
+      "GET /index.html HTTP/1.1\r\n"
+      "Host: example.com\r\n"
+      "X-Long-Header-Name-Past-Sixteen:   spaced value\t \r\n"
+      "Folded: first\r\n"
+      "  second\r\n"
+      "\r\n"
+      "GET /next HTTP/1.1\r\n";
+  HttpParser p;
+  CHECK(Parse(&p, data) == kCoHttpComplete);
+  CHECK(HttpSliceEqual(data, p.start[0], "GET"));
+  CHECK(HttpSliceEqual(data, p.start[1], "/index.html"));
+  CHECK(HttpSliceEqual(data, p.start[2], "HTTP/1.1"));
+  CHECK(p.num_headers == 3);
+  CHECK(HeaderIs(&p, data, "host", "example.com"));
+  CHECK(HeaderIs(&p, data, "x-long-header-name-past-sixteen",
+                 "spaced value"));
+  CHECK(HeaderIs(&p, data, "Folded", "first\r\n  second"));
+  HttpSlice s;
+  CHECK(!HttpParserFindHeader(&p, data, "Content-Length", &s));
+  // The pipelined request that follows isn't part of the header.
+  CHECK(p.length == strlen(data) - strlen("GET /next HTTP/1.1\r\n"));
+  // Parsing again once complete changes nothing.
+  CHECK(HttpParserParse(&p, data, strlen(data)) == kCoHttpComplete);
+}
+
+// However the header is split over reads, the result is the same.
+static void TestIncremental(void) {
+  const char* data =
+      "POST /form HTTP/1.0\r\n"
+      "Content-Length: 12\r\n"
+      "Content-Type: application/x-www-form-urlencoded\r\n"
+      "\r\n"
+      "body";
+  size_t header_length = strlen(data) - 4;
+  for (size_t split = 0; split < header_length; split++) {
+    HttpParser p;
+    HttpParserInit(&p);
+    CHECK(HttpParserParse(&p, data, split) == kCoHttpIncomplete);
+    CHECK(HttpParserParse(&p, data, strlen(data)) == kCoHttpComplete);
+    CHECK(p.length == header_length);
+    CHECK(p.num_headers == 2);
+    HttpSlice s;
+    CHECK(HttpParserFindHeader(&p, data, "CONTENT-LENGTH", &s) &&
+          HttpSliceToInt(data, s) == 12);
+  }
+  // One byte at a time.
+  HttpParser p;
+  HttpParserInit(&p);
+  HttpParseStatus status = kCoHttpIncomplete;
+  size_t n = 0;
+  while (status == kCoHttpIncomplete && n < strlen(data)) {
+    status = HttpParserParse(&p, data, ++n);
+  }
+  CHECK(status == kCoHttpComplete && n == header_length);
+}
+
+static void TestResponse(void) {
+  const char* data =
+      "HTTP/1.1 404 Not Found Here\n"
+      "Connection: close\n"
+      "\n";
+  HttpParser p;
+  CHECK(Parse(&p, data) == kCoHttpComplete);
+  CHECK(HttpSliceEqual(data, p.start[0], "HTTP/1.1"));
+  CHECK(HttpSliceToInt(data, p.start[1]) == 404);
+  CHECK(HttpSliceEqual(data, p.start[2], "Not Found Here"));
+  CHECK(HeaderIs(&p, data, "connection", "close"));
+  CHECK(p.length == strlen(data));
+
+  // The reason can be missing and blank lines before the start are skipped.
+  data = "\r\n\r\nHTTP/1.1 200\r\n\r\n";
+  CHECK(Parse(&p, data) == kCoHttpComplete);
+  CHECK(HttpSliceToInt(data, p.start[1]) == 200);
+  CHECK(p.start[2].length == 0);
+  CHECK(p.num_headers == 0);
+}
+
+static void TestInvalid(void) {
+  HttpParser p;
+  CHECK(Parse(&p, " GET / HTTP/1.1\r\n\r\n") == kCoHttpInvalid);
+  CHECK(Parse(&p, "GET\r\n\r\n") == kCoHttpInvalid);
+  CHECK(Parse(&p, "GET  HTTP/1.1\r\n\r\n") == kCoHttpInvalid);
+  CHECK(Parse(&p, "GET / HTTP/1.1\r\nNo colon\r\n\r\n") == kCoHttpInvalid);
+  CHECK(Parse(&p, "GET / HTTP/1.1\r\nBad name: x\r\n\r\n") ==
+        kCoHttpInvalid);
+  CHECK(Parse(&p, "GET / HTTP/1.1\r\n: x\r\n\r\n") == kCoHttpInvalid);
+  CHECK(Parse(&p, "GET / HTTP/1.1\r\n folded first\r\n\r\n") ==
+        kCoHttpInvalid);
+
+  // Too many headers.
+  char many[2048] = "GET / HTTP/1.1\r\n";
+  for (int i = 0; i <= kCoHttpMaxHeaders; i++) {
+    char line[32];
+    snprintf(line, sizeof(line), "H%d: %d\r\n", i, i);
+    strcat(many, line);
+  }
+  strcat(many, "\r\n");
+  CHECK(Parse(&p, many) == kCoHttpInvalid);
+
+  // A header that never ends.
+  size_t length = kCoHttpMaxHeaderSize + 100;
+  char* big = malloc(length + 1);
+  strcpy(big, "GET / HTTP/1.1\r\nX: ");
+  memset(big + strlen(big), 'x', length - strlen(big));
+  big[length] = '\0';
+  CHECK(Parse(&p, big) == kCoHttpInvalid);
+  free(big);
+}
+
+static void TestSlices(void) {
+  const char* data = "123 abc 9x 1234567890123456789";
+  CHECK(HttpSliceToInt(data, (HttpSlice){0, 3}) == 123);
+  CHECK(HttpSliceToInt(data, (HttpSlice){0, 0}) == -1);
+  CHECK(HttpSliceToInt(data, (HttpSlice){8, 2}) == -1);
+  CHECK(HttpSliceToInt(data, (HttpSlice){11, 18}) == 123456789012345678);
+  CHECK(HttpSliceToInt(data, (HttpSlice){11, 19}) == -1);
+  CHECK(HttpSliceEqual(data, (HttpSlice){4, 3}, "abc"));
+  CHECK(!HttpSliceEqual(data, (HttpSlice){4, 3}, "ABC"));
+  CHECK(HttpSliceCaseEqual(data, (HttpSlice){4, 3}, "ABC"));
+  CHECK(!HttpSliceCaseEqual(data, (HttpSlice){4, 3}, "ab"));
+}
+
+int main(int argc, const char* argv[]) {
+  TestRequest();
+  TestIncremental();
+  TestResponse();
+  TestInvalid();
+  TestSlices();
+  return CheckResult("http_test");
+}